@@ -0,0 +1,898 @@
+/*
+ * converting many pictures in one run of tga2cry
+ *
+ * Each job is one input file converted with one set of options: those
+ * given on the command line, followed by any given on the job's line of
+ * a list file ("manifest"). A line of a list file is just what would
+ * follow "tga2cry" on the command line for that job, e.g.
+ *
+ *	-resize 64,64 -f cry8 -o tex/wall64.cry art/wall.tga
+ *
+ * or just the input file name. The jobs are run by run_jobs(), -j at a
+ * time, each with its own Converter. An input file that several jobs
+ * use is read once, by a job of its own (decode_file()), and those jobs
+ * then convert the picture in memory (convert_decoded()); run_jobs()
+ * holds them back until it has been read, and the memory is freed when
+ * the last of them has finished.
+ *
+ * With -cache, each input is hashed first (see cache.c), and the jobs
+ * whose outputs are in the cache just fetch them; the others store
+ * their outputs there when they're done.
+ *
+ * When tga2cry --serve runs a batch for a client (see server.c),
+ * batch_serve() sends its messages to files that go back to the
+ * client, makes file names relative to the client's directory, and has
+ * every input read through the server's picture cache, so even an input
+ * only one job uses is read by a job of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tga2cry.h"
+#include "tgaproto.h"
+
+#define MAX_NAME	1024		/* longest file name */
+#define MAX_LINE	(MAX_NAME - 2)	/* longest list file line, not counting its end */
+#define MAX_PATH_NAME	(2 * MAX_NAME + 2)	/* room for a name in the client's directory */
+
+typedef struct {
+	char	*input;			/* the input file */
+	char	*path;			/* and its name in the client's directory (batch_serve()) */
+	char	**opts;			/* options of its own, after the command line's */
+	int	nopts;
+	char	*where;			/* "listfile:line", or NULL if from the command line */
+	char	*line;			/* the list file line, which input and opts point into */
+	int	in;			/* which of the inputs it is */
+	int	source;			/* the Source it is converted from, or -1 to read the file itself */
+	char	**outs;			/* the output files */
+	char	**labels;		/* what each output calls the picture */
+	int	nouts;
+	char	key[65];		/* its key in the cache, or "" */
+	int	cached;			/* found in the cache before starting */
+	int	hit;			/* and its outputs were taken from there */
+	long	width, height;		/* from the TGA header; 0 if it couldn't be read */
+	char	label[MAX_NAME];	/* what to call the job in messages */
+	double	seconds;		/* how long the conversion took */
+	int	failed;
+} Job;
+
+/* an input file */
+typedef struct {
+	char	*name;
+	int	jobs;			/* how many jobs use it */
+	int	users;			/* how many of them need to read it */
+	int	source;			/* its Source, or -1 */
+	uint8_t	digest[32];		/* hash of its contents, for the cache */
+	int	hashed;
+} Input;
+
+/* an input file read once for several jobs */
+typedef struct {
+	char	*input;
+	Pixel	*pix;
+	unsigned w, h;
+	int	users;			/* jobs still to use pix */
+	int	shared;			/* more than one job uses it */
+	int	failed;
+	double	seconds;		/* how long reading it took */
+} Source;
+
+struct Batch {
+	char	**opts;			/* the command line's options */
+	int	nopts;
+	Job	*jobs;
+	int	njobs, room;
+	Input	*inputs;
+	int	ninputs;
+	Source	*sources;
+	int	nsources;
+	int	quiet;
+	const char *cache_dir;		/* -cache, or NULL */
+	int	cache_link;		/* -cachelink */
+	const char *version;
+	char	*cache_path;		/* cache_dir in the client's directory */
+	FILE	*out, *err;		/* where the summary and the errors go */
+	const char *dir;		/* the client's directory, or NULL */
+	Picture_Cache *pictures;	/* the server's picture cache, or NULL */
+	int	plain;			/* just one file from the command line, and no cache:
+					   print what tga2cry would for it on its own */
+};
+
+/*
+ * say that there isn't enough memory, and return -1; a batch that runs
+ * out gives up rather than stopping the program, which may be a server
+ * with other batches to run
+ */
+static int
+no_memory(Batch *b)
+{
+	fprintf(b->err, "ERROR: insufficient memory\n");
+	return -1;
+}
+
+/* a copy of s, or NULL */
+static char *
+copy_name(const char *s)
+{
+	char *p;
+
+	p = (char *)malloc(strlen(s) + 1);
+	return p ? strcpy(p, s) : NULL;
+}
+
+/*
+ * opts[0..nopts-1] are the options common to every job (already
+ * checked); quiet is set if -quiet was one of them. Returns NULL if
+ * there isn't enough memory.
+ */
+Batch *
+batch_new(char **opts, int nopts, int quiet)
+{
+	Batch *b;
+
+	b = (Batch *)calloc(1, sizeof(Batch));
+	if (!b)
+		return NULL;
+	b->opts = opts;
+	b->nopts = nopts;
+	b->quiet = quiet;
+	b->out = stdout;
+	b->err = stderr;
+	return b;
+}
+
+/*
+ * run the batch for a client of tga2cry --serve: the summary goes to
+ * out and errors and warnings to err, relative file names are in the
+ * directory dir, and the inputs are read through the picture cache pc
+ */
+void
+batch_serve(Batch *b, FILE *out, FILE *err, const char *dir, Picture_Cache *pc)
+{
+	b->out = out;
+	b->err = err;
+	b->dir = dir;
+	b->pictures = pc;
+}
+
+/* the file "name", in the client's directory if need be; buf has room for MAX_PATH_NAME */
+static const char *
+in_dir(Batch *b, const char *name, char *buf)
+{
+	if (!b->dir || *name == '/')
+		return name;
+	sprintf(buf, "%.*s/%.*s", MAX_NAME, b->dir, MAX_NAME, name);
+	return buf;
+}
+
+/* the file "name" as the client would put it, for messages */
+static const char *
+shown(Batch *b, const char *name)
+{
+	size_t n;
+
+	if (!b->dir)
+		return name;
+	n = strlen(b->dir);
+	if (!strncmp(name, b->dir, n) && name[n] == '/')
+		return name + n + 1;
+	return name;
+}
+
+void
+batch_free(Batch *b)
+{
+	int i, k;
+
+	for (i = 0; i < b->njobs; i++) {
+		for (k = 0; k < b->jobs[i].nouts; k++) {
+			free(b->jobs[i].outs[k]);
+			free(b->jobs[i].labels[k]);
+		}
+		free(b->jobs[i].outs);
+		free(b->jobs[i].labels);
+		if (b->jobs[i].path != b->jobs[i].input)
+			free(b->jobs[i].path);
+		if (b->jobs[i].line) {
+			free(b->jobs[i].line);
+			free(b->jobs[i].opts);
+			free(b->jobs[i].where);
+		}
+	}
+	free(b->jobs);
+	free(b->inputs);
+	free(b->sources);
+	free(b->cache_path);
+	free(b);
+}
+
+/*
+ * apply n options from opts to cv; returns -1 if one of them is no good
+ */
+static int
+apply_options(Batch *b, Converter *cv, char **opts, int n)
+{
+	char buf[MAX_PATH_NAME];
+	const char *value;
+	int i, k;
+
+	for (i = 0; i < n; i += k + 1) {
+		value = i + 1 < n ? opts[i+1] : (char *)0;
+		if (value && !strcmp(opts[i], "-o"))
+			value = in_dir(b, value, buf);
+		k = converter_option(cv, opts[i] + 1, value);
+		if (k < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * a Converter set up for job j; NULL (with the message in err) if the
+ * options are no good, or there isn't enough memory
+ */
+static Converter *
+job_converter(Batch *b, Job *j, char *err)
+{
+	Converter *cv;
+
+	cv = converter_new();
+	if (!cv) {
+		strcpy(err, "ERROR: insufficient memory");
+		return NULL;
+	}
+	if (apply_options(b, cv, b->opts, b->nopts) < 0 || apply_options(b, cv, j->opts, j->nopts) < 0
+	    || converter_check(cv, j->path) < 0) {
+		strcpy(err, converter_error(cv));
+		converter_free(cv);
+		return NULL;
+	}
+	return cv;
+}
+
+/*
+ * add a job converting "input" with the nopts options at opts (which
+ * must stay around); "where" is the list file and line it came from,
+ * for messages. Returns -1 (having said why) if the options are no good,
+ * or there isn't enough memory.
+ */
+int
+batch_add(Batch *b, char *input, char **opts, int nopts, char *where)
+{
+	Converter *cv;
+	Job *j;
+	char err[300];
+	char buf[MAX_PATH_NAME];
+
+	if (b->njobs == b->room) {
+		j = (Job *)realloc(b->jobs, (b->room ? 2 * b->room : 16) * sizeof(Job));
+		if (!j)
+			return no_memory(b);
+		b->jobs = j;
+		b->room = b->room ? 2 * b->room : 16;
+	}
+	j = &b->jobs[b->njobs];
+	memset(j, 0, sizeof(Job));
+	j->input = input;
+	j->path = (char *)in_dir(b, input, buf);
+	if (j->path == buf && (j->path = copy_name(buf)) == NULL)
+		return no_memory(b);
+	j->opts = opts;
+	j->nopts = nopts;
+	j->where = where;
+	j->source = -1;
+	cv = job_converter(b, j, err);
+	if (!cv) {
+		fprintf(b->err, "%s: %s\n", where ? where : input, err);
+		if (j->path != input)
+			free(j->path);
+		return -1;
+	}
+	converter_free(cv);
+	b->njobs++;
+	return 0;
+}
+
+/* the next word of a list file line, or NULL; *end is set to just after it */
+static char *
+next_word(char *p, char **end)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (!*p)
+		return NULL;
+	*end = p;
+	while (**end && **end != ' ' && **end != '\t')
+		(*end)++;
+	return p;
+}
+
+/*
+ * add the jobs in listname, one per line: any options, then the input
+ * file name (the rest of the line, so it may contain spaces); returns
+ * -1 (having said why) if a line is no good, or there isn't enough
+ * memory
+ */
+int
+batch_read_list(Batch *b, const char *listname)
+{
+	FILE *f;
+	Converter *cv;
+	char line[MAX_LINE + 3];		/* room for "\r\n" and one character too many */
+	char value[MAX_NAME];
+	char where[MAX_NAME + 32];
+	char buf[MAX_PATH_NAME];
+	char *line_copy, *p, *q, *word, *val, *end, *vend, *where_copy;
+	char **opts, **new_opts;
+	int lineno, nopts, room, n;
+
+	f = fopen(in_dir(b, listname, buf), "r");
+	if (!f) {
+		fprintf(b->err, "%s: %s\n", listname, strerror(errno));
+		return -1;
+	}
+	lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		where_copy = NULL;
+		sprintf(where, "%.*s:%d", MAX_NAME, listname, lineno);
+		n = strlen(line);
+		if (n > 0 && line[n-1] == '\n')
+			n--;
+		if (n > 0 && line[n-1] == '\r')
+			n--;
+		if (n > MAX_LINE) {
+			fprintf(b->err, "%s: line too long (at most %d characters)\n", where, MAX_LINE);
+			fclose(f);
+			return -1;
+		}
+		for (q = line + strlen(line); q > line && (q[-1] == '\n' || q[-1] == '\r' || q[-1] == ' ' || q[-1] == '\t'); q--)
+			;
+		*q = 0;
+		opts = NULL;
+		nopts = room = 0;
+		cv = converter_new();			/* just to find how many values each option takes */
+		p = line_copy = copy_name(line);
+		if (!cv || !line_copy) {
+			if (cv)
+				converter_free(cv);
+			no_memory(b);
+			goto bad;
+		}
+		while ((word = next_word(p, &end)) != NULL && *word == '-') {
+			if (nopts + 2 > room) {
+				new_opts = (char **)realloc(opts, (room ? 2 * room : 8) * sizeof(char *));
+				if (!new_opts) {
+					no_memory(b);
+					break;
+				}
+				opts = new_opts;
+				room = room ? 2 * room : 8;
+			}
+			if (*end)
+				*end++ = 0;
+			if (!strcmp(word, "-j") || !strcmp(word, "-cache") || !strcmp(word, "-cachelink")) {
+				fprintf(b->err, "%s: %s can only be given on the command line\n", where, word);
+				break;
+			}
+			opts[nopts++] = word;
+			val = next_word(end, &vend);
+			if (val)
+				sprintf(value, "%.*s", (int)(vend - val), val);
+			n = converter_option(cv, word + 1, val ? value : (char *)0);
+			if (n < 0) {
+				fprintf(b->err, "%s: %s\n", where, converter_error(cv));
+				break;
+			}
+			if (n > 0) {
+				if (*vend)
+					*vend++ = 0;
+				opts[nopts++] = val;
+				end = vend;
+			}
+			p = end;
+		}
+		converter_free(cv);
+		if (word && *word == '-')
+			goto bad;			/* said why above */
+		if (!word) {
+			if (nopts > 0) {
+				fprintf(b->err, "%s: no input file given\n", where);
+				goto bad;
+			}
+			free(line_copy);			/* a blank line */
+			continue;
+		}
+		where_copy = copy_name(where);
+		if (!where_copy) {
+			no_memory(b);
+			goto bad;
+		}
+		if (batch_add(b, word, opts, nopts, where_copy) < 0)
+			goto bad;
+		b->jobs[b->njobs - 1].line = line_copy;
+	}
+	fclose(f);
+	return 0;
+
+bad:
+	free(where_copy);
+	free(opts);
+	free(line_copy);
+	fclose(f);
+	return -1;
+}
+
+/*
+ * get the size of a picture from its TGA header, so that the biggest
+ * pictures can be started first
+ */
+static void
+picture_size(const char *name, long *w, long *h)
+{
+	FILE *f;
+	unsigned char hdr[18];
+
+	*w = *h = 0;
+	f = fopen(name, "rb");
+	if (!f)
+		return;
+	if (fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr)) {
+		*w = hdr[12] | (hdr[13] << 8);
+		*h = hdr[14] | (hdr[15] << 8);
+	}
+	fclose(f);
+}
+
+/* for sorting the jobs by input file */
+static Job *sort_jobs;
+
+static int
+by_input(const void *a, const void *b)
+{
+	int r;
+
+	r = strcmp(sort_jobs[*(const int *)a].path, sort_jobs[*(const int *)b].path);
+	return r ? r : *(const int *)a - *(const int *)b;
+}
+
+/*
+ * list the different input files, and which one each job uses; returns
+ * -1 if there isn't enough memory
+ */
+static int
+group_inputs(Batch *b)
+{
+	int *order;
+	int i, k, first;
+
+	b->inputs = (Input *)calloc(b->njobs + 1, sizeof(Input));
+	order = (int *)malloc((b->njobs + 1) * sizeof(int));
+	if (!b->inputs || !order) {
+		free(order);
+		return no_memory(b);
+	}
+	for (i = 0; i < b->njobs; i++)
+		order[i] = i;
+	lock_shared();				/* a server may be running several batches */
+	sort_jobs = b->jobs;
+	qsort(order, b->njobs, sizeof(int), by_input);
+	unlock_shared();
+	for (first = 0; first < b->njobs; first = k) {
+		for (k = first + 1; k < b->njobs && !strcmp(b->jobs[order[k]].path, b->jobs[order[first]].path); k++)
+			;
+		b->inputs[b->ninputs].name = b->jobs[order[first]].path;
+		b->inputs[b->ninputs].jobs = k - first;
+		b->inputs[b->ninputs].source = -1;
+		for (i = first; i < k; i++)
+			b->jobs[order[i]].in = b->ninputs;
+		b->ninputs++;
+	}
+	free(order);
+	return 0;
+}
+
+static int
+uses_memlimit(char **opts, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!strcmp(opts[i], "-memlimit"))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * find the inputs that more than one job has to convert, to be read
+ * just once (or, when serving, every input, so that it goes through
+ * the picture cache); jobs with -memlimit read the file themselves, a
+ * band at a time, and jobs found in the cache don't need it at all;
+ * returns -1 if there isn't enough memory
+ */
+static int
+find_sources(Batch *b)
+{
+	Input *in;
+	int i, n;
+
+	b->sources = (Source *)calloc(b->ninputs + 1, sizeof(Source));
+	if (!b->sources)
+		return no_memory(b);
+	n = uses_memlimit(b->opts, b->nopts);
+	for (i = 0; i < b->njobs; i++) {
+		if (!n && !b->jobs[i].cached && !uses_memlimit(b->jobs[i].opts, b->jobs[i].nopts))
+			b->inputs[b->jobs[i].in].users++;
+	}
+	for (i = 0; i < b->njobs; i++) {
+		in = &b->inputs[b->jobs[i].in];
+		if (in->users < (b->pictures ? 1 : 2) || b->jobs[i].cached
+		    || uses_memlimit(b->jobs[i].opts, b->jobs[i].nopts))
+			continue;
+		if (in->source < 0) {
+			in->source = b->nsources++;
+			b->sources[in->source].input = in->name;
+			b->sources[in->source].users = in->users;
+			b->sources[in->source].shared = (in->users > 1);
+		}
+		b->jobs[i].source = in->source;
+	}
+	return 0;
+}
+
+/* for sorting the output names */
+typedef struct {
+	char	*name;
+	int	job;
+} Output;
+
+static int
+by_name(const void *a, const void *b)
+{
+	int r;
+
+	r = strcmp(((const Output *)a)->name, ((const Output *)b)->name);
+	return r ? r : ((const Output *)a)->job - ((const Output *)b)->job;
+}
+
+/*
+ * find the names of each job's outputs, give it its label, and make sure
+ * that no two jobs write the same file; returns -1 if they would (or
+ * there isn't enough memory)
+ */
+static int
+check_outputs(Batch *b)
+{
+	Converter *cv;
+	Output *out;
+	Job *j;
+	char **names, **labels;
+	char name[MAX_PATH_NAME];
+	char err[300];
+	int nout, i, k, r;
+
+	nout = 0;
+	for (i = 0; i < b->njobs; i++) {
+		j = &b->jobs[i];
+		cv = job_converter(b, j, err);
+		if (!cv)
+			return no_memory(b);		/* the options were checked by batch_add() */
+		for (k = 0; converter_output_name(cv, k, j->path, name, sizeof(name)) == 0; k++) {
+			names = (char **)realloc(j->outs, (k + 1) * sizeof(char *));
+			if (names)
+				j->outs = names;
+			labels = (char **)realloc(j->labels, (k + 1) * sizeof(char *));
+			if (labels)
+				j->labels = labels;
+			if (names && labels) {
+				j->outs[k] = copy_name(name);
+				j->labels[k] = strip_extension(name);	/* what the output calls the picture */
+			}
+			if (!names || !labels || !j->outs[k] || !j->labels[k]) {
+				if (names && labels) {
+					free(j->outs[k]);
+					free(j->labels[k]);
+				}
+				converter_free(cv);
+				return no_memory(b);
+			}
+			j->nouts++;
+		}
+		if (j->nouts == 0) {
+			fprintf(b->err, "%s: %s\n", j->where ? j->where : j->input, converter_error(cv));
+			converter_free(cv);
+			return -1;
+		}
+		converter_free(cv);
+		nout += j->nouts;
+		if (b->inputs[j->in].jobs > 1)
+			sprintf(j->label, "%.500s -> %.500s", j->input, shown(b, j->outs[0]));
+		else
+			sprintf(j->label, "%.1000s", j->input);
+	}
+
+	out = (Output *)malloc((nout + 1) * sizeof(Output));
+	if (!out)
+		return no_memory(b);
+	nout = 0;
+	for (i = 0; i < b->njobs; i++) {
+		for (k = 0; k < b->jobs[i].nouts; k++) {
+			out[nout].name = b->jobs[i].outs[k];
+			out[nout].job = i;
+			nout++;
+		}
+	}
+	qsort(out, nout, sizeof(Output), by_name);
+	r = 0;
+	for (i = 1; i < nout; i++) {
+		if (!strcmp(out[i].name, out[i-1].name)) {
+			fprintf(b->err, "ERROR: '%s' would be written by both %s and %s\n", shown(b, out[i].name),
+				b->jobs[out[i-1].job].where ? b->jobs[out[i-1].job].where : b->jobs[out[i-1].job].input,
+				b->jobs[out[i].job].where ? b->jobs[out[i].job].where : b->jobs[out[i].job].input);
+			r = -1;
+		}
+	}
+	free(out);
+	return r;
+}
+
+/*
+ * use the cache (-cache dir) for the outputs of the conversions
+ * of this batch; version is tga2cry's, which is part of the key, and if
+ * link is set, outputs are hard links to the cached files rather than
+ * copies of them
+ */
+void
+batch_cache(Batch *b, const char *dir, int link, const char *version)
+{
+	b->cache_dir = dir;
+	b->cache_link = link;
+	b->version = version;
+}
+
+/* run_jobs() function: hash an input file, for the cache */
+static void
+hash_job(void *arg, int worker, int k)
+{
+	Batch *b = (Batch *)arg;
+	Input *in = &b->inputs[k];
+
+	in->hashed = (hash_file(in->name, in->digest) == 0);
+}
+
+/*
+ * work out the cache key of each job, and whether its outputs are
+ * already in the cache; returns -1 if there isn't enough memory
+ */
+static int
+find_cached(Batch *b, int nthreads)
+{
+	Converter *cv;
+	Input *in;
+	Job *j;
+	char settings[1000], err[300];
+	int i, r;
+
+	run_jobs(nthreads, b->ninputs, (long *)0, (int *)0, hash_job, b);
+	for (i = 0; i < b->njobs; i++) {
+		j = &b->jobs[i];
+		in = &b->inputs[j->in];
+		if (!in->hashed)
+			continue;			/* it will fail when it's converted */
+		cv = job_converter(b, j, err);
+		if (!cv)
+			return no_memory(b);		/* the options were checked by batch_add() */
+		r = converter_settings(cv, settings, sizeof(settings));
+		converter_free(cv);
+		if (r < 0)
+			continue;			/* just don't cache it */
+		cache_key(j->key, in->digest, b->version, settings, j->labels, j->nouts);
+		j->cached = cache_has(b->cache_path, j->key, j->nouts);
+	}
+	return 0;
+}
+
+static void
+report_error(Batch *b, const char *label, const char *input, const char *err)
+{
+	if (b->plain || !strncmp(err, input, strlen(input)))	/* "file: reason" already */
+		fprintf(b->err, "%s\n", shown(b, err));
+	else
+		fprintf(b->err, "%s: %s\n", label, err);
+}
+
+/*
+ * run_jobs() function: jobs 0 to nsources-1 read the shared inputs,
+ * and the rest are the conversions
+ */
+static void
+batch_job(void *arg, int worker, int job)
+{
+	Batch *b = (Batch *)arg;
+	Converter *cv;
+	Source *s;
+	Job *j;
+	char err[300];
+	double start;
+	int r;
+
+	start = wall_clock();
+	if (job < b->nsources) {
+		s = &b->sources[job];
+		cv = converter_new();
+		if (!cv) {
+			s->failed = 1;
+			report_error(b, shown(b, s->input), s->input, "ERROR: insufficient memory");
+			s->seconds = wall_clock() - start;
+			return;
+		}
+		if (b->pictures)
+			r = picture_get(b->pictures, cv, s->input, &s->pix, &s->w, &s->h);
+		else
+			r = decode_file(cv, s->input, &s->pix, &s->w, &s->h);
+		if (r < 0) {
+			s->failed = 1;
+			report_error(b, shown(b, s->input), s->input, converter_error(cv));
+		}
+		converter_free(cv);
+		s->seconds = wall_clock() - start;
+		return;
+	}
+
+	j = &b->jobs[job - b->nsources];
+	if (j->cached && cache_fetch(b->cache_path, j->key, j->outs, j->nouts, b->cache_link) == 0) {
+		j->hit = 1;
+		j->seconds = wall_clock() - start;
+		return;
+	}
+	s = (j->source >= 0) ? &b->sources[j->source] : NULL;
+	if (s && s->failed) {
+		j->failed = 1;			/* already reported */
+		return;
+	}
+	if (b->cache_link) {
+		for (r = 0; r < j->nouts; r++)
+			remove(j->outs[r]);	/* it may be a link to a cached file, which mustn't be written over */
+	}
+	cv = job_converter(b, j, err);
+	if (!cv) {
+		j->failed = 1;			/* the options were checked by batch_add(), so it's memory */
+		report_error(b, j->label, j->path, err);
+	} else {
+		if (b->plain) {
+			converter_progress(cv, b->out);
+		} else {
+			converter_option(cv, "quiet", (char *)0);	/* progress from several pictures at once would be a jumble */
+			converter_label(cv, j->label);
+		}
+		converter_messages(cv, b->err);
+		if (s)
+			r = convert_decoded(cv, j->path, s->pix, s->w, s->h);
+		else
+			r = convert_file(cv, j->path);
+		if (r < 0) {
+			j->failed = 1;
+			report_error(b, j->label, j->path, converter_error(cv));
+		} else if (b->cache_dir && j->key[0]) {
+			cache_store(b->cache_path, j->key, j->outs, j->nouts, b->cache_link);
+		}
+		converter_free(cv);
+	}
+	j->seconds = wall_clock() - start;
+
+	if (s) {
+		lock_shared();
+		r = --s->users;
+		unlock_shared();
+		if (r == 0) {
+			if (b->pictures)
+				picture_release(b->pictures, s->pix);
+			else
+				free_decoded(s->pix);
+			s->pix = 0;
+		}
+	}
+}
+
+/*
+ * run all the jobs, nthreads at a time, and print the summary (except
+ * for a plain batch: one file from the command line, as the server
+ * gets from a makefile); returns the number that failed, or -1 if they
+ * couldn't be run at all
+ */
+int
+batch_run(Batch *b, int nthreads)
+{
+	long *cost;
+	int *after;
+	double start, seconds, mpix, total_mpix;
+	int i, ntasks, failed, hits;
+	char buf[MAX_PATH_NAME];
+	Job *j;
+
+	start = wall_clock();
+	b->plain = (b->njobs == 1 && !b->jobs[0].line && !b->cache_dir);
+	if (b->cache_dir) {
+		b->cache_path = copy_name(in_dir(b, b->cache_dir, buf));
+		if (!b->cache_path)
+			return no_memory(b);
+	}
+	if (group_inputs(b) < 0 || check_outputs(b) < 0)
+		return -1;
+	if (b->cache_dir && find_cached(b, nthreads) < 0)
+		return -1;
+	if (find_sources(b) < 0)
+		return -1;
+
+	/* the shared inputs first, as each conversion has to come after its input */
+	ntasks = b->nsources + b->njobs;
+	cost = (long *)malloc((ntasks + 1) * sizeof(long));
+	after = (int *)malloc((ntasks + 1) * sizeof(int));
+	if (!cost || !after) {
+		free(cost);
+		free(after);
+		return no_memory(b);
+	}
+	for (i = 0; i < b->njobs; i++) {
+		j = &b->jobs[i];
+		picture_size(j->path, &j->width, &j->height);
+		cost[b->nsources + i] = j->cached ? 0 : j->width * j->height;
+		after[b->nsources + i] = j->source;
+		if (j->source >= 0) {
+			cost[j->source] = j->width * j->height;
+			after[j->source] = -1;
+		}
+	}
+
+	run_jobs(nthreads, ntasks, cost, after, batch_job, b);
+	seconds = wall_clock() - start;
+	if (b->plain) {
+		free(cost);
+		free(after);
+		return b->jobs[0].failed;
+	}
+
+	failed = hits = 0;
+	total_mpix = 0;
+	for (i = 0; i < b->njobs; i++) {
+		j = &b->jobs[i];
+		mpix = j->width * j->height / 1e6;
+		if (j->failed) {
+			failed++;
+			if (!b->quiet)
+				fprintf(b->out, "%-24s FAILED\n", j->label);
+			continue;
+		}
+		total_mpix += mpix;
+		if (j->hit) {
+			hits++;
+			if (!b->quiet)
+				fprintf(b->out, "%-24s %5ld x %-5ld %8.3fs   from the cache\n", j->label, j->width, j->height, j->seconds);
+			continue;
+		}
+		if (!b->quiet)
+			fprintf(b->out, "%-24s %5ld x %-5ld %8.3fs %8.2f Mpixels/s\n", j->label, j->width, j->height,
+			       j->seconds, j->seconds > 0 ? mpix / j->seconds : 0.0);
+	}
+	if (!b->quiet) {
+		for (i = 0; i < b->nsources; i++) {
+			if (b->sources[i].shared && !b->sources[i].failed)
+				fprintf(b->out, "%-24s read once, in %.3fs\n", shown(b, b->sources[i].input), b->sources[i].seconds);
+		}
+		fprintf(b->out, "%d jobs", b->njobs);
+		if (failed)
+			fprintf(b->out, " (%d failed)", failed);
+		fprintf(b->out, ", %.2f Mpixels in %.3fs using %d jobs at once: %.2f Mpixels/s, %.1f jobs/s\n", total_mpix, seconds,
+		       nthreads < b->njobs ? nthreads : b->njobs,
+		       seconds > 0 ? total_mpix / seconds : 0.0, seconds > 0 ? (b->njobs - failed) / seconds : 0.0);
+		if (b->cache_dir)
+			fprintf(b->out, "cache %s: %d hits, %d misses (%.0f%% hit)\n", b->cache_dir, hits, b->njobs - failed - hits,
+			       b->njobs - failed > 0 ? 100.0 * hits / (b->njobs - failed) : 0.0);
+	}
+	free(cost);
+	free(after);
+	return failed;
+}
@@ -0,0 +1,547 @@
+/*
+ * the conversion cache (-cache dir), and the cache of decoded pictures
+ * kept by tga2cry --serve
+ *
+ * A conversion's outputs are stored under a key which is a SHA-256
+ * hash of everything that decides what they contain: the tga2cry
+ * version, the bytes of the input file, the settings the options come
+ * to (from converter_settings(), which leaves out those like -threads
+ * that make no difference to the output) and the label each output is
+ * given. Output i of the conversion with key k is kept
+ * as dir/kk/k.i, where kk is the first two digits of k, so that no one
+ * directory gets too big. When the same conversion comes round again,
+ * the stored files are copied (or, with -cachelink, hard linked) to
+ * the output names instead.
+ *
+ * Files are stored by writing them under a temporary name and renaming
+ * them into place, so several tga2cry processes can share a cache. An
+ * entry is only used if all of its outputs are there. Nothing is ever
+ * removed from the cache; delete the directory to empty it.
+ *
+ * The picture cache (see picture_get() below) is in memory, and lasts
+ * only as long as the server does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "tga2cry.h"
+#include "tgaproto.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#define make_dir(d)	_mkdir(d)
+#define hard_link(from, to) (CreateHardLinkA((to), (from), NULL) ? 0 : -1)
+#define process_id()	_getpid()
+#else
+#include <unistd.h>
+#define make_dir(d)	mkdir((d), 0777)
+#define hard_link(from, to) link((from), (to))
+#define process_id()	getpid()
+#endif
+
+/* the fraction of a second a file was last changed, where stat() says */
+#if defined(__APPLE__)
+#define mtime_ns(st)	((long)(st).st_mtimespec.tv_nsec)
+#elif defined(__linux__)
+#define mtime_ns(st)	((long)(st).st_mtim.tv_nsec)
+#else
+#define mtime_ns(st)	0L
+#endif
+
+#define CACHE_PATH	1100		/* room for dir/kk/key.i */
+
+/*
+ * SHA-256, as in FIPS 180-4
+ */
+typedef struct {
+	uint32_t h[8];
+	uint8_t	buf[64];
+	int	n;			/* bytes in buf */
+	uint64_t len;			/* bytes hashed so far */
+} Sha256;
+
+static const uint32_t sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha_block(Sha256 *s, const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t)p[4*i] << 24) | ((uint32_t)p[4*i+1] << 16) | ((uint32_t)p[4*i+2] << 8) | p[4*i+3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i-16] + (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3))
+			+ w[i-7] + (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10));
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void
+sha_init(Sha256 *s)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, h0, sizeof(h0));
+	s->n = 0;
+	s->len = 0;
+}
+
+static void
+sha_update(Sha256 *s, const void *data, size_t n)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	size_t k;
+
+	s->len += n;
+	while (n > 0) {
+		if (s->n == 0 && n >= 64) {
+			sha_block(s, p);
+			p += 64;
+			n -= 64;
+			continue;
+		}
+		k = 64 - s->n;
+		if (k > n)
+			k = n;
+		memcpy(s->buf + s->n, p, k);
+		s->n += (int)k;
+		p += k;
+		n -= k;
+		if (s->n == 64) {
+			sha_block(s, s->buf);
+			s->n = 0;
+		}
+	}
+}
+
+static void
+sha_final(Sha256 *s, uint8_t digest[32])
+{
+	uint64_t bits = s->len * 8;
+	uint8_t pad[8];
+	int i;
+
+	sha_update(s, "\x80", 1);
+	while (s->n != 56)
+		sha_update(s, "", 1);
+	for (i = 0; i < 8; i++)
+		pad[i] = (uint8_t)(bits >> (56 - 8*i));
+	sha_update(s, pad, 8);
+	for (i = 0; i < 32; i++)
+		digest[i] = (uint8_t)(s->h[i/4] >> (24 - 8*(i%4)));
+}
+
+/*
+ * hash the contents of file "name" into digest; returns -1 if it
+ * can't be read
+ */
+int
+hash_file(const char *name, uint8_t digest[32])
+{
+	Sha256 s;
+	FILE *f;
+	uint8_t buf[65536];
+	size_t n;
+	int err;
+
+	f = fopen(name, "rb");
+	if (!f)
+		return -1;
+	sha_init(&s);
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		sha_update(&s, buf, n);
+	err = ferror(f);
+	fclose(f);
+	if (err)
+		return -1;
+	sha_final(&s, digest);
+	return 0;
+}
+
+/* feed a string to the hash, with its terminating 0 so that "ab","c" differs from "a","bc" */
+static void
+sha_string(Sha256 *s, const char *str)
+{
+	sha_update(s, str, strlen(str) + 1);
+}
+
+/*
+ * work out the key (64 hex digits and a 0) of converting the input
+ * whose contents hash to "input", with the given version of tga2cry,
+ * the converter settings "settings", and outputs labelled
+ * labels[0..nout-1]
+ */
+void
+cache_key(char *key, const uint8_t input[32], const char *version, const char *settings, char **labels, int nout)
+{
+	Sha256 s;
+	uint8_t digest[32];
+	int i;
+
+	sha_init(&s);
+	sha_string(&s, "tga2cry");
+	sha_string(&s, version);
+	sha_update(&s, input, 32);
+	sha_string(&s, settings);
+	sha_string(&s, "outputs");
+	for (i = 0; i < nout; i++)
+		sha_string(&s, labels[i]);
+	sha_final(&s, digest);
+	for (i = 0; i < 32; i++)
+		sprintf(key + 2*i, "%02x", digest[i]);
+}
+
+/* the name of output i of the entry "key" */
+static void
+entry_name(char *path, const char *dir, const char *key, int i)
+{
+	sprintf(path, "%.1000s/%.2s/%s.%d", dir, key, key, i);
+}
+
+/*
+ * copy file "from" to "to"; returns -1 if it couldn't
+ */
+static int
+copy_file(const char *from, const char *to)
+{
+	FILE *in, *out;
+	char buf[65536];
+	size_t n;
+	int err;
+
+	in = fopen(from, "rb");
+	if (!in)
+		return -1;
+	out = fopen(to, "wb");
+	if (!out) {
+		fclose(in);
+		return -1;
+	}
+	err = 0;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, n, out) != n) {
+			err = 1;
+			break;
+		}
+	}
+	if (ferror(in))
+		err = 1;
+	fclose(in);
+	if (fclose(out) != 0)
+		err = 1;
+	if (err)
+		remove(to);
+	return err ? -1 : 0;
+}
+
+/* put a copy of (or a link to) "from" at "to", replacing anything there */
+static int
+place_file(const char *from, const char *to, int use_link)
+{
+	remove(to);
+	if (use_link && hard_link(from, to) == 0)
+		return 0;
+	return copy_file(from, to);
+}
+
+/*
+ * is there an entry with all nout outputs for "key"?
+ */
+int
+cache_has(const char *dir, const char *key, int nout)
+{
+	char path[CACHE_PATH];
+	FILE *f;
+	int i;
+
+	for (i = 0; i < nout; i++) {
+		entry_name(path, dir, key, i);
+		f = fopen(path, "rb");
+		if (!f)
+			return 0;
+		fclose(f);
+	}
+	return 1;
+}
+
+/*
+ * copy (or link) the stored outputs for "key" to outs[0..nout-1];
+ * returns -1 if they couldn't all be
+ */
+int
+cache_fetch(const char *dir, const char *key, char **outs, int nout, int use_link)
+{
+	char path[CACHE_PATH];
+	int i;
+
+	for (i = 0; i < nout; i++) {
+		entry_name(path, dir, key, i);
+		if (place_file(path, outs[i], use_link) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* numbers the temporary names of cache_store(), under lock_shared() */
+static unsigned long store_count;
+
+/*
+ * store outs[0..nout-1] as the entry for "key". Each call writes under
+ * temporary names of its own (even when tga2cry --serve is running
+ * several batches at once), so a half written file is never renamed
+ * into place. Failing to store is not an error, just a miss next time.
+ */
+void
+cache_store(const char *dir, const char *key, char **outs, int nout, int use_link)
+{
+	char path[CACHE_PATH], tmp[CACHE_PATH + 40];
+	unsigned long n;
+	int i;
+
+	lock_shared();
+	n = ++store_count;
+	unlock_shared();
+	sprintf(path, "%.1000s", dir);
+	make_dir(path);
+	sprintf(path, "%.1000s/%.2s", dir, key);
+	make_dir(path);
+	for (i = 0; i < nout; i++) {
+		entry_name(path, dir, key, i);
+		sprintf(tmp, "%s.tmp%ld.%lu", path, (long)process_id(), n);
+		if (place_file(outs[i], tmp, use_link) < 0)
+			return;
+		if (rename(tmp, path) != 0) {
+			remove(path);			/* rename() won't replace a file everywhere */
+			if (rename(tmp, path) != 0) {
+				remove(tmp);
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * The picture cache keeps the pictures read by decode_file(), so that
+ * a server converting the same file again (for another output size,
+ * or because the makefile asked for it twice) needn't read it again.
+ * A picture is known by its file name, and the size and time of last
+ * change that stat() gives, so a file that has been written since is
+ * read afresh. Pictures in use are kept; of the others, the ones used
+ * least recently are thrown out when the cache would go over its
+ * limit. The cache is shared by all the server's requests, so it is
+ * only looked at with lock_shared() held.
+ */
+typedef struct Picture {
+	struct Picture *next;
+	char	*name;
+	long	size;			/* what stat() said about the file */
+	long	mtime, mtime_ns;
+	Pixel	*pix;
+	unsigned w, h;
+	long	bytes;			/* the memory pix takes */
+	int	users;			/* picture_get()s not yet released */
+	unsigned long used;		/* when it was last asked for */
+} Picture;
+
+struct Picture_Cache {
+	Picture	*list;
+	long	limit;			/* bytes the pictures may take */
+	long	bytes;			/* and do */
+	unsigned long clock;
+	long	hits, misses;
+};
+
+/* a cache for up to "limit" bytes of pictures; NULL if out of memory */
+Picture_Cache *
+picture_cache_new(long limit)
+{
+	Picture_Cache *pc;
+
+	pc = (Picture_Cache *)calloc(1, sizeof(Picture_Cache));
+	if (pc)
+		pc->limit = limit;
+	return pc;
+}
+
+static void
+free_picture(Picture *p)
+{
+	free_decoded(p->pix);
+	free(p->name);
+	free(p);
+}
+
+/* throw out pictures not in use, least recently used first, until the cache fits */
+static void
+trim_pictures(Picture_Cache *pc)
+{
+	Picture **pp, **victim, *p;
+
+	while (pc->bytes > pc->limit) {
+		victim = NULL;
+		for (pp = &pc->list; *pp; pp = &(*pp)->next) {
+			if ((*pp)->users == 0 && (!victim || (*pp)->used < (*victim)->used))
+				victim = pp;
+		}
+		if (!victim)
+			return;
+		p = *victim;
+		*victim = p->next;
+		pc->bytes -= p->bytes;
+		free_picture(p);
+	}
+}
+
+/* the picture in the cache that is the file "name" as st describes it */
+static Picture *
+find_picture(Picture_Cache *pc, const char *name, const struct stat *st)
+{
+	Picture *p;
+
+	for (p = pc->list; p; p = p->next) {
+		if (!strcmp(p->name, name) && p->size == (long)st->st_size
+		    && p->mtime == (long)st->st_mtime && p->mtime_ns == mtime_ns(*st))
+			return p;
+	}
+	return NULL;
+}
+
+/*
+ * decode_file() for a server: give the picture in the file "name" from
+ * the cache if it's there, or read it with cv and keep it. The pixels
+ * must be handed back with picture_release().
+ */
+int
+picture_get(Picture_Cache *pc, Converter *cv, const char *name, Pixel **pix, unsigned *w, unsigned *h)
+{
+	struct stat st;
+	Picture *p;
+
+	if (stat(name, &st) != 0)
+		return decode_file(cv, name, pix, w, h);	/* for the error message */
+	lock_shared();
+	p = find_picture(pc, name, &st);
+	if (p) {
+		p->users++;
+		p->used = ++pc->clock;
+		pc->hits++;
+		*pix = p->pix;
+		*w = p->w;
+		*h = p->h;
+		unlock_shared();
+		return 0;
+	}
+	pc->misses++;
+	unlock_shared();
+
+	if (decode_file(cv, name, pix, w, h) < 0)
+		return -1;
+	lock_shared();
+	p = find_picture(pc, name, &st);
+	if (p) {				/* another request read it meanwhile */
+		free_decoded(*pix);
+		p->users++;
+		p->used = ++pc->clock;
+		*pix = p->pix;
+		unlock_shared();
+		return 0;
+	}
+	if ((long)*w * *h * (long)sizeof(Pixel) > pc->limit) {
+		unlock_shared();
+		return 0;			/* would push everything else out; picture_release() frees it */
+	}
+	p = (Picture *)calloc(1, sizeof(Picture));
+	if (p)
+		p->name = (char *)malloc(strlen(name) + 1);
+	if (!p || !p->name) {
+		free(p);
+		unlock_shared();
+		return 0;			/* not cached, so picture_release() will free it */
+	}
+	strcpy(p->name, name);
+	p->size = (long)st.st_size;
+	p->mtime = (long)st.st_mtime;
+	p->mtime_ns = mtime_ns(st);
+	p->pix = *pix;
+	p->w = *w;
+	p->h = *h;
+	p->bytes = (long)*w * *h * (long)sizeof(Pixel);
+	p->users = 1;
+	p->used = ++pc->clock;
+	p->next = pc->list;
+	pc->list = p;
+	pc->bytes += p->bytes;
+	trim_pictures(pc);
+	unlock_shared();
+	return 0;
+}
+
+/* hand back the pixels picture_get() gave */
+void
+picture_release(Picture_Cache *pc, Pixel *pix)
+{
+	Picture *p;
+
+	lock_shared();
+	for (p = pc->list; p; p = p->next) {
+		if (p->pix == pix) {
+			p->users--;
+			trim_pictures(pc);
+			unlock_shared();
+			return;
+		}
+	}
+	unlock_shared();
+	free_decoded(pix);
+}
+
+/* how the cache has done: hits and misses, and the memory it is using */
+void
+picture_cache_stats(Picture_Cache *pc, long *hits, long *misses, long *bytes)
+{
+	lock_shared();
+	*hits = pc->hits;
+	*misses = pc->misses;
+	*bytes = pc->bytes;
+	unlock_shared();
+}
+
+void
+picture_cache_free(Picture_Cache *pc)
+{
+	Picture *p;
+
+	while ((p = pc->list) != NULL) {
+		pc->list = p->next;
+		free_picture(p);
+	}
+	free(pc);
+}
@@ -0,0 +1,338 @@
+/*
+ * compressing the binary output as it is written (-compress)
+ *
+ * The data is split into blocks of COMPRESS_BLOCK bytes, each
+ * compressed on its own, so that several blocks can be compressed at
+ * once by different threads and so that the target can decompress
+ * any block without the ones before it. A batch of blocks is
+ * collected, compressed by run_threads(), and written out in order
+ * before compress_write() returns, so the conversion waits while each
+ * batch is compressed: the blocks of a batch are compressed at the
+ * same time as each other, not as the rest of the conversion.
+ *
+ * Nothing here stops the program: compress_open() returns NULL if
+ * there is not enough memory, and write errors are left in the Sink
+ * for the caller to find.
+ *
+ * The file starts with a 16 byte header (all values big endian):
+ *	dc.l	uncompressed size
+ *	dc.l	compressed size (of the blocks, not counting this header)
+ *	dc.w	method: 1 for RLE, 2 for LZSS
+ *	dc.w	0
+ *	dc.l	block size (uncompressed; the last block may be shorter)
+ * and each block is
+ *	dc.l	number of bytes of compressed data
+ *	dc.b	the compressed data, padded with a 0 byte to an even length
+ * The file is padded with zeros to a whole number of phrases.
+ *
+ * RLE works on words; each run starts with a control word n:
+ *	n < $8000	n words follow, to be copied as they are
+ *	n >= $8000	one word follows, to be repeated n - $8000 times
+ *
+ * LZSS works on bytes; before each group of 8 items comes a flag
+ * byte, read from the most significant bit down, with 1 meaning a
+ * literal byte follows and 0 meaning a 2 byte match follows:
+ *	ddddddddddddllll	copy l+3 bytes, starting d+1 bytes back
+ * so matches are 3 to 18 bytes long and up to 4096 bytes back. Matches
+ * never reach back past the start of the block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tgadefs.h"
+#include "tgaproto.h"
+
+#if __MSDOS__
+#include <alloc.h>
+#define my_malloc(x) farmalloc((long)(x))
+#define my_free(x) farfree(x)
+#else
+#define my_malloc(x) malloc(x)
+#define my_free(x) free(x)
+#endif
+
+#define COMPRESS_BLOCK	65536L
+#define COMPRESS_OUTMAX	(COMPRESS_BLOCK + COMPRESS_BLOCK/8 + 64)	/* worst case compressed block */
+
+#define RLE_MAXRUN	0x7fff
+#define LZ_WINDOW	4096
+#define LZ_MINMATCH	3
+#define LZ_MAXMATCH	18
+#define LZ_HASHBITS	12
+#define LZ_MAXCHAIN	64		/* how many earlier matches to try */
+
+struct Compressor {
+	Sink	*sink;
+	int	method;
+	int	nthreads;
+	int	nbuf;			/* blocks per batch */
+	uint8_t	*in;			/* the batch being collected */
+	uint8_t	*out;			/* compressed blocks, COMPRESS_OUTMAX bytes apart */
+	long	*outlen;		/* size of each compressed block */
+	int32_t	*prev;			/* LZSS hash chains, COMPRESS_BLOCK entries per thread */
+	long	fill;			/* bytes in the batch so far */
+	long	total;			/* uncompressed bytes so far */
+	long	written;		/* compressed bytes so far */
+	long	start;			/* where the header is in the file */
+};
+
+static void
+put32(uint8_t *p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/*
+ * word RLE; an odd last byte is treated as a word with a 0 low byte
+ */
+static long
+rle_block(const uint8_t *in, long n, uint8_t *out)
+{
+	long m, i, j, r;
+	uint8_t *o = out;
+
+#define WORD(k)	((in[2*(k)] << 8) | (2*(k)+1 < n ? in[2*(k)+1] : 0))
+	m = (n + 1) / 2;
+	i = 0;
+	while (i < m) {
+		for (r = 1; i + r < m && r < RLE_MAXRUN && WORD(i + r) == WORD(i); r++)
+			;
+		if (r >= 3) {
+			*o++ = (0x8000 | r) >> 8;
+			*o++ = r & 0xff;
+			*o++ = WORD(i) >> 8;
+			*o++ = WORD(i) & 0xff;
+			i += r;
+			continue;
+		}
+	/* a run of literal words, up to the next run of 3 or more */
+		for (j = i + 1; j < m && j - i < RLE_MAXRUN; j++) {
+			if (j + 2 < m && WORD(j) == WORD(j + 1) && WORD(j) == WORD(j + 2))
+				break;
+		}
+		*o++ = (j - i) >> 8;
+		*o++ = (j - i) & 0xff;
+		for (; i < j; i++) {
+			*o++ = WORD(i) >> 8;
+			*o++ = WORD(i) & 0xff;
+		}
+	}
+#undef WORD
+	return o - out;
+}
+
+/*
+ * LZSS with greedy parsing, finding matches through hash chains of
+ * the positions where each 3 byte string occurs; prev has room for a
+ * chain entry for each byte of the block
+ */
+#define LZ_HASH(p)	((((p)[0] << 8) ^ ((p)[1] << 4) ^ (p)[2]) & ((1 << LZ_HASHBITS) - 1))
+
+static long
+lzss_block(const uint8_t *in, long n, uint8_t *out, int32_t *prev)
+{
+	int32_t head[1 << LZ_HASHBITS];
+	uint8_t *o = out;
+	uint8_t *flags;			/* the current flag byte */
+	int nflags;			/* items it covers so far */
+	long pos, cand, len, best_len, best_dist, k, maxlen;
+	int chain;
+
+	for (k = 0; k < (1 << LZ_HASHBITS); k++)
+		head[k] = -1;
+
+	flags = o;
+	nflags = 8;
+	pos = 0;
+	while (pos < n) {
+		if (nflags == 8) {
+			flags = o++;
+			*flags = 0;
+			nflags = 0;
+		}
+		best_len = best_dist = 0;
+		maxlen = n - pos;
+		if (maxlen > LZ_MAXMATCH)
+			maxlen = LZ_MAXMATCH;
+		if (maxlen >= LZ_MINMATCH) {
+			cand = head[LZ_HASH(in + pos)];
+			for (chain = 0; cand >= 0 && pos - cand <= LZ_WINDOW && chain < LZ_MAXCHAIN; chain++) {
+				if (in[cand + best_len] == in[pos + best_len]) {
+					for (len = 0; len < maxlen && in[cand + len] == in[pos + len]; len++)
+						;
+					if (len > best_len) {
+						best_len = len;
+						best_dist = pos - cand;
+						if (len == maxlen)
+							break;
+					}
+				}
+				cand = prev[cand];
+			}
+		}
+		if (best_len >= LZ_MINMATCH) {
+			*o++ = (best_dist - 1) >> 4;
+			*o++ = (((best_dist - 1) & 0x0f) << 4) | (best_len - LZ_MINMATCH);
+		} else {
+			*flags |= 0x80 >> nflags;
+			*o++ = in[pos];
+			best_len = 1;
+		}
+		nflags++;
+		for (k = pos; k < pos + best_len; k++) {
+			if (k + LZ_MINMATCH <= n) {
+				prev[k] = head[LZ_HASH(in + k)];
+				head[LZ_HASH(in + k)] = k;
+			}
+		}
+		pos += best_len;
+	}
+	return o - out;
+}
+
+/* thread function: compress every count'th block of the batch */
+static void
+compress_blocks(void *arg, int index, int count)
+{
+	Compressor *c = (Compressor *)arg;
+	long b, n;
+
+	for (b = index; b * COMPRESS_BLOCK < c->fill; b += count) {
+		n = c->fill - b * COMPRESS_BLOCK;
+		if (n > COMPRESS_BLOCK)
+			n = COMPRESS_BLOCK;
+		if (c->method == COMPRESS_RLE)
+			c->outlen[b] = rle_block(c->in + b * COMPRESS_BLOCK, n, c->out + b * COMPRESS_OUTMAX);
+		else
+			c->outlen[b] = lzss_block(c->in + b * COMPRESS_BLOCK, n, c->out + b * COMPRESS_OUTMAX,
+						  c->prev + index * COMPRESS_BLOCK);
+	}
+}
+
+/* compress and write out the batch collected so far */
+static void
+compress_batch(Compressor *c)
+{
+	long b, nblocks;
+	uint8_t len[4];
+	static const uint8_t zero = 0;
+
+	if (c->fill == 0)
+		return;
+	nblocks = (c->fill + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+	run_threads(nblocks < c->nthreads ? (int)nblocks : c->nthreads, compress_blocks, c);
+	for (b = 0; b < nblocks; b++) {
+		put32(len, c->outlen[b]);
+		sink_write(c->sink, len, 4);
+		sink_write(c->sink, c->out + b * COMPRESS_OUTMAX, c->outlen[b]);
+		c->written += 4 + c->outlen[b];
+		if (c->outlen[b] & 1) {
+			sink_write(c->sink, &zero, 1);
+			c->written++;
+		}
+	}
+	c->total += c->fill;
+	c->fill = 0;
+}
+
+/*
+ * start writing compressed data to s with the given method
+ * (COMPRESS_RLE or COMPRESS_LZSS), using nthreads threads
+ * returns NULL if there is not enough memory
+ */
+Compressor *
+compress_open(Sink *s, int method, int nthreads)
+{
+	Compressor *c;
+	uint8_t hdr[16];
+
+	c = my_malloc(sizeof(Compressor));
+	if (!c)
+		return NULL;
+	c->sink = s;
+	c->method = method;
+	c->nthreads = nthreads > 0 ? nthreads : 1;
+	c->nbuf = c->nthreads;
+	c->in = my_malloc(COMPRESS_BLOCK * c->nbuf);
+	c->out = my_malloc(COMPRESS_OUTMAX * c->nbuf);
+	c->outlen = my_malloc(sizeof(long) * c->nbuf);
+	c->prev = (method == COMPRESS_LZSS) ? my_malloc(sizeof(int32_t) * COMPRESS_BLOCK * c->nthreads) : NULL;
+	if (!c->in || !c->out || !c->outlen || (method == COMPRESS_LZSS && !c->prev)) {
+		compress_free(c);
+		return NULL;
+	}
+	c->fill = c->total = c->written = 0;
+	c->start = sink_tell(s);
+	memset(hdr, 0, sizeof(hdr));
+	sink_write(s, hdr, sizeof(hdr));
+	return c;
+}
+
+/*
+ * add n bytes to the data to be compressed
+ */
+void
+compress_write(Compressor *c, const uint8_t *buf, long n)
+{
+	long k;
+
+	while (n > 0) {
+		k = COMPRESS_BLOCK * c->nbuf - c->fill;
+		if (k > n)
+			k = n;
+		memcpy(c->in + c->fill, buf, k);
+		c->fill += k;
+		buf += k;
+		n -= k;
+		if (c->fill == COMPRESS_BLOCK * c->nbuf)
+			compress_batch(c);
+	}
+}
+
+/*
+ * compress whatever is left, pad the file to a phrase, go back and
+ * fill in the header, and free c; returns the size of the
+ * compressed data, header and padding included
+ */
+long
+compress_close(Compressor *c)
+{
+	uint8_t hdr[16];
+	static const uint8_t pad[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	long size;
+
+	compress_batch(c);
+	size = 16 + c->written;
+	sink_write(c->sink, pad, (8 - (size & 7)) & 7);
+	memset(hdr, 0, sizeof(hdr));
+	put32(hdr, c->total);
+	put32(hdr+4, c->written);
+	hdr[8] = 0;
+	hdr[9] = c->method;
+	put32(hdr+12, COMPRESS_BLOCK);
+	sink_seek(c->sink, c->start, SEEK_SET);
+	sink_write(c->sink, hdr, sizeof(hdr));
+	sink_seek(c->sink, 0L, SEEK_END);
+	size += (8 - (size & 7)) & 7;
+
+	compress_free(c);
+	return size;
+}
+
+/*
+ * free c without writing anything more (when the conversion has
+ * failed part way)
+ */
+void
+compress_free(Compressor *c)
+{
+	if (c->in) my_free(c->in);
+	if (c->out) my_free(c->out);
+	if (c->outlen) my_free(c->outlen);
+	if (c->prev) my_free(c->prev);
+	my_free(c);
+}
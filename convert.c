@@ -0,0 +1,2872 @@
+/*
+ * libtga2cry: converting a 24 bit picture to Jaguar CRY or RGB data
+ *
+ * Everything about a conversion is kept in a Converter (see struct
+ * Converter below): converter_new() makes one with the default options,
+ * converter_option() sets them just as the tga2cry command line does,
+ * and then convert_file() converts a TGA file to the output files, or
+ * convert_pixels() converts a picture that is already in memory into
+ * a buffer. To convert one file in several ways, decode_file() reads
+ * it into memory once, and convert_decoded() converts that to the
+ * files convert_file() would have written. A Converter can be used for
+ * any number of pictures, one at a time; different Converters can be
+ * used by different threads at once.
+ *
+ * Nothing here stops the program. When something goes wrong part way
+ * through a conversion, fail() records a message in the Converter and
+ * longjmp()s back to convert_file() or convert_pixels(), which free
+ * whatever the conversion had allocated (which is why those things are
+ * kept in the Converter, rather than in local variables) and return -1;
+ * converter_error() gives the message. The conversion still prints its
+ * progress, and warnings, unless the "quiet" option is set; when
+ * several conversions share stderr, converter_label() names the one
+ * each warning is about, and converter_messages() and
+ * converter_progress() can send the warnings and the progress to other
+ * files instead.
+ */
+
+#if __MSDOS__
+#define my_malloc(x) farmalloc((long)(x))
+#define my_free(x) farfree(x)
+#include <conio.h>
+#include <alloc.h>
+#else
+#define my_malloc(x) malloc(x)
+#define my_free(x) free(x)
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <inttypes.h>
+#include "tga2cry.h"
+#include "tgaproto.h"
+
+#ifndef PATHMAX
+#define PATHMAX 256
+#endif
+#define MAX_MIPMAPS 16			/* enough to get a 65535 x 65535 picture down to 1 x 1 */
+#define MAX_OUTPUTS 16			/* most formats that -f can be given */
+
+
+#define NO		0
+#define YES		1
+
+/*
+ * the start of a row of an RLE file, and the state the decoder is in
+ * there, since a packet can run on into the next row (for -memlimit)
+ */
+typedef struct {
+	long	offset;			/* file position */
+	int	block_count;		/* decoder state */
+	int	dup_pixel_count;
+	char	tga_pixel[4];
+} Row_Start;
+
+#define OUTBUF_WORDS 16384		/* size of the binary output buffer */
+#define OUTBUF_TEXT 65536		/* size of the text output buffer */
+
+/*
+ * everything about converting one picture: the options, the picture
+ * itself, and the state of the output being written. Nothing else in
+ * the conversion changes, so separate Converters can convert different
+ * pictures at the same time, in different threads. Converting a picture
+ * leaves the options as they were, so that the next one can be
+ * converted with them.
+ */
+struct Converter {
+	/* the options */
+	int	quiet_flag;		/* Should we print lots of messages to screen? */
+	int	nodata_flag;		/* if output might not be in .data segment */
+	int	nozero_flag;		/* if only true 0 should result in a zero output */
+	int	hflip_flag;		/* if image should be flipped horizontally */
+	int	vflip_flag;		/* if image should be flipped vertically */
+	int	rotate_flag;		/* if image should be turned 90 degrees clockwise */
+	int	dither_flag;		/* if CRY conversion should use dithering */
+	int	header_flag;		/* if new style header should be used */
+	int	binary_flag;		/* if output file should be binary */
+	int	object_format;		/* if output should be an object file, its format */
+	int	c_flag;			/* if output should be C arrays */
+	int	compress_method;	/* how to compress the output, or 0 */
+	int	aspect_flag;		/* if aspect ratio should be preserved when scaling */
+	int	floatscale_flag;	/* if the floating point resampler should be used */
+	int	fastscale_flag;		/* if the planar SIMD resampler should be used */
+	int	linear_flag;		/* if resizing should be done in linear light */
+	int	varmod_flag;		/* if low bit of data should indicate RGB or CRY output */
+	int	filter_type;		/* flag for which kind of filter to use */
+	int	gray_threshold;		/* limit for converting gray maps */
+	int	gray_color;		/* color to be or'd in with CRY intensity */
+	int	contrast_min;		/* minimum value for contrast enhancement */
+	int	contrast_max;		/* maximum value for contrast enhancement */
+	double	contrast;		/* scaling for contrast */
+	int	rescale_w, rescale_h;	/* new size for image */
+	int	num_threads;		/* number of threads to use for resizing */
+	int	mip_levels;		/* number of mipmap levels to output */
+	long	mem_limit;		/* most memory to use for the picture, or 0 for no limit */
+	int	stripbits_mask;		/* for CRY: controls how many bits of intensity to strip off */
+	int	base_intensity;		/* for CRY: make intensities relative to this */
+	int	max_colors;		/* for palettes: controls max. number of colors to allocate from palette */
+	int	base_color;		/* for palettes: added to all pixel values output */
+	int	refine_iters;		/* for palettes: number of k-means passes to refine the palette */
+	int	crop_x, crop_y, crop_w, crop_h;	/* crop region, or 0,0,0,0 for no cropping */
+	int	opt_max_colors;		/* max_colors and rescale_w, _h as given, which */
+	int	opt_rescale_w, opt_rescale_h;	/* the conversion changes and release() puts back */
+
+	/* the outputs */
+	int	num_outputs;		/* number of formats to output */
+	int	out_format[MAX_OUTPUTS];	/* index in format_tab of each one */
+	char	*out_name[MAX_OUTPUTS];	/* output file name of each one (our own copy), or NULL for the default */
+	int	num_out_names;		/* number of -o options given */
+	char	*def_name[MAX_OUTPUTS];	/* default output file names for this picture */
+
+	/* the output being written */
+	int	data_type;		/* if new data should be CRY or RGB format */
+	int	bit_colors;		/* for palettes: gives the limit for max_colors */
+	int	num_colors;		/* for palettes: gives number of colors actually in the palette */
+	Palette_Entry palette[256];	/* here is the palette */
+	char	*outfilename;		/* output file name */
+	char	*picname;		/* name of image to be printed in file */
+	FILE	*outhandle;		/* output file pointer, if writing to a file */
+	Sink	sink;			/* where the output goes */
+
+	/* the picture */
+	Pixel	*srcfile;		/* buffer holding loaded file */
+	Pixel	*newdata;		/* address of beginning of TGA data */
+	Pixel	*cur_row;		/* row being converted; the next row follows it */
+	uint8_t	*row_values;		/* its palette indices, for the 4 and 1 bit formats */
+	unsigned int image_w;		/* width of image in pixels from TGA header */
+	unsigned int image_h;		/* height of image in pixels from TGA header */
+	int	bits_per_pixel;		/* bits per pixel from TGA file header */
+	int	bytes_in_name;		/* bytes in filename at end of TGA header */
+	int	tga_flags;		/* TGA file flags */
+	int	cmap_type;		/* color map type */
+	int	sub_type;		/* TGA file sub type */
+	int	cmap_len;		/* length of color map */
+	int	flip_y;			/* vflip_flag, reversed if the picture is stored bottom-up */
+
+	/* reading the file; both counts must be init to 0 */
+	int	block_count;		/* # of pixels remaining in RLE block */
+	int	dup_pixel_count;	/* # of times to duplicate previous pixel */
+	void	(*read_pixel)(Converter *cv, FILE *fhandle, Pixel *place);
+	char	tga_pixel[4];
+	FILE	*in_handle;		/* the file being read */
+	const Pixel *mem_pixels;	/* or the next pixel of a picture in memory */
+
+	/* reading it a row at a time, for -memlimit */
+	FILE	*src_handle;		/* the input file */
+	unsigned src_w, src_h;		/* size of the picture in the file */
+	unsigned src_x0, src_y0;	/* crop offset */
+	unsigned src_cw;		/* width after cropping */
+	long	src_start;		/* file position of the first pixel */
+	Row_Start *src_index;		/* start of each row, for RLE files */
+	Pixel	*src_buf;		/* a whole row of the file */
+
+	/* output buffering (see output_flush()) */
+	int	items_per_line;		/* count words per line in new file */
+	long	binary_file_size;	/* size of output binary file (we round to a phrase boundary) */
+	int	binary_bit_size;	/* for counting bits of a fractional byte */
+	int	bit_buffer;		/* bit buffer for 1 bit at a time MSK output */
+	uint16_t out_words[OUTBUF_WORDS];	/* words waiting to be written */
+	uint8_t	out_bytes[2*OUTBUF_WORDS];	/* the same, in big endian order */
+	int	out_nwords;		/* number of words in out_words */
+	int	out_odd_byte;		/* a byte waiting for its partner, or -1 */
+	char	out_text[OUTBUF_TEXT];	/* text waiting to be written */
+	int	out_tlen;		/* number of characters in out_text */
+	int	c_elem_size;		/* bytes per C array element */
+	Compressor *compressor;		/* for -compress */
+
+	/* working memory, freed by release() if the conversion fails */
+	Resizer	*resizer;		/* for resizing a row at a time */
+	Pixel	*window;		/* current and next rows, when streaming */
+	Pixel	*nextdata;		/* next mipmap level */
+	Histogram *hist;		/* for building the palette a row at a time */
+	uint8_t	*packed;		/* a row of pixels packed into bytes */
+	Pixel	*copy;			/* rows copied from newdata, for dithering */
+
+	/* errors (see fail()) */
+	char	*label;			/* put before warnings (converter_label()) */
+	FILE	*messages;		/* where warnings go, if not stderr */
+	FILE	*progress;		/* where progress goes, if not stdout */
+	jmp_buf	jmp;			/* where to go back to */
+	char	error[256];		/* what went wrong */
+};
+
+extern unsigned char cry[];		/* cry lookup table */
+extern unsigned short cryred[],crygreen[],cryblue[];	/* lookup tables for cry->rgb conversion */
+
+/* constants for data_type */
+#define CRY16		0
+#define RGB16		1
+#define RGB24		2
+#define MSK		3
+#define GRAY		4
+#define GLASS		5
+#define CRY8		6
+#define RGB8		7
+#define CRY4		8
+#define RGB4		9
+#define CRY1		10
+#define RGB1		11
+
+/* output formats that the "f" option understands */
+static struct {
+	char	*name;
+	int	type;			/* data_type */
+	int	colors;			/* palette size, or 0 if not a palette format */
+	char	*ext;			/* default extension for the output file */
+} format_tab[] = {
+	{ "cry",	CRY16,	0,	".cry" },
+	{ "cry16",	CRY16,	0,	".cry" },
+	{ "cry8",	CRY8,	256,	".cr8" },
+	{ "cry4",	CRY4,	16,	".cr4" },
+	{ "cry1",	CRY1,	2,	".cr1" },
+	{ "rgb",	RGB16,	0,	".rgb" },
+	{ "rgb16",	RGB16,	0,	".rgb" },
+	{ "rgb8",	RGB8,	256,	".rg8" },
+	{ "rgb4",	RGB4,	16,	".rg4" },
+	{ "rgb1",	RGB1,	2,	".rg1" },
+	{ "rgb24",	RGB24,	0,	".rgb" },
+	{ "msk",	MSK,	0,	".msk" },
+	{ "gray",	GRAY,	0,	".cry" },
+	{ "glass",	GLASS,	0,	".cry" },
+	{ 0,		0,	0,	0 }
+};
+
+
+/*
+ * make a new Converter, with all the options set to their defaults
+ * returns NULL if there is not enough memory
+ */
+Converter *
+converter_new(void)
+{
+	Converter *cv;
+
+	cv = my_malloc(sizeof(Converter));
+	if (!cv)
+		return NULL;
+	memset(cv, 0, sizeof(Converter));
+	cv->data_type = CRY16;			/* default is to write 16 bit CRY data */
+	cv->hflip_flag = NO;							/* default option is no hflip */
+	cv->vflip_flag = NO;							/* default option is no vflip */
+	cv->rotate_flag = NO;
+	cv->dither_flag = NO;
+	cv->header_flag = NO;
+	cv->filter_type = FILTER_MITCH;
+	cv->aspect_flag = NO;
+	cv->floatscale_flag = NO;
+	cv->fastscale_flag = NO;
+	cv->linear_flag = NO;
+	cv->quiet_flag = NO;
+	cv->nodata_flag = NO;
+	cv->varmod_flag = NO;
+	cv->rescale_w = cv->rescale_h = 0;
+	cv->num_threads = 1;
+	cv->mip_levels = 1;
+	cv->mem_limit = 0;
+	cv->object_format = 0;
+	cv->c_flag = NO;
+	cv->compress_method = 0;
+	cv->crop_x = cv->crop_y = cv->crop_w = cv->crop_h = 0;
+	cv->gray_threshold = cv->gray_color = 0;
+	cv->contrast_min = 0;
+	cv->contrast_max = 255;
+	cv->stripbits_mask = 0xff;
+	cv->base_intensity = 0;			/* indicates no base, i.e. output raw intensities */
+	cv->max_colors = cv->bit_colors = 0;		/* indicates unlimited colors */
+	cv->base_color = 0;
+	cv->refine_iters = 0;
+	cv->out_odd_byte = -1;
+	return cv;
+}
+
+void
+converter_free(Converter *cv)
+{
+	int i;
+
+	for (i = 0; i < cv->num_out_names; i++)
+		my_free(cv->out_name[i]);
+	if (cv->label)
+		my_free(cv->label);
+	my_free(cv);
+}
+
+static char *
+copy_string(const char *str)
+{
+	char *s;
+
+	s = my_malloc(strlen(str) + 1);
+	if (s)
+		strcpy(s, str);
+	return s;
+}
+
+/*
+ * the message for the last thing that went wrong
+ */
+const char *
+converter_error(Converter *cv)
+{
+	return cv->error;
+}
+
+/*
+ * record an error; returns -1, for the functions that return it
+ */
+static int
+set_error(Converter *cv, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(cv->error, sizeof(cv->error), fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+/*
+ * set the label put before the warnings from cv's conversions (such as
+ * the name of the file being converted), or remove it if label is NULL
+ */
+int
+converter_label(Converter *cv, const char *label)
+{
+	if (cv->label)
+		my_free(cv->label);
+	cv->label = NULL;
+	if (!label)
+		return 0;
+	cv->label = copy_string(label);
+	return cv->label ? 0 : set_error(cv, "ERROR: insufficient memory");
+}
+
+/*
+ * send cv's warnings to f, or back to stderr if f is NULL
+ */
+void
+converter_messages(Converter *cv, FILE *f)
+{
+	cv->messages = f;
+}
+
+/*
+ * send cv's progress messages to f, or back to stdout if f is NULL
+ */
+void
+converter_progress(Converter *cv, FILE *f)
+{
+	cv->progress = f;
+}
+
+/* where cv's progress messages go */
+static FILE *
+progress_file(Converter *cv)
+{
+	return cv->progress ? cv->progress : stdout;
+}
+
+/*
+ * print a warning about cv's conversion, after its label if it has one
+ */
+void
+warning(Converter *cv, const char *fmt, ...)
+{
+	char msg[300];
+	FILE *f;
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	f = cv->messages ? cv->messages : stderr;
+	if (cv->label)
+		fprintf(f, "%s: Warning: %s\n", cv->label, msg);
+	else
+		fprintf(f, "Warning: %s\n", msg);
+}
+
+/*
+ * give up on the conversion: record the error and go back to
+ * convert_file() or convert_pixels()
+ */
+static void
+fail(Converter *cv, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(cv->error, sizeof(cv->error), fmt, ap);
+	va_end(ap);
+	longjmp(cv->jmp, 1);
+}
+
+/*
+ * set an option; "name" is a command line option without its '-', and
+ * "value" its argument (ignored by options that don't take one)
+ * returns how many arguments were used (0 or 1), or -1 if the option
+ * or its value is invalid
+ */
+int
+converter_option(Converter *cv, const char *name, const char *value)
+{
+	const char *s, *t;
+	size_t len;
+	int i;
+
+	if (!strcmp(name, "binary")) {
+		cv->binary_flag = YES;
+	} else if (!strcmp(name, "c")) {
+		cv->c_flag = YES;
+		cv->binary_flag = YES;		/* the arrays are made from the binary output */
+	} else if (!strcmp(name, "quiet")) {
+		cv->quiet_flag = YES;
+	} else if (!strcmp(name, "dither")) {
+		cv->dither_flag = YES;
+	} else if (!strcmp(name, "header")) {
+		cv->header_flag = YES;
+	} else if (!strcmp(name, "nodata")) {
+		cv->nodata_flag = YES;
+	} else if (!strcmp(name, "hflip")) {
+		cv->hflip_flag = YES;
+	} else if (!strcmp(name, "vflip")) {
+		cv->vflip_flag = YES;
+	} else if (!strcmp(name, "rotate")) {
+		cv->rotate_flag = YES;
+	} else if (!strcmp(name, "nozero")) {
+		cv->nozero_flag = YES;
+	} else if (!strcmp(name, "aspect")) {
+		cv->aspect_flag = YES;
+	} else if (!strcmp(name, "floatscale")) {
+		cv->floatscale_flag = YES;
+	} else if (!strcmp(name, "fastscale")) {
+		cv->fastscale_flag = YES;
+	} else if (!strcmp(name, "linear")) {
+		cv->linear_flag = YES;
+	} else if (!strcmp(name, "glimit")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-glimit' flag");
+		if (sscanf(value, "%i", &cv->gray_threshold) != 1)
+			return set_error(cv, "Invalid argument given for '-glimit' flag");
+		return 1;
+	} else if (!strcmp(name, "stripbits")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-stripbits' flag");
+		if (sscanf(value, "%i", &cv->stripbits_mask) != 1)
+			return set_error(cv, "Invalid argument given for '-stripbits' flag");
+		cv->stripbits_mask = ~((1 << cv->stripbits_mask) - 1);
+		return 1;
+	} else if (!strcmp(name, "relative")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-relative' flag");
+		if (sscanf(value, "%i", &cv->base_intensity) != 1)
+			return set_error(cv, "Invalid argument given for '-relative' flag");
+		return 1;
+	} else if (!strcmp(name, "maxcolors")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-maxcolors' flag");
+		if (sscanf(value, "%i", &cv->max_colors) != 1)
+			return set_error(cv, "Invalid argument given for '-maxcolors' flag");
+		return 1;
+	} else if (!strcmp(name, "basecolor")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-basecolor' flag");
+		if (sscanf(value, "%i", &cv->base_color) != 1)
+			return set_error(cv, "Invalid argument given for '-basecolor' flag");
+		return 1;
+	} else if (!strcmp(name, "refine")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-refine' flag");
+		if (sscanf(value, "%i", &cv->refine_iters) != 1 || cv->refine_iters < 0)
+			return set_error(cv, "Invalid argument given for '-refine' flag");
+		return 1;
+	} else if (!strcmp(name, "gcolor")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-gcolor' flag");
+		if (sscanf(value, "%i", &cv->gray_color) != 1)
+			return set_error(cv, "Invalid argument given for '-gcolor' flag");
+		cv->gray_color = cv->gray_color << 8;
+		return 1;
+	} else if (!strcmp(name, "resize")) {
+		if (!value)
+			return set_error(cv, "No arguments given for '-resize' flag");
+		if (sscanf(value, "%i,%i", &cv->rescale_w, &cv->rescale_h) != 2)
+			return set_error(cv, "Invalid argument(s) given for '-resize' flag");
+		return 1;
+	} else if (!strcmp(name, "threads")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-threads' flag");
+		if (sscanf(value, "%i", &cv->num_threads) != 1 || cv->num_threads < 0)
+			return set_error(cv, "Invalid argument given for '-threads' flag");
+		if (cv->num_threads == 0)
+			cv->num_threads = cpu_count();
+		return 1;
+	} else if (!strcmp(name, "mipmaps")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-mipmaps' flag");
+		if (sscanf(value, "%i", &cv->mip_levels) != 1 || cv->mip_levels < 1 || cv->mip_levels > MAX_MIPMAPS)
+			return set_error(cv, "Invalid argument given for '-mipmaps' flag");
+		return 1;
+	} else if (!strcmp(name, "memlimit")) {
+		if (!value)
+			return set_error(cv, "No argument given for '-memlimit' flag");
+		if (sscanf(value, "%ld", &cv->mem_limit) != 1 || cv->mem_limit < 1)
+			return set_error(cv, "Invalid argument given for '-memlimit' flag");
+		if (cv->mem_limit > LONG_MAX / (1024L * 1024L))	/* long may be 32 bits */
+			return set_error(cv, "-memlimit can be at most %ld megabytes", LONG_MAX / (1024L * 1024L));
+		cv->mem_limit *= 1024L * 1024L;
+		return 1;
+	} else if (!strcmp(name, "object")) {
+		if (!value)
+			return set_error(cv, "No object file format given");
+		if (!strcmp(value, "aout")) {
+			cv->object_format = OBJECT_AOUT;
+		} else if (!strcmp(value, "elf")) {
+			cv->object_format = OBJECT_ELF;
+		} else {
+			return set_error(cv, "Invalid object file format specified");
+		}
+		cv->binary_flag = YES;		/* the object holds the binary output */
+		return 1;
+	} else if (!strcmp(name, "compress")) {
+		if (!value)
+			return set_error(cv, "No compression method given");
+		if (!strcmp(value, "rle")) {
+			cv->compress_method = COMPRESS_RLE;
+		} else if (!strcmp(value, "lzss")) {
+			cv->compress_method = COMPRESS_LZSS;
+		} else {
+			return set_error(cv, "Invalid compression method specified");
+		}
+		cv->binary_flag = YES;		/* what gets compressed is the binary output */
+		return 1;
+	} else if (!strcmp(name, "crop")) {
+		if (!value)
+			return set_error(cv, "No arguments given for '-crop' flag");
+		if (sscanf(value, "%i,%i,%i,%i", &cv->crop_x, &cv->crop_y, &cv->crop_w, &cv->crop_h) != 4)
+			return set_error(cv, "Invalid argument(s) given for '-crop' flag");
+		return 1;
+	} else if (!strcmp(name, "gcontrast")) {
+		if (!value)
+			return set_error(cv, "No arguments given for '-gcontrast' flag");
+		if (sscanf(value, "%i,%i", &cv->contrast_min, &cv->contrast_max) != 2)
+			return set_error(cv, "Invalid argument(s) given for '-gcontrast' flag");
+		return 1;
+	} else if (!strcmp(name, "f")) {
+		if (!value)
+			return set_error(cv, "No format type specified");
+		cv->num_outputs = 0;
+		for (s = value; ; s = t + 1) {
+			t = strchr(s, ',');
+			len = t ? (size_t)(t - s) : strlen(s);
+			for (i = 0; format_tab[i].name; i++) {
+				if (strlen(format_tab[i].name) == len && !strncmp(s, format_tab[i].name, len))
+					break;
+			}
+			if (!format_tab[i].name)
+				return set_error(cv, "Invalid format given with '-f' flag");
+			if (cv->num_outputs == MAX_OUTPUTS)
+				return set_error(cv, "Too many formats given with '-f' flag");
+			cv->out_format[cv->num_outputs++] = i;
+			if (!t)
+				break;
+		}
+		return 1;
+	} else if (!strcmp(name, "filter")) {
+		if (!value)
+			return set_error(cv, "No filter type given");
+		if (!strcmp(value, "box")) {
+			cv->filter_type = FILTER_BOX;
+		} else if (!strcmp(value, "bell")) {
+			cv->filter_type = FILTER_BELL;
+		} else if (!strcmp(value, "lanc")) {
+			cv->filter_type = FILTER_LANC;
+		} else if (!strcmp(value, "tri")) {
+			cv->filter_type = FILTER_TRI;
+		} else if (!strcmp(value, "sinc")) {
+			cv->filter_type = FILTER_SINC;
+		} else if (!strcmp(value, "mitch")) {
+			cv->filter_type = FILTER_MITCH;
+		} else {
+			return set_error(cv, "Invalid filter type specified");
+		}
+		return 1;
+	} else if (!strcmp(name, "o")) {
+		if (!value)
+			return set_error(cv, "No output file name given with '-o'");
+		if (cv->num_out_names == MAX_OUTPUTS)
+			return set_error(cv, "Too many '-o' options given");
+		cv->out_name[cv->num_out_names] = copy_string(value);
+		if (!cv->out_name[cv->num_out_names])
+			return set_error(cv, "ERROR: insufficient memory");
+		cv->num_out_names++;
+		return 1;
+	} else {
+		return set_error(cv, "Illegal option given: '-%s'", name);
+	}
+	return 0;
+}
+
+/*
+ * name of output i, for the picture in "infile" (or NULL, if it comes
+ * from memory, when the name is only used for the symbol); the name is
+ * allocated, or NULL if there is not enough memory
+ */
+static char *
+output_name(Converter *cv, int i, const char *infile)
+{
+	const char *ext;
+
+	if (cv->out_name[i] || !infile)
+		return copy_string(cv->out_name[i] ? cv->out_name[i] : "picture");
+	if (cv->object_format)
+		ext = ".o";
+	else if (cv->c_flag)
+		ext = ".h";
+	else
+		ext = format_tab[cv->out_format[i]].ext;
+	return change_extension(infile, ext);
+}
+
+/*
+ * put the name of output i (from 0) for infile in the size bytes at
+ * buf; returns -1 if there is no output i, or the name won't fit
+ */
+int
+converter_output_name(Converter *cv, int i, const char *infile, char *buf, int size)
+{
+	char *name;
+	int r;
+
+	if (i < 0 || i >= (cv->num_outputs ? cv->num_outputs : 1))
+		return set_error(cv, "ERROR: there is no output %d", i);
+	name = output_name(cv, i, infile);
+	if (!name)
+		return set_error(cv, "ERROR: insufficient memory");
+	r = (strlen(name) < (size_t)size) ? 0 : set_error(cv, "ERROR: output name too long");
+	if (r == 0)
+		strcpy(buf, name);
+	my_free(name);
+	return r;
+}
+
+/*
+ * put a description of the options that decide what cv writes in the
+ * size bytes at buf: all of them but -quiet, -threads and the output
+ * names, as their values rather than as they were typed, so that
+ * options that come to the same thing are described the same way.
+ * Returns -1 if it won't fit.
+ */
+int
+converter_settings(Converter *cv, char *buf, int size)
+{
+	int i, n;
+
+	n = snprintf(buf, size, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d "
+		"%d %d %d %ld %d %d %d %d %d %d %d formats",
+		cv->nodata_flag, cv->nozero_flag, cv->hflip_flag, cv->vflip_flag, cv->rotate_flag,
+		cv->dither_flag, cv->header_flag, cv->binary_flag, cv->object_format, cv->c_flag,
+		cv->compress_method, cv->aspect_flag, cv->floatscale_flag, cv->fastscale_flag,
+		cv->linear_flag, cv->varmod_flag, cv->filter_type, cv->gray_threshold, cv->gray_color,
+		cv->contrast_min, cv->contrast_max, cv->stripbits_mask, cv->base_intensity,
+		cv->rescale_w, cv->rescale_h, cv->mip_levels, cv->mem_limit, cv->max_colors, cv->base_color,
+		cv->refine_iters, cv->crop_x, cv->crop_y, cv->crop_w, cv->crop_h);
+	for (i = 0; i < cv->num_outputs && n >= 0 && n < size; i++)
+		n += snprintf(buf + n, size - n, " %d", cv->out_format[i]);
+	if (n < 0 || n >= size)
+		return set_error(cv, "ERROR: no room for the settings");
+	return 0;
+}
+
+/*
+ * check that the options make sense together, and if "infile" is
+ * given, that no two outputs for it would go to the same file
+ * returns 0 if all is well, or -1 if not
+ */
+int
+converter_check(Converter *cv, const char *infile)
+{
+	char *name[MAX_OUTPUTS];
+	int i, j, err;
+
+	if (cv->num_outputs == 0) {			/* default is to write 16 bit CRY data */
+		cv->out_format[0] = 0;
+		cv->num_outputs = 1;
+	}
+	if (cv->num_out_names > cv->num_outputs)
+		return set_error(cv, "More '-o' options given than output formats");
+	cv->bit_colors = 0;
+	for (i = 0; i < cv->num_outputs; i++) {
+		if (format_tab[cv->out_format[i]].colors > cv->bit_colors)
+			cv->bit_colors = format_tab[cv->out_format[i]].colors;
+	}
+
+	if (cv->floatscale_flag && cv->fastscale_flag)
+		return set_error(cv, "Only one of -floatscale and -fastscale may be given");
+	if (cv->floatscale_flag && cv->linear_flag)
+		return set_error(cv, "-linear can't be used with -floatscale");
+	if (cv->compress_method && (cv->c_flag || cv->object_format))
+		return set_error(cv, "-compress can't be used with -c or -object");
+	if (cv->c_flag && cv->object_format)
+		return set_error(cv, "Only one of -c and -object may be given");
+	if (cv->mem_limit && cv->rotate_flag)
+		return set_error(cv, "-memlimit can't be used with -rotate");
+	if (cv->mem_limit && cv->mip_levels > 1)
+		return set_error(cv, "-memlimit can't be used with -mipmaps");
+	if (cv->mem_limit && cv->num_outputs > 1)
+		return set_error(cv, "-memlimit can't be used with more than one output format");
+	if (cv->max_colors != 0 && cv->bit_colors == 0)		/* palette requested but not palette output format */
+		return set_error(cv, "-maxcolors option only valid with palette output formats");
+	if (cv->refine_iters != 0 && cv->bit_colors == 0)
+		return set_error(cv, "-refine option only valid with palette output formats");
+	for (i = 0; i < cv->num_outputs; i++) {
+		j = format_tab[cv->out_format[i]].colors;
+		if ((j && (cv->max_colors ? cv->max_colors : j) + cv->base_color > j) || (cv->base_color && !cv->bit_colors))
+			return set_error(cv, "-basecolor set too large for this output format");
+	}
+	cv->contrast = (double)(255-cv->gray_threshold)/(double)(cv->contrast_max-cv->contrast_min);
+	if (!infile)
+		return 0;
+
+	err = 0;
+	for (i = 0; i < cv->num_outputs; i++)
+		name[i] = NULL;
+	for (i = 0; i < cv->num_outputs && !err; i++) {
+		name[i] = output_name(cv, i, infile);
+		if (!name[i])
+			err = set_error(cv, "ERROR: insufficient memory");
+		for (j = 0; j < i && !err; j++) {
+			if (!strcmp(name[i], name[j]))
+				err = set_error(cv, "Two output formats would both be written to '%s'; use '-o' to name them", name[i]);
+		}
+	}
+	for (i = 0; i < cv->num_outputs; i++) {
+		if (name[i])
+			my_free(name[i]);
+	}
+	return err;
+}
+
+#if __MSDOS__
+void draw_percentage( Converter *cv, int pct )
+{
+	if( ! cv->quiet_flag )
+	{
+		fprintf( progress_file(cv), "Image Conversion %d%% Complete\n", pct );
+		gotoxy( wherex(), wherey() - 1 );
+	}
+}
+#else
+void draw_percentage( Converter *cv, int pct )
+{
+	if( ! cv->quiet_flag )
+	{
+		if (pct > 100)
+			fprintf( progress_file(cv), "Image Conversion %d%% Complete\n", 100 );
+		else
+			fprintf( progress_file(cv), "Image Conversion %d%% Complete\r", pct );
+
+		fflush( progress_file(cv) );
+	}
+}
+#endif /* __MSDOS__ */
+
+/*************************************************************************
+change_extension(name, ext): creates a duplicate string, containing the
+given file name but with its extension changed to ext; if the file had
+no extension, one is added.
+ext must contain the appropriate '.' character
+returns NULL if there is not enough memory
+**************************************************************************/
+char *
+change_extension(const char *name, const char *ext)
+{
+	const char *s;		/* temporary string pointer */
+	size_t len;		/* length of the string */
+	size_t extpos;		/* position where the extension is to be added */
+	char *newname;
+
+	len = extpos = 0;
+
+	for (s = name; *s; s++) {
+		if (*s == '\\' || *s == '/') {		/* account for both UNIX and DOS path separators */
+			extpos = 0;			/* no extension yet, the name isn't finished */
+		} else if (*s == '.') {
+			extpos = len;
+		}
+		len++;
+	}
+	if (extpos == 0)
+		extpos = len;
+
+	newname = my_malloc(len+strlen(ext)+1);		/* the "+1" is for the trailing 0 */
+	if (!newname)
+		return NULL;
+	strcpy(newname, name);
+	strcpy(newname+extpos, ext);
+	return newname;
+}
+
+/*************************************************************************
+strip_extension(name): creates a duplicate string, containing the
+given file name but with no extension or path name, i.e. the string
+"c:\foo\bar.tga" gets turned into just plain "bar"
+returns NULL if there is not enough memory
+**************************************************************************/
+char *
+strip_extension(const char *name)
+{
+	const char *s;		/* temporary string pointer */
+	size_t len;		/* length of the string */
+	size_t extpos;		/* position where the extension is to be added */
+	char *newname;
+
+	len = extpos = 0;
+
+	for (s = name; *s; s++) {
+		if (*s == '\\' || *s == '/') {		/* account for both UNIX and DOS path separators */
+			extpos = len = 0;		/* no extension yet, the name isn't finished */
+			name = s+1;			/* throw away everything before this */
+		} else if (*s == '.') {
+			extpos = len++;
+		} else {
+			len++;
+		}
+	}
+	if (extpos == 0)
+		extpos = len;
+
+	newname = my_malloc(len+1);		/* the "+1" is for the trailing 0 */
+	if (!newname)
+		return NULL;
+	strcpy(newname, name);
+	strcpy(newname+extpos, "");
+	return newname;
+}
+
+/* reading the picture a row at a time, for -memlimit */
+static void source_open(Converter *cv);
+static void source_row(void *arg, int y, Pixel *row);
+static void source_close(Converter *cv);
+static void load_picture(Converter *cv, FILE *fhandle);
+static void read_pixels(Converter *cv, const Pixel *pix, unsigned w, unsigned h);
+
+/*
+ * the flags for rescale() and resize_open() that the options ask for
+ */
+static int
+rescale_flags(Converter *cv)
+{
+	return (cv->aspect_flag ? RESCALE_ASPECT : 0) | (cv->floatscale_flag ? RESCALE_FLOAT : 0)
+		| (cv->fastscale_flag ? RESCALE_PLANAR : 0) | (cv->linear_flag ? RESCALE_LINEAR : 0);
+}
+
+/*
+ * make name (from strip_extension()) into a C identifier for -c, by
+ * changing anything but letters, digits and '_' to '_' and putting a
+ * '_' in front of a leading digit; frees name, and returns NULL if
+ * there is not enough memory
+ */
+static char *
+c_identifier(char *name)
+{
+	char *id, *p;
+	int lead;
+
+	lead = (*name >= '0' && *name <= '9');
+	id = my_malloc(strlen(name) + lead + 1);
+	if (id) {
+		id[0] = '_';
+		strcpy(id + lead, name);
+		for (p = id; *p; p++) {
+			if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')))
+				*p = '_';
+		}
+	}
+	my_free(name);
+	return id;
+}
+
+/*
+ * write the picture out in each output format: to the output files or,
+ * if "out" is not NULL, to the buffer there (outsize bytes)
+ */
+static void
+write_outputs(Converter *cv, void *out, long outsize)
+{
+	Pixel *resized;
+	unsigned in_w, in_h;
+	int i;
+
+/*
+ * with more than one format, resize the picture once for all of them,
+ * rather than a row at a time for each one
+ */
+	if (cv->num_outputs > 1 && cv->srcfile && cv->rescale_w && cv->rescale_h) {
+		if ( !cv->quiet_flag )
+			fprintf(progress_file(cv), "Resizing image to %d x %d...\n", cv->rescale_w, cv->rescale_h);
+		resized = rescale(cv->srcfile, cv->image_w, cv->image_h, cv->rescale_w, cv->rescale_h, cv->filter_type,
+				rescale_flags(cv), cv->num_threads);
+		if (!resized)
+			fail(cv, "ERROR: Unable to allocate memory to resize picture");
+		my_free(cv->srcfile);
+		cv->srcfile = resized;
+		cv->image_w = cv->rescale_w;
+		cv->image_h = cv->rescale_h;
+		cv->rescale_w = cv->rescale_h = 0;
+	}
+
+	in_w = cv->image_w;
+	in_h = cv->image_h;
+	for (i = 0; i < cv->num_outputs; i++) {
+		cv->data_type = format_tab[cv->out_format[i]].type;
+		cv->bit_colors = format_tab[cv->out_format[i]].colors;
+		cv->max_colors = cv->bit_colors ? (cv->opt_max_colors ? cv->opt_max_colors : cv->bit_colors) : 0;
+		cv->outfilename = cv->def_name[i];
+		cv->picname = strip_extension(cv->outfilename);
+		if (cv->picname && cv->c_flag)
+			cv->picname = c_identifier(cv->picname);
+		if (!cv->picname)
+			fail(cv, "ERROR: insufficient memory");
+		if (out) {
+			sink_buffer(&cv->sink, out, outsize);
+		} else {
+			if (cv->binary_flag && !cv->c_flag) {
+				cv->outhandle = fopen(cv->outfilename, "wb");
+			} else {
+				cv->outhandle = fopen(cv->outfilename, "w");
+			}
+			if (!cv->outhandle)
+				fail(cv, "%s: %s", cv->outfilename, strerror(errno));
+			sink_file(&cv->sink, cv->outhandle);
+		}
+		make_newdata(cv);
+		if (cv->outhandle) {
+			if (fclose(cv->outhandle) != 0)
+				cv->sink.error = 1;
+			cv->outhandle = 0;
+		}
+		if (cv->sink.error) {
+			if (out)
+				fail(cv, "ERROR: output buffer too small (%ld bytes needed)", sink_size(&cv->sink));
+			fail(cv, "ERROR: writing %s", cv->outfilename);
+		}
+		my_free(cv->picname);
+		cv->picname = 0;
+		cv->image_w = in_w;
+		cv->image_h = in_h;
+	}
+}
+
+/*
+ * free everything a conversion allocated (all of it, if it failed part
+ * way), and put back the options it changed
+ */
+static void
+release(Converter *cv)
+{
+	int i;
+
+	if (cv->compressor)
+		compress_free(cv->compressor);
+	if (cv->outhandle)
+		fclose(cv->outhandle);
+	if (cv->in_handle)
+		fclose(cv->in_handle);
+	if (cv->src_handle)
+		source_close(cv);
+	if (cv->resizer)
+		resize_close(cv->resizer);
+	if (cv->hist)
+		palette_free(cv->hist);
+	if (cv->newdata && cv->newdata != cv->srcfile)
+		my_free(cv->newdata);
+	if (cv->srcfile)
+		my_free(cv->srcfile);
+	if (cv->nextdata)
+		my_free(cv->nextdata);
+	if (cv->window)
+		my_free(cv->window);
+	if (cv->row_values)
+		my_free(cv->row_values);
+	if (cv->packed)
+		my_free(cv->packed);
+	if (cv->copy)
+		my_free(cv->copy);
+	if (cv->picname)
+		my_free(cv->picname);
+	for (i = 0; i < MAX_OUTPUTS; i++) {
+		if (cv->def_name[i])
+			my_free(cv->def_name[i]);
+		cv->def_name[i] = 0;
+	}
+	cv->compressor = 0;
+	cv->outhandle = cv->in_handle = 0;
+	cv->resizer = 0;
+	cv->hist = 0;
+	cv->srcfile = cv->newdata = cv->nextdata = cv->window = cv->copy = 0;
+	cv->row_values = cv->packed = 0;
+	cv->picname = 0;
+
+	cv->max_colors = cv->opt_max_colors;
+	cv->rescale_w = cv->opt_rescale_w;
+	cv->rescale_h = cv->opt_rescale_h;
+}
+
+/*
+ * the conversion itself, for convert_file(), convert_decoded() and
+ * convert_pixels(): take the w x h pixels at pix, or if that is NULL
+ * read the picture from "infile", and write it out; the output files
+ * are named after infile
+ */
+static int
+convert(Converter *cv, const char *infile, const Pixel *pix, unsigned w, unsigned h, void *out, long outsize)
+{
+	int i;
+
+	if (converter_check(cv, infile) < 0)
+		return -1;
+	cv->opt_max_colors = cv->max_colors;
+	cv->opt_rescale_w = cv->rescale_w;
+	cv->opt_rescale_h = cv->rescale_h;
+	if (setjmp(cv->jmp)) {
+		release(cv);
+		return -1;
+	}
+
+	for (i = 0; i < cv->num_outputs; i++) {
+		cv->def_name[i] = output_name(cv, i, infile);
+		if (!cv->def_name[i])
+			fail(cv, "ERROR: insufficient memory");
+	}
+	if (pix)
+		read_pixels(cv, pix, w, h);
+	else
+		read_file(cv, infile);
+	write_outputs(cv, out, outsize);
+	release(cv);
+	return 0;
+}
+
+/*
+ * convert the TGA file "infile", writing each output format to its
+ * file; returns 0, or -1 if something went wrong
+ */
+int
+convert_file(Converter *cv, const char *infile)
+{
+	return convert(cv, infile, 0, 0, 0, 0, 0L);
+}
+
+/*
+ * read the TGA file "infile" into memory, as it is (with none of the
+ * options applied), setting *pix to its pixels, top row first, and *w
+ * and *h to its size; free the pixels with free_decoded()
+ * returns 0, or -1 if something went wrong
+ */
+int
+decode_file(Converter *cv, const char *infile, Pixel **pix, unsigned *w, unsigned *h)
+{
+	Converter *raw;
+
+	*pix = 0;
+	raw = converter_new();			/* the default options: no flipping, cropping or -memlimit */
+	if (!raw)
+		return set_error(cv, "ERROR: insufficient memory");
+	raw->quiet_flag = YES;
+	if (setjmp(raw->jmp)) {
+		strcpy(cv->error, raw->error);
+		release(raw);
+		converter_free(raw);
+		return -1;
+	}
+	read_file(raw, infile);
+	*pix = raw->srcfile;
+	*w = raw->image_w;
+	*h = raw->image_h;
+	raw->srcfile = 0;
+	release(raw);
+	converter_free(raw);
+	return 0;
+}
+
+void
+free_decoded(Pixel *pix)
+{
+	if (pix)
+		my_free(pix);
+}
+
+/*
+ * convert the w x h picture at pix, which decode_file() read from
+ * "infile", writing each output format to the file convert_file()
+ * would have; -memlimit makes no difference, as the picture is already
+ * in memory. The pixels aren't changed, so several converters can use
+ * the same ones at once.
+ * returns 0, or -1 if something went wrong
+ */
+int
+convert_decoded(Converter *cv, const char *infile, const Pixel *pix, unsigned w, unsigned h)
+{
+	if (!pix || w == 0 || h == 0)
+		return set_error(cv, "ERROR: no picture given");
+	return convert(cv, infile, pix, w, h, 0, 0L);
+}
+
+/*
+ * convert the w x h picture at pix (top row first, with no padding
+ * between rows) into the outsize bytes at out, setting *outlen to the
+ * number of bytes of output; only one output format may be chosen, and
+ * -memlimit makes no difference, as the picture is already in memory.
+ * The file name given with "o", if any, is used only for the symbol
+ * name in the output.
+ * returns 0, or -1 if something went wrong; if it was that the buffer
+ * was too small, *outlen is the size it needs to be
+ */
+int
+convert_pixels(Converter *cv, const Pixel *pix, unsigned w, unsigned h, void *out, long outsize, long *outlen)
+{
+	int r;
+
+	*outlen = 0;
+	if (!pix || w == 0 || h == 0)
+		return set_error(cv, "ERROR: no picture given");
+	if (cv->num_outputs > 1)
+		return set_error(cv, "ERROR: only one output format can be written to memory");
+	sink_buffer(&cv->sink, 0, 0L);
+	r = convert(cv, 0, pix, w, h, out, outsize);
+	*outlen = sink_size(&cv->sink);
+	return r;
+}
+
+static void
+err_eof(Converter *cv)
+{
+	fail(cv, "ERROR: unexpected EOF");
+}
+
+/*
+ * read_rle_pixel: read a pixel from an RLE encoded .TGA file
+ */
+static void
+read_rle_pixel(Converter *cv, FILE *fhandle, Pixel *place)
+{
+	int i;
+
+	/* if we're in the middle of reading a duplicate pixel */
+	if (cv->dup_pixel_count > 0) {
+		cv->dup_pixel_count--;
+		place->blue = cv->tga_pixel[0];
+		place->green = cv->tga_pixel[1];
+		place->red = cv->tga_pixel[2];
+		return;
+	}
+	/* should we read an RLE block header? */
+	if (--cv->block_count < 0) {
+		i = fgetc(fhandle);
+		if (i < 0) err_eof(cv);
+		if (i & 0x80) {
+			cv->dup_pixel_count = i & 0x7f;	/* number of duplications after this one */
+			cv->block_count = 0;		/* then a new block header */
+		} else {
+			cv->block_count = i & 0x7f;		/* this many unduplicated pixels */
+		}
+	}
+	place->blue = cv->tga_pixel[0] = fgetc(fhandle);
+	place->green = cv->tga_pixel[1] = fgetc(fhandle);
+	place->red = cv->tga_pixel[2] = fgetc(fhandle);
+}
+
+/*
+ * read a pixel from an uncompressed .TGA file
+ */
+static void
+read_norm_pixel(Converter *cv, FILE *fhandle, Pixel *place)
+{
+	int i;
+
+	place->blue = fgetc(fhandle);
+	place->green = fgetc(fhandle);
+	i = fgetc(fhandle);
+	if (i < 0) err_eof(cv);
+	place->red = i;
+}
+
+/*
+ * take the next pixel of a picture in memory
+ */
+static void
+read_mem_pixel(Converter *cv, FILE *fhandle, Pixel *place)
+{
+	*place = *cv->mem_pixels++;
+}
+
+void
+read_row(Converter *cv, FILE *fhandle, Pixel *place)
+{
+	int i;
+	void (*rpixel)(Converter *, FILE *, Pixel *);
+
+	rpixel = cv->read_pixel;
+	if (cv->rotate_flag) {
+		if (cv->hflip_flag) {
+			place += cv->image_h*(long)cv->image_w;
+			for (i = 0; i < cv->image_h; i++) {
+				place -= cv->image_w;
+				(*rpixel)(cv, fhandle, place);
+			}
+		} else {
+			for (i = 0; i < cv->image_h; i++) {
+				(*rpixel)(cv, fhandle, place);
+				place += cv->image_w;
+			}
+		}
+	} else if (cv->hflip_flag) {
+		place += cv->image_w;
+		for (i = 0; i < cv->image_w; i++) {
+			place--;
+			(*rpixel)(cv, fhandle, place);
+		}
+	} else {
+		for (i = 0; i < cv->image_w; i++) {
+			(*rpixel)(cv, fhandle, place);
+			place++;
+		}
+	}
+}
+
+/*
+ * check the crop window against the size of the picture
+ */
+static void
+check_crop(Converter *cv)
+{
+	if (cv->crop_w != 0 && cv->crop_h != 0) {
+		if ( (cv->crop_x + cv->crop_w > cv->image_w) || (cv->crop_y + cv->crop_h > cv->image_h) )
+			fail(cv, "WARNING: crop window exceeds size of input image");
+	}
+}
+
+void
+read_file(Converter *cv, const char *infile)
+{
+	FILE *fhandle;
+	int c;
+	long i;
+
+	cv->block_count = cv->dup_pixel_count = 0;
+	fhandle = cv->in_handle = fopen(infile, "rb");
+	if (!fhandle)
+		fail(cv, "%s: %s", infile, strerror(errno));
+	cv->bytes_in_name = fgetc(fhandle);
+	cv->cmap_type = fgetc(fhandle);
+	cv->sub_type = fgetc(fhandle);
+	c = fgetc(fhandle);			/* skip bytes 3 and 4 */
+	c = fgetc(fhandle);
+	if (c < 0) err_eof(cv);
+
+	cv->cmap_len = fgetc(fhandle) + ((unsigned)fgetc(fhandle) << 8);
+	c = fgetc(fhandle);			/* skip bytes 7 through 11 */
+	c = fgetc(fhandle);
+	c = fgetc(fhandle);
+	c = fgetc(fhandle);
+	c = fgetc(fhandle);
+	if (c < 0) err_eof(cv);
+
+	cv->image_w = fgetc(fhandle) + ((unsigned)fgetc(fhandle) << 8);
+	cv->image_h = fgetc(fhandle) + ((unsigned)fgetc(fhandle) << 8);
+
+/* set input crop window */
+	check_crop(cv);
+
+	cv->bits_per_pixel = fgetc(fhandle);
+	if (cv->bits_per_pixel < 0) err_eof(cv);
+	cv->tga_flags = fgetc(fhandle);
+
+	if (cv->cmap_type != 0)
+		fail(cv, "ERROR: Targa files with color maps not supported");
+	if (cv->bits_per_pixel != 24)
+		fail(cv, "ERROR: Only 24 bit Targa files are supported");
+	cv->flip_y = cv->vflip_flag;
+	if ((cv->tga_flags & 0x20) == 0) {		/* this picture is bottom-up */
+		cv->flip_y = !cv->flip_y;
+	}
+	if (cv->tga_flags & 0xc0)
+		fail(cv, "ERROR: Interlaced Targa files are not supported");
+/* figure out how to read source pixels */
+	if (cv->sub_type > 8) {
+	/* an RLE-coded file */
+		cv->read_pixel = read_rle_pixel;
+		cv->sub_type -= 8;
+	} else {
+		cv->read_pixel = read_norm_pixel;
+	}
+
+	if (cv->sub_type == 1) {
+		fail(cv, "ERROR: Colormapped Targa files not supported");
+	} else if (cv->sub_type == 2) {
+		/* everything is OK */ ;
+	} else {
+		fail(cv, "ERROR: Invalid or unsupported Targa file");
+	}
+
+/* skip the image name */
+	for (i = 0; i < cv->bytes_in_name; i++) {
+		c = fgetc(fhandle);
+		if (c < 0) err_eof(cv);
+	}
+
+/* with -memlimit, rows are read when they're needed */
+	if (cv->mem_limit) {
+		cv->srcfile = 0;
+		source_open(cv);
+		return;
+	}
+
+	load_picture(cv, fhandle);
+	fclose(fhandle);
+	cv->in_handle = 0;
+}
+
+/*
+ * read a picture of image_w x image_h pixels, in the order they're stored,
+ * into srcfile, flipping, rotating and cropping it as the options say
+ */
+static void
+load_picture(Converter *cv, FILE *fhandle)
+{
+	Pixel *row_pixels;
+	long i;
+
+	cv->srcfile = my_malloc(sizeof(Pixel) * (size_t)cv->image_w*(size_t)cv->image_h);
+	if (!cv->srcfile)
+		fail(cv, "ERROR: insufficient memory for image");
+
+	if (cv->rotate_flag) {
+		unsigned int temp;
+		temp = cv->image_w;
+		cv->image_w = cv->image_h;
+		cv->image_h = temp;
+
+		if (cv->flip_y) {
+			row_pixels = cv->srcfile;
+			for (i = 0; i < cv->image_w; i++) {
+				read_row(cv, fhandle, row_pixels);
+				row_pixels++;
+			}
+		} else {
+			row_pixels = cv->srcfile + cv->image_w;
+			for (i = 0; i < cv->image_w; i++) {
+				row_pixels--;
+				read_row(cv, fhandle, row_pixels);
+			}
+		}
+	} else if (cv->flip_y) {
+		row_pixels = cv->srcfile + cv->image_h*(long)cv->image_w;
+		for (i = 0; i < cv->image_h; i++) {
+			row_pixels -= cv->image_w;
+			read_row(cv, fhandle, row_pixels);
+		}
+	} else {
+		row_pixels = cv->srcfile;
+		for (i = 0; i < cv->image_h; i++) {
+			read_row(cv, fhandle, row_pixels);
+			row_pixels += cv->image_w;
+		}
+	}
+
+	/* crop input */
+	/* LOGICALLY, this should happen *before* -hflip, -vflip, or -rotate, but it's too much
+	 * hassle to implement that now
+	 */
+	if (cv->crop_w != 0 && cv->crop_h != 0) {
+		Pixel *newpix;
+
+		newpix = crop(cv->srcfile, cv->image_w, cv->image_h, cv->crop_x, cv->crop_y, cv->crop_w, cv->crop_h);
+		if (!newpix)
+			fail(cv, "ERROR: insufficient memory for cropping picture");
+		free(cv->srcfile);
+		cv->srcfile = newpix;
+		cv->image_w = cv->crop_w;
+		cv->image_h = cv->crop_h;
+	}
+}
+
+/*
+ * take the picture from memory instead of a file
+ */
+static void
+read_pixels(Converter *cv, const Pixel *pix, unsigned w, unsigned h)
+{
+	cv->image_w = w;
+	cv->image_h = h;
+	check_crop(cv);
+	cv->flip_y = cv->vflip_flag;
+	cv->read_pixel = read_mem_pixel;
+	cv->mem_pixels = pix;
+	load_picture(cv, 0);
+}
+
+/*
+ * With -memlimit the picture isn't read into memory; instead the rows are
+ * read from the file when they're needed, by source_row(). For an RLE file
+ * we first go through the whole file, noting where each row starts (and
+ * what state the decoder is in there, since a packet can run on into the
+ * next row); see Row_Start.
+ */
+static void
+source_open(Converter *cv)
+{
+	FILE *fhandle;
+	unsigned y, x;
+
+	fhandle = cv->src_handle = cv->in_handle;	/* source_close() closes it now */
+	cv->in_handle = 0;
+	cv->src_w = cv->image_w;
+	cv->src_h = cv->image_h;
+	cv->src_start = ftell(fhandle);
+	cv->src_index = 0;
+	cv->src_buf = my_malloc(sizeof(Pixel) * (size_t)cv->src_w);
+	if (!cv->src_buf)
+		fail(cv, "ERROR: insufficient memory for image");
+	if (cv->read_pixel == read_rle_pixel) {
+		cv->src_index = my_malloc(sizeof(Row_Start) * (size_t)cv->src_h);
+		if (!cv->src_index)
+			fail(cv, "ERROR: insufficient memory for image");
+		for (y = 0; y < cv->src_h; y++) {
+			cv->src_index[y].offset = ftell(fhandle);
+			cv->src_index[y].block_count = cv->block_count;
+			cv->src_index[y].dup_pixel_count = cv->dup_pixel_count;
+			memcpy(cv->src_index[y].tga_pixel, cv->tga_pixel, sizeof(cv->tga_pixel));
+			for (x = 0; x < cv->src_w; x++)
+				read_rle_pixel(cv, fhandle, cv->src_buf);
+		}
+	}
+	cv->src_x0 = cv->src_y0 = 0;
+	if (cv->crop_w != 0 && cv->crop_h != 0) {
+		cv->src_x0 = cv->crop_x;
+		cv->src_y0 = cv->crop_y;
+		cv->image_w = cv->crop_w;
+		cv->image_h = cv->crop_h;
+	}
+	cv->src_cw = cv->image_w;
+}
+
+/*
+ * read row y of the (flipped and cropped) picture
+ */
+static void
+source_row(void *arg, int y, Pixel *row)
+{
+	Converter *cv = (Converter *)arg;
+	unsigned r, x;
+
+	r = cv->src_y0 + y;				/* row of the whole picture */
+	if (cv->flip_y)
+		r = cv->src_h - 1 - r;		/* row of the file */
+	if (cv->src_index) {
+		fseek(cv->src_handle, cv->src_index[r].offset, SEEK_SET);
+		cv->block_count = cv->src_index[r].block_count;
+		cv->dup_pixel_count = cv->src_index[r].dup_pixel_count;
+		memcpy(cv->tga_pixel, cv->src_index[r].tga_pixel, sizeof(cv->tga_pixel));
+	} else {
+		fseek(cv->src_handle, cv->src_start + 3L * cv->src_w * r, SEEK_SET);
+	}
+	for (x = 0; x < cv->src_w; x++)
+		(*cv->read_pixel)(cv, cv->src_handle, &cv->src_buf[cv->hflip_flag ? cv->src_w - 1 - x : x]);
+	memcpy(row, cv->src_buf + cv->src_x0, cv->src_cw * sizeof(Pixel));
+}
+
+static void
+source_close(Converter *cv)
+{
+	fclose(cv->src_handle);
+	if (cv->src_index)
+		my_free(cv->src_index);
+	if (cv->src_buf)
+		my_free(cv->src_buf);
+	cv->src_handle = 0;
+	cv->src_index = 0;
+	cv->src_buf = 0;
+}
+
+static INLINE void
+diffuse_error(Pixel newcolor, Pixel origcolor, Pixel *where, long linelen)
+{
+	int	err;
+	int	x;
+
+/* diffuse error in red */
+	err = (int)origcolor.red - (int)newcolor.red;
+	x = where[1].red + ((7*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[1].red = x;
+
+	x = where[linelen-1].red + ((3*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen-1].red = x;
+
+	x = where[linelen].red + ((5*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen].red = x;
+
+	x = where[linelen+1].red + (err>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen+1].red = x;
+
+/* diffuse error in green */
+	err = (int)origcolor.green - (int)newcolor.green;
+	x = where[1].green + ((7*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[1].green = x;
+
+	x = where[linelen-1].green + ((3*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen-1].green = x;
+
+	x = where[linelen].green + ((5*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen].green = x;
+
+	x = where[linelen+1].green + (err>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen+1].green = x;
+
+/* diffuse error in blue */
+	err = (int)origcolor.blue - (int)newcolor.blue;
+	x = where[1].blue + ((7*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[1].blue = x;
+
+	x = where[linelen-1].blue + ((3*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen-1].blue = x;
+
+	x = where[linelen].blue + ((5*err)>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen].blue = x;
+
+	x = where[linelen+1].blue + (err>>4);
+	if (x < 0) x = 0;
+	if (x > 255) x = 255;
+	where[linelen+1].blue = x;
+}
+
+/*
+ * binary output is collected a word at a time in out_words, in the
+ * machine's own byte order, and then byte swapped and written out in
+ * big blocks by output_flush(); a byte that doesn't make up a whole
+ * word yet waits in out_odd_byte. binary_file_size only counts what
+ * has actually been written, so use output_size() for the total.
+ *
+ * assembly language output is formatted into out_text (with a table
+ * lookup per hex digit, rather than a printf per item) and written
+ * out by output_flush() too; anything that writes straight to the
+ * file instead must call output_flush() first.
+ *
+ * C output (-c) goes through the binary path, and output_flush()
+ * formats the words into out_text as array elements of c_elem_size
+ * bytes each, instead of writing them.
+ */
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+/*
+ * write binary output, compressing it if need be
+ */
+static void
+output_write(Converter *cv, const uint8_t *buf, long n)
+{
+	if (cv->compressor)
+		compress_write(cv->compressor, buf, n);
+	else
+		sink_write(&cv->sink, buf, n);
+}
+
+static void
+text_flush(Converter *cv)
+{
+	sink_write(&cv->sink, cv->out_text, cv->out_tlen);
+	cv->out_tlen = 0;
+}
+
+/*
+ * add n characters of text to the output
+ */
+static INLINE void
+put_text(Converter *cv, const char *str, int n)
+{
+	if (cv->out_tlen + n > OUTBUF_TEXT)
+		text_flush(cv);
+	memcpy(cv->out_text + cv->out_tlen, str, n);
+	cv->out_tlen += n;
+}
+
+/*
+ * add "w" to the output as "digits" upper case hex digits
+ */
+static INLINE void
+put_hex(Converter *cv, uint32_t w, int digits)
+{
+	char *p;
+
+	if (cv->out_tlen + digits > OUTBUF_TEXT)
+		text_flush(cv);
+	p = cv->out_text + cv->out_tlen;
+	cv->out_tlen += digits;
+	while (digits-- > 0) {
+		p[digits] = hex_digits[w & 0xf];
+		w >>= 4;
+	}
+}
+
+/*
+ * add one C array element to the output
+ */
+static INLINE void
+put_c_item(Converter *cv, uint32_t w)
+{
+	if (cv->items_per_line == 0) {
+		put_text(cv, "\t0x", 3);
+	} else {
+		put_text(cv, ", 0x", 4);
+	}
+	put_hex(cv, w, 2*cv->c_elem_size);
+	if (cv->items_per_line++ == (cv->c_elem_size == 4 ? 7 : 15)) {
+		put_text(cv, ",\n", 2);
+		cv->items_per_line = 0;
+	}
+}
+
+/*
+ * write out any pending output
+ */
+static void
+output_flush(Converter *cv)
+{
+	int i;
+
+	if (cv->c_flag) {
+	/* whole elements are always waiting here, as every format's data is */
+		for (i = 0; i < cv->out_nwords; i++) {
+			if (cv->c_elem_size == 2) {
+				put_c_item(cv, cv->out_words[i]);
+			} else if (cv->c_elem_size == 4) {
+				put_c_item(cv, ((uint32_t)cv->out_words[i] << 16) | cv->out_words[i+1]);
+				i++;
+			} else {
+				put_c_item(cv, cv->out_words[i] >> 8);
+				put_c_item(cv, cv->out_words[i] & 0x00ff);
+			}
+		}
+		if (cv->out_odd_byte >= 0)
+			put_c_item(cv, cv->out_odd_byte);
+		cv->binary_file_size += 2L * cv->out_nwords + (cv->out_odd_byte >= 0);
+		cv->out_nwords = 0;
+		cv->out_odd_byte = -1;
+	}
+	if (cv->out_tlen)
+		text_flush(cv);
+	if (cv->out_nwords) {
+		swap_words(cv->out_bytes, cv->out_words, cv->out_nwords);
+		output_write(cv, cv->out_bytes, 2L * cv->out_nwords);
+		cv->binary_file_size += 2L * cv->out_nwords;
+		cv->out_nwords = 0;
+	}
+	if (cv->out_odd_byte >= 0) {
+		cv->out_bytes[0] = cv->out_odd_byte;
+		output_write(cv, cv->out_bytes, 1);
+		cv->binary_file_size++;
+		cv->out_odd_byte = -1;
+	}
+}
+
+/*
+ * total size of the output so far, including anything not yet written
+ */
+static long
+output_size(Converter *cv)
+{
+	return cv->binary_file_size + 2L * cv->out_nwords + (cv->out_odd_byte >= 0);
+}
+
+static INLINE void
+put_word(Converter *cv, uint16_t w)
+{
+	if (cv->out_odd_byte >= 0 || cv->out_nwords == OUTBUF_WORDS)
+		output_flush(cv);
+	cv->out_words[cv->out_nwords++] = w;
+}
+
+static INLINE void
+put_byte(Converter *cv, int c)
+{
+	if (cv->out_odd_byte >= 0) {
+		c |= cv->out_odd_byte << 8;
+		cv->out_odd_byte = -1;
+		put_word(cv, c);
+	} else {
+		cv->out_odd_byte = c;
+	}
+}
+
+void
+output_byte(Converter *cv, unsigned char w)
+{
+	if (cv->binary_flag) {
+		put_byte(cv, w);
+	} else {
+		cv->binary_file_size++;
+		if (cv->items_per_line == 0) {
+			put_text(cv, "\tdc.b\t$", 7);
+		} else {
+			put_text(cv, ",$", 2);
+		}
+		put_hex(cv, w, 2);
+		if (cv->items_per_line++ == 15) {
+			put_text(cv, "\n", 1);
+			cv->items_per_line = 0;
+		}
+	}
+}
+
+void
+output_word(Converter *cv, uint16_t w)
+{
+	if (cv->binary_flag) {
+		put_word(cv, w);
+	} else {
+		cv->binary_file_size += 2;
+		if (cv->items_per_line == 0) {
+			put_text(cv, "\tdc.w\t$", 7);
+		} else {
+			put_text(cv, ",$", 2);
+		}
+		put_hex(cv, w, 4);
+		if (cv->items_per_line++ == 15) {
+			put_text(cv, "\n", 1);
+			cv->items_per_line = 0;
+		}
+	}
+}
+
+void
+output_long(Converter *cv, uint32_t w)
+{
+	if (cv->binary_flag) {
+		put_word(cv, w >> 16);
+		put_word(cv, w & 0xffff);
+	} else {
+		cv->binary_file_size += 4;
+		if (cv->items_per_line == 0) {
+			put_text(cv, "\tdc.l\t$", 7);
+		} else {
+			put_text(cv, ",$", 2);
+		}
+		put_hex(cv, w, 8);
+		if (cv->items_per_line++ == 7) {
+			put_text(cv, "\n", 1);
+			cv->items_per_line = 0;
+		}
+	}
+}
+
+/*
+ * output a byte of packed bits
+ */
+static INLINE void
+put_bits_byte(Converter *cv, int c)
+{
+	if (cv->binary_flag) {
+		put_byte(cv, c);
+	} else {
+		cv->binary_file_size++;
+		put_text(cv, "\tdc.b\t$", 7);
+		put_hex(cv, c, 2);
+		put_text(cv, "\n", 1);
+	}
+}
+
+void
+output_bit(Converter *cv, int b)
+{
+	cv->bit_buffer = (cv->bit_buffer << 1) | b;
+	cv->binary_bit_size++;
+	if (cv->binary_bit_size >= 8) {
+		cv->binary_bit_size = 0;
+		put_bits_byte(cv, cv->bit_buffer);
+		cv->bit_buffer = 0;
+	}
+}
+
+/*
+ * output the first nbits bits of buf (most significant bit of each
+ * byte first), carrying on from any bits left over in bit_buffer and
+ * leaving any left over at the end there, exactly as giving each bit
+ * to output_bit() would
+ */
+static void
+output_bits(Converter *cv, const uint8_t *buf, long nbits)
+{
+	int k = cv->binary_bit_size;		/* bits in bit_buffer, 0 to 7 */
+	long i, nbytes;
+	int rest;
+
+	nbytes = nbits / 8;
+	for (i = 0; i < nbytes; i++) {
+		put_bits_byte(cv, ((cv->bit_buffer << (8 - k)) | (buf[i] >> k)) & 0xff);
+		cv->bit_buffer = buf[i] & ((1 << k) - 1);
+	}
+	rest = nbits & 7;
+	if (rest) {
+		cv->bit_buffer = (cv->bit_buffer << rest) | (buf[nbytes] >> (8 - rest));
+		k += rest;
+		if (k >= 8) {
+			k -= 8;
+			put_bits_byte(cv, cv->bit_buffer >> k);
+			cv->bit_buffer &= (1 << k) - 1;
+		}
+	}
+	cv->binary_bit_size = k;
+}
+
+/*
+ * synchronize output to a word boundary
+ */
+void
+output_sync(Converter *cv)
+{
+	if (cv->binary_flag == 0 && cv->items_per_line != 0) {
+		put_text(cv, "\n", 1);
+		cv->items_per_line = 0;
+	}
+	while (cv->binary_bit_size != 0) {
+		output_bit(cv, 0);
+	}
+	if (output_size(cv) & 1) {
+		output_byte(cv, 0);
+		if (cv->binary_flag == 0) {
+			put_text(cv, "\n", 1);
+			cv->items_per_line = 0;
+		}
+	}
+}
+
+/*
+ * functions for converting palette entries into 16 bit RGB or CRY, respectively
+ */
+void
+rgbize_palette(Converter *cv)
+{
+	int i;
+	unsigned int red, green, blue;
+	Pixel p;
+
+	for (i = 0; i < cv->num_colors; i++) {
+		p = cv->palette[i].color;
+		red = p.red >> 3;
+		green = p.green >> 2;
+		blue = p.blue >> 3;
+
+		if (cv->varmod_flag)
+			cv->palette[i].outval = (red << 11) | (blue << 6) | green | 1;
+		else
+			cv->palette[i].outval = (red << 11) | (blue << 6) | green | 1;
+		cv->palette[i].color.red = red << 3;
+		cv->palette[i].color.green = green << 2;
+		cv->palette[i].color.blue = blue << 3;
+	}
+}
+
+void
+cryize_palette(Converter *cv)
+{
+	int i;
+	int intensity;
+	unsigned int color_offset;		/* offset for cry lookup table */
+	unsigned int rcomp,gcomp,bcomp;
+	unsigned int red, green, blue;
+
+	for (i = 0; i < cv->num_colors; i++) {
+		red = cv->palette[i].color.red;
+		green = cv->palette[i].color.green;
+		blue = cv->palette[i].color.blue;
+
+		intensity = red;				/* start with red */
+		if(green > intensity)
+			intensity = green;
+		if(blue > intensity)
+			intensity = blue;			/* get highest RGB value */
+		if(intensity != 0)
+		{
+			rcomp = (unsigned int)red * 255 / intensity;
+			gcomp = (unsigned int)green * 255 / intensity;
+			bcomp = (unsigned int)blue * 255 / intensity;
+		}
+		else
+			rcomp = gcomp = bcomp = 0;		/* R, G, B, were all 0 (black) */
+
+		color_offset = (rcomp & 0xF8) << 7;
+		color_offset |= (gcomp & 0xF8) << 2;
+		color_offset |= (bcomp & 0xF8) >> 3;		/* now we have offset for cry table */
+
+		intensity = intensity & cv->stripbits_mask;
+		if (cv->base_intensity > 0) {
+			intensity = intensity - cv->base_intensity;
+			if (intensity > 0x7f) intensity = 0x7f;
+			else if (intensity < -0x7f) intensity = -0x7f;
+		}
+		if (cv->varmod_flag)
+			intensity &= 0xfe;
+
+		cv->palette[i].outval = ((color_offset = cry[color_offset]) << 8) | (intensity & 0x00ff);
+
+		/* now convert back to RGB for dithering purposes */
+		cv->palette[i].color.red = (intensity*cryred[color_offset]) >> 8;
+		cv->palette[i].color.green = (intensity*crygreen[color_offset]) >> 8;
+		cv->palette[i].color.blue = (intensity*cryblue[color_offset]) >> 8;
+	}
+}
+
+static INLINE unsigned int
+do_cry(Converter *cv, unsigned char red, unsigned char green, unsigned char blue, int line, int column)
+{
+	int intensity;
+	unsigned int color_offset;		/* offset for cry lookup table */
+	unsigned int result;
+	unsigned int rcomp,gcomp,bcomp;
+
+	intensity = red;				/* start with red */
+	if(green > intensity)
+		intensity = green;
+	if(blue > intensity)
+		intensity = blue;			/* get highest RGB value */
+	if(intensity != 0)
+	{
+		rcomp = (unsigned int)red * 255 / intensity;
+		gcomp = (unsigned int)green * 255 / intensity;
+		bcomp = (unsigned int)blue * 255 / intensity;
+	}
+	else
+		rcomp = gcomp = bcomp = 0;		/* R, G, B, were all 0 (black) */
+
+	color_offset = (rcomp & 0xF8) << 7;
+	color_offset |= (gcomp & 0xF8) << 2;
+	color_offset |= (bcomp & 0xF8) >> 3;		/* now we have offset for cry table */
+
+	intensity = intensity & cv->stripbits_mask;
+	if (cv->base_intensity > 0) {
+		intensity = intensity - cv->base_intensity;
+		if (intensity > 0x7f) intensity = 0x7f;
+		else if (intensity < -0x7f) intensity = -0x7f;
+	}
+	result = ((color_offset = cry[color_offset]) << 8) | (intensity & 0x00ff);
+
+	if (cv->varmod_flag) {
+		result &= 0xfffe;
+	}
+
+	output_word(cv, result);
+
+/*
+ * if we're supposed to dither the final CRY, convert it back to RGB and use it to find
+ * the error
+ */
+	if (cv->dither_flag) {
+		long linelen = cv->image_w;
+		Pixel oldcolor, newcolor, *where;
+
+		oldcolor.red = red;
+		oldcolor.green = green;
+		oldcolor.blue = blue;
+
+		newcolor.red = (intensity*cryred[color_offset]) >> 8;
+		newcolor.green = (intensity*crygreen[color_offset]) >> 8;
+		newcolor.blue = (intensity*cryblue[color_offset]) >> 8;
+
+		if (column >= 3 && column < linelen - 3 && line < cv->image_h - 1) {
+			where = &cv->cur_row[column];
+			diffuse_error(newcolor, oldcolor, where, linelen);
+		}
+	}
+	return result;
+}
+
+static INLINE unsigned int
+do_gray(Converter *cv, unsigned char red, unsigned char green, unsigned char blue)
+{
+	double intensity;
+	unsigned result;
+
+	intensity = (0.59*green + 0.30*red + 0.11*blue);
+	if (intensity < cv->gray_threshold) intensity = 0;
+	else if (intensity < cv->contrast_min) intensity = cv->gray_threshold;
+	else if (intensity > cv->contrast_max) intensity = 255;
+	else intensity = cv->gray_threshold + cv->contrast*(intensity-cv->contrast_min);
+
+	if (intensity < 0) intensity = 0;
+	else if (intensity > 255.0) intensity = 255.0;
+
+	if (intensity == 0 && cv->nozero_flag && (green != 0 || red != 0 || blue != 0))
+		intensity = 2;
+
+	result = cv->gray_color | (unsigned)intensity;
+
+	if (cv->varmod_flag)
+		result &= 0xfffe;
+
+	output_word(cv, result);
+	return result;
+}
+
+static INLINE unsigned int
+do_glass(Converter *cv, unsigned char red, unsigned char green, unsigned char blue)
+{
+	double intensity;
+	int i;
+
+	intensity = (0.59*green + 0.30*red + 0.11*blue);
+	if (intensity < cv->gray_threshold) intensity = 0;
+	else if (intensity < cv->contrast_min) intensity = cv->gray_threshold;
+	else if (intensity > cv->contrast_max) intensity = 255;
+	else intensity = cv->gray_threshold + cv->contrast*(intensity-cv->contrast_min);
+
+	if (intensity < 0) intensity = 0;
+	else if (intensity > 255.0) intensity = 255.0;
+
+	i = (intensity - 128.0);
+
+	if (cv->varmod_flag)
+		i &= 0xfe;
+
+	output_word(cv, cv->gray_color|(i & 0x00ff));
+	return intensity;
+}
+
+static INLINE void
+do_rgb16(Converter *cv, unsigned char red, unsigned char green, unsigned char blue)
+{
+	int temp0;
+	temp0 = (red >> 3) << 5;					/* reduce red to 5 bits, shift left 5 bits */
+	temp0 += blue >> 3;						/* reduce blue to 5 bits */
+	temp0 = temp0 << 6;						/* make room for green */
+	temp0 += green >> 2;					/* reduce green to 6 bits */
+
+	if (cv->nozero_flag && temp0 == 0 && (red != 0 || green != 0 || blue != 0))
+		temp0 = 1;
+
+	if (cv->varmod_flag)
+		temp0 |= 1;
+
+	output_word(cv, temp0);
+}
+
+static INLINE void
+do_rgb24(Converter *cv, unsigned char red, unsigned char green, unsigned char blue)
+{
+	uint32_t temp0;
+
+	temp0 = ((uint32_t)green << 24) | ((uint32_t)red << 16) | blue;
+	output_long(cv, temp0);
+}
+
+/*
+ * look through a palette, looking for the best match for a palette entry,
+ * and then output the 8 bit index
+ */
+static INLINE void
+do_palette(Converter *cv, unsigned char red, unsigned char green, unsigned char blue, int line, int column)
+{
+	int32_t dist, bestdist;
+	int bestcolor;
+	int i, rdist, bdist, gdist;
+
+	bestdist = 0x7fffffff;
+	bestcolor = 0;
+	for (i = 0; i < cv->num_colors; i++) {
+		rdist = (int)red - (int)cv->palette[i].color.red;
+		gdist = (int)green - (int)cv->palette[i].color.green;
+		bdist = (int)blue - (int)cv->palette[i].color.blue;
+		dist = rdist*(int32_t)rdist+gdist*(int32_t)gdist+bdist*(int32_t)bdist;
+		if (dist <= bestdist) {
+			bestdist = dist;
+			bestcolor = i;
+		}
+	}
+
+	output_byte(cv, bestcolor + cv->base_color);
+
+	/* dither the error, if we're supposed to */
+	if (cv->dither_flag) {
+		long linelen = cv->image_w;
+		Pixel oldcolor, *where;
+
+		oldcolor.red = red;
+		oldcolor.green = green;
+		oldcolor.blue = blue;
+
+		if (column >= 3 && column < linelen - 3 && line < cv->image_h - 1) {
+			where = &cv->cur_row[column];
+			diffuse_error(cv->palette[bestcolor].color, oldcolor, where, linelen);
+		}
+	}
+}
+
+/*
+ * look through a palette, looking for the best match for a palette entry,
+ * and then store the 4 bit index in row_values (convert_picture() packs
+ * and outputs the row)
+ */
+static INLINE void
+do_4palette(Converter *cv, unsigned char red, unsigned char green, unsigned char blue, int line, int column)
+{
+	int32_t dist, bestdist;
+	int bestcolor;
+	int i, rdist, bdist, gdist;
+
+	bestdist = 0x7fffffff;
+	bestcolor = 0;
+	for (i = 0; i < cv->num_colors; i++) {
+		rdist = (int)red - (int)cv->palette[i].color.red;
+		gdist = (int)green - (int)cv->palette[i].color.green;
+		bdist = (int)blue - (int)cv->palette[i].color.blue;
+		dist = rdist*(int32_t)rdist+gdist*(int32_t)gdist+bdist*(int32_t)bdist;
+		if (dist <= bestdist) {
+			bestdist = dist;
+			bestcolor = i;
+		}
+	}
+
+	cv->row_values[column] = bestcolor + cv->base_color;
+
+	/* dither the error, if we're supposed to */
+	if (cv->dither_flag) {
+		long linelen = cv->image_w;
+		Pixel oldcolor, *where;
+
+		oldcolor.red = red;
+		oldcolor.green = green;
+		oldcolor.blue = blue;
+
+		if (column >= 3 && column < linelen - 3 && line < cv->image_h - 1) {
+			where = &cv->cur_row[column];
+			diffuse_error(cv->palette[bestcolor].color, oldcolor, where, linelen);
+		}
+	}
+}
+
+/*
+ * look through a palette, looking for the best match for a palette entry,
+ * and store the 1 bit index in row_values
+ */
+static INLINE void
+do_1palette(Converter *cv, unsigned char red, unsigned char green, unsigned char blue, int line, int column)
+{
+	int32_t dist, bestdist;
+	int bestcolor;
+	int i, rdist, bdist, gdist;
+
+	bestdist = 0x7fffffff;
+	bestcolor = 0;
+	for (i = 0; i < cv->num_colors; i++) {
+		rdist = (int)red - (int)cv->palette[i].color.red;
+		gdist = (int)green - (int)cv->palette[i].color.green;
+		bdist = (int)blue - (int)cv->palette[i].color.blue;
+		dist = rdist*(int32_t)rdist+gdist*(int32_t)gdist+bdist*(int32_t)bdist;
+		if (dist <= bestdist) {
+			bestdist = dist;
+			bestcolor = i;
+		}
+	}
+
+	cv->row_values[column] = bestcolor;
+
+	/* dither the error, if we're supposed to */
+	if (cv->dither_flag) {
+		long linelen = cv->image_w;
+		Pixel oldcolor, *where;
+
+		oldcolor.red = red;
+		oldcolor.green = green;
+		oldcolor.blue = blue;
+
+		if (column >= 3 && column < linelen - 3 && line < cv->image_h - 1) {
+			where = &cv->cur_row[column];
+			diffuse_error(cv->palette[bestcolor].color, oldcolor, where, linelen);
+		}
+	}
+}
+
+static INLINE void
+convert_rgb_pixel(Converter *cv, unsigned char red,unsigned char green,unsigned char blue,int line,int column)
+{
+	switch(cv->data_type)
+	{
+		case CRY16:
+			do_cry(cv, red,green,blue,line,column);
+			break;
+		case GRAY:
+			do_gray(cv, red,green,blue);
+			break;
+		case GLASS:
+			do_gray(cv, red,green,blue);
+			break;
+		case RGB16:
+			do_rgb16(cv, red,green,blue);
+			break;
+		case RGB24:
+			do_rgb24(cv, red,green,blue);
+			break;
+		case CRY8:
+		case RGB8:
+			do_palette(cv, red,green,blue,line,column);
+			break;
+		case CRY4:
+		case RGB4:
+			do_4palette(cv, red,green,blue,line,column);
+			break;
+		case CRY1:
+		case RGB1:
+			do_1palette(cv, red,green,blue,line,column);
+			break;
+	}
+}
+
+/*************************************************************************
+wid(image_w): return the blitter bits for a given image width
+This is done by a table lookup on "widtab"; each entry in widtab consists
+of two longs, the first being the width as an integer, the second being
+the corresponding blitter bits.
+*************************************************************************/
+static uint32_t widtab[] = {
+2,	0x00000800,
+4,	0x00001000,
+6,	0x00001400,
+8,	0x00001800,
+10,	0x00001A00,
+12,	0x00001C00,
+14,	0x00001E00,
+16,	0x00002000,
+20,	0x00002200,
+24,	0x00002400,
+28,	0x00002600,
+32,	0x00002800,
+40,	0x00002A00,
+48,	0x00002C00,
+56,	0x00002E00,
+64,	0x00003000,
+80,	0x00003200,
+96,	0x00003400,
+112,	0x00003600,
+128,	0x00003800,
+160,	0x00003A00,
+192,	0x00003C00,
+224,	0x00003E00,
+256,	0x00004000,
+320,	0x00004200,
+384,	0x00004400,
+448,	0x00004600,
+512,	0x00004800,
+640,	0x00004A00,
+768,	0x00004C00,
+896,	0x00004E00,
+1024,	0x00005000,
+1280,	0x00005200,
+1536,	0x00005400,
+1792,	0x00005600,
+2048,	0x00005800,
+2560,	0x00005A00,
+3072,	0x00005C00,
+3584,	0x00005E00,
+0,	0x00000000
+};
+
+uint32_t
+wid(Converter *cv, unsigned int image_w)
+{
+	uint32_t *ptr;
+
+	ptr = widtab;
+	while (*ptr != 0) {
+		if (*ptr == (uint32_t)image_w) {
+			return ptr[1];
+		}
+		ptr += 2;		/* skip the image width and blitter bits */
+	}
+/* if header_flag is set, then this is a fatal error (we can't generate the
+ * header); otherwise it should just be a warning
+ */
+	if (cv->header_flag) {
+		fail(cv, "ERROR: Unsupported width (%d)", (int)image_w);
+	} else {
+		warning(cv, "%d is not a blittable width", (int)image_w);
+	}
+	return 0;
+}
+
+static void
+resizer_row(void *arg, int y, Pixel *row)
+{
+	resize_row((Resizer *)arg, row);
+}
+
+/*
+ * get ready to go through the (resized, if -resize was given) in_w x in_h
+ * picture a row at a time: from srcfile if it's in memory, otherwise from
+ * the file; sets *getrow and *arg, and returns the Resizer, if one is used
+ */
+static Resizer *
+open_rows(Converter *cv, unsigned in_w, unsigned in_h, int resize_flags, Row_Func *getrow, void **arg)
+{
+	Resizer *r;
+	long needed;
+
+	if (!cv->rescale_w || !cv->rescale_h) {
+		*getrow = source_row;
+		*arg = cv;
+		return 0;
+	}
+	if (cv->srcfile)
+		r = resize_open(cv->srcfile, 0, 0, in_w, in_h, cv->rescale_w, cv->rescale_h, cv->filter_type, resize_flags, 1, 0L,
+				&needed);
+	else
+		r = resize_open(0, source_row, cv, in_w, in_h, cv->rescale_w, cv->rescale_h, cv->filter_type, resize_flags,
+				cv->num_threads, cv->mem_limit, &needed);
+	if (!r && needed)
+		fail(cv, "ERROR: resizing this picture needs at least %ldK of memory", (needed + 1023) / 1024);
+	if (!r)
+		fail(cv, "ERROR: Unable to allocate memory to resize picture");
+	*getrow = resizer_row;
+	*arg = r;
+	return r;
+}
+
+/*************************************************************************
+blit_flags(w, &pixsiz): return the blitter flags for a picture of width w
+in the output format, and set pixsiz to its number of bits per pixel.
+By always calculating the blitter flags, we always check for legal widths
+in the "wid" function...
+**************************************************************************/
+static uint32_t
+blit_flags(Converter *cv, unsigned w, int *pixsiz)
+{
+	if (cv->data_type == RGB24) {
+		*pixsiz = 32;
+		return 0x00030028u|wid(cv, w);		/* PITCH1|PIXEL32|XADDINC|WIDxxx */
+	} else if (cv->data_type == MSK || cv->data_type == CRY1 || cv->data_type == RGB1 ) {
+		*pixsiz = 1;
+		return 0x00030000u|wid(cv, w);		/* PITCH1|PIXEL1|XADDINC|WIDxxx */
+	} else if (cv->data_type == CRY8 || cv->data_type == RGB8) {
+		*pixsiz = 8;
+		return 0x00030018u|wid(cv, w);		/* PITCH1|PIXEL8|XADDINC|WIDxxx */
+	} else if (cv->data_type == CRY4 || cv->data_type == RGB4) {
+		*pixsiz = 4;
+		return 0x00030010u|wid(cv, w);		/* PITCH1|PIXEL4|XADDINC|WIDxxx */
+	} else {
+		*pixsiz = 16;
+		return 0x00030020u|wid(cv, w);		/* PITCH1|PIXEL16|XADDINC|WIDxxx */
+	}
+}
+
+/*
+ * number of bytes of data for a w x h picture with pixsiz bits per pixel;
+ * the pixels are packed together and rounded up to a word (see output_sync)
+ */
+static long
+data_size(unsigned w, unsigned h, int pixsiz)
+{
+	long bytes;
+
+	bytes = ((long)w * (long)h * pixsiz + 7) / 8;
+	return (bytes + 1) & ~1L;
+}
+
+/*
+ * start and end a C array of the given element size for -c; the
+ * elements themselves are written by output_flush()
+ */
+static void
+c_array_start(Converter *cv, int elem_size, const char *suffix)
+{
+	output_flush(cv);
+	cv->c_elem_size = elem_size;
+	cv->items_per_line = 0;
+	sink_printf(&cv->sink, "static const uint%d_t %s%s[] = {\n", 8*elem_size, cv->picname, suffix);
+}
+
+static void
+c_array_end(Converter *cv)
+{
+	output_flush(cv);
+	sink_printf(&cv->sink, "%s};\n", cv->items_per_line ? "\n" : "");
+	cv->items_per_line = 0;
+}
+
+/*
+ * pad the output with zero words until it is a whole number of phrases
+ * past "start" (which must be at an even byte count)
+ */
+static void
+output_phrase_pad(Converter *cv, long start)
+{
+	int n;
+
+	for (n = (8 - ((output_size(cv) - start) & 7)) & 7; n > 0; n -= 2)
+		output_word(cv, 0);
+	if (cv->binary_flag == 0 && cv->items_per_line != 0) {
+		put_text(cv, "\n", 1);
+		cv->items_per_line = 0;
+	}
+}
+
+/*
+ * pack n values of "bits" (4 or 1) bits each into bytes, the first in the
+ * most significant bits, with any partly filled last byte padded with 0
+ */
+static void
+pack_values(uint8_t *out, const uint8_t *v, int n, int bits)
+{
+	int x;
+
+	if (bits == 4) {
+		for (x = 0; x + 2 <= n; x += 2)
+			*out++ = (v[x] << 4) | v[x+1];
+		if (x < n)
+			*out = v[x] << 4;
+	} else {
+		for (x = 0; x + 8 <= n; x += 8)
+			*out++ = (v[x] << 7) | (v[x+1] << 6) | (v[x+2] << 5) | (v[x+3] << 4)
+				| (v[x+4] << 3) | (v[x+5] << 2) | (v[x+6] << 1) | v[x+7];
+		if (x < n) {
+			*out = 0;
+			for (bits = 7; x < n; x++, bits--)
+				*out |= v[x] << bits;
+		}
+	}
+}
+
+/*
+ * row function for convert_picture() to copy rows of a picture in
+ * memory (arg)
+ */
+typedef struct {
+	Pixel	*data;
+	long	width;
+} Copy_Source;
+
+static void
+copy_row(void *arg, int y, Pixel *row)
+{
+	Copy_Source *src = (Copy_Source *)arg;
+
+	memcpy(row, src->data + y * src->width, sizeof(Pixel) * (size_t)src->width);
+}
+
+/*
+ * convert and output an image_w x image_h picture, either from "data" or,
+ * if that is NULL, a row at a time from getrow(arg, ...); in that case
+ * "window" must have room for two rows
+ */
+static void
+convert_picture(Converter *cv, Pixel *data, Row_Func getrow, void *arg, Pixel *window)
+{
+	unsigned char red,green,blue;		/* RGB colors for each pixel */
+	int line,column;
+	long completed;
+	long linelen;
+	int bits;				/* bits per pixel, if less than 8 */
+	Copy_Source src;
+
+	linelen = cv->image_w;
+
+/*
+ * dithering changes the pixels as it goes, so rather than working on
+ * "data" (which may be shared with the next mipmap level or output
+ * format) it gets a copy of each row, just as if the rows were being
+ * read one at a time
+ */
+	if (data && cv->dither_flag) {
+		cv->copy = my_malloc(2 * sizeof(Pixel) * (size_t)linelen);
+		if (!cv->copy)
+			fail(cv, "ERROR: insufficient memory for image");
+		src.data = data;
+		src.width = linelen;
+		getrow = copy_row;
+		arg = &src;
+		window = cv->copy;
+		data = 0;
+	}
+
+/*
+ * formats with less than 8 bits per pixel are packed and output a row
+ * at a time, rather than a pixel at a time
+ */
+	bits = 0;
+	if (cv->data_type == MSK || cv->data_type == CRY1 || cv->data_type == RGB1)
+		bits = 1;
+	else if (cv->data_type == CRY4 || cv->data_type == RGB4)
+		bits = 4;
+	if (bits) {
+		cv->row_values = my_malloc(linelen);
+		cv->packed = my_malloc(linelen / 2 + 1);
+		if (!cv->row_values || !cv->packed)
+			fail(cv, "ERROR: insufficient memory for image");
+	}
+	if (cv->data_type == MSK)
+		mask_init();
+
+	if (!data) {
+		(*getrow)(arg, 0, window);
+		if (cv->image_h > 1)
+			(*getrow)(arg, 1, window + linelen);
+	}
+
+	for(line = 0; line < cv->image_h; line++)
+	{
+		/* dithering spreads errors into the row after cur_row */
+		cv->cur_row = data ? data + line * linelen : window;
+		if (cv->data_type == MSK) {
+			mask_bits(cv->packed, cv->cur_row, cv->image_w);
+		} else {
+			for(column = 0; column < cv->image_w; column++)
+			{
+				blue = cv->cur_row[column].blue;
+				green = cv->cur_row[column].green;
+				red = cv->cur_row[column].red;
+				convert_rgb_pixel(cv, red,green,blue,line,column);
+			}
+			if (bits)
+				pack_values(cv->packed, cv->row_values, cv->image_w, bits);
+		}
+		if (bits)
+			output_bits(cv, cv->packed, linelen * bits);
+		if (!data && line + 1 < cv->image_h) {
+			memcpy(window, window + linelen, linelen * sizeof(Pixel));
+			if (line + 2 < cv->image_h)
+				(*getrow)(arg, line + 2, window + linelen);
+		}
+		completed = (cv->image_h - line) * 100L / cv->image_h;
+		draw_percentage(cv, 100-completed);
+	}
+
+	draw_percentage(cv, 101);		/* mark the end of the progress report */
+
+	if (bits) {
+		my_free(cv->row_values);
+		my_free(cv->packed);
+		cv->row_values = cv->packed = 0;
+	}
+	if (cv->copy) {
+		my_free(cv->copy);
+		cv->copy = 0;
+	}
+
+/* sync to a word boundary */
+	output_sync(cv);
+}
+
+/*************************************************************************
+make_newdata(Converter *cv): here's where the actual TGA to CRY conversion takes
+place
+**************************************************************************/
+ 
+void
+make_newdata(Converter *cv)
+{
+	int line;
+	uint32_t blitflags;
+	int pixsiz;
+	Row_Func getrow;			/* gives the rows, when streaming */
+	void *getarg;
+	int resize_flags;
+	unsigned in_w, in_h;			/* size before resizing */
+	int level;
+	unsigned mip_w[MAX_MIPMAPS], mip_h[MAX_MIPMAPS];	/* size of each mipmap level */
+	long offset;				/* offset of a mipmap level from the header */
+	long level_start;			/* output size when the level was started */
+	long compressed_size;
+
+	/* start the output afresh */
+	cv->items_per_line = 0;				/* count words per line in new file */
+	cv->binary_file_size = 0;
+	cv->binary_bit_size = 0;
+	cv->bit_buffer = 0;
+	cv->out_nwords = 0;
+	cv->out_odd_byte = -1;
+	cv->out_tlen = 0;
+	getrow = 0;
+	getarg = 0;
+	in_w = cv->image_w;
+	in_h = cv->image_h;
+
+	resize_flags = rescale_flags(cv);
+
+/*
+ * if the whole resized picture isn't needed (for the palette, to build
+ * mipmaps from, or so that several threads can work on it) resize it a
+ * row at a time as we convert it, rather than making a whole new copy
+ * of it; with -memlimit, the picture was never read in (srcfile is NULL)
+ * and always goes through a row at a time
+ */
+	if (!cv->srcfile || (cv->rescale_w && cv->rescale_h && cv->max_colors == 0 && cv->num_threads == 1 && cv->mip_levels == 1)) {
+		if ( cv->rescale_w && cv->rescale_h && !cv->quiet_flag )
+			fprintf(progress_file(cv), "Resizing image to %d x %d...\n", cv->rescale_w, cv->rescale_h);
+		cv->resizer = open_rows(cv, in_w, in_h, resize_flags, &getrow, &getarg);
+		if (cv->rescale_w && cv->rescale_h) {
+			cv->image_w = cv->rescale_w;
+			cv->image_h = cv->rescale_h;
+		}
+		cv->window = my_malloc(2 * sizeof(Pixel) * (size_t)cv->image_w);
+		if (!cv->window)
+			fail(cv, "ERROR: insufficient memory for image");
+		cv->newdata = 0;
+	} else if (cv->rescale_w && cv->rescale_h) {		/* we should resize the picture */
+		if ( !cv->quiet_flag )
+			fprintf(progress_file(cv), "Resizing image to %d x %d...\n", cv->rescale_w, cv->rescale_h);
+		cv->newdata = rescale(cv->srcfile, cv->image_w, cv->image_h, cv->rescale_w, cv->rescale_h, cv->filter_type,
+				resize_flags, cv->num_threads);
+		if (!cv->newdata)
+			fail(cv, "ERROR: Unable to allocate memory to resize picture");
+		cv->image_w = cv->rescale_w;
+		cv->image_h = cv->rescale_h;
+	} else {
+		cv->newdata = cv->srcfile;
+	}
+
+/*
+ * each mipmap level is half the size of the one before it
+ */
+	mip_w[0] = cv->image_w;
+	mip_h[0] = cv->image_h;
+	for (level = 1; level < cv->mip_levels; level++) {
+		if (mip_w[level-1] == 1 && mip_h[level-1] == 1)
+			fail(cv, "ERROR: picture is too small for %d mipmap levels", cv->mip_levels);
+		mip_w[level] = (mip_w[level-1] > 1) ? mip_w[level-1] / 2 : 1;
+		mip_h[level] = (mip_h[level-1] > 1) ? mip_h[level-1] / 2 : 1;
+	}
+
+/*
+ * if max_colors is nonzero, we must palettize the image; all the
+ * mipmap levels share the palette of the largest one
+ */
+	if (cv->max_colors != 0) {
+		if (!cv->quiet_flag)
+			fprintf(progress_file(cv), "Constructing palette for image...\n");
+		if (cv->newdata) {
+			cv->num_colors = build_palette(cv->max_colors, cv->palette, cv->newdata, (long)cv->image_w * (long)cv->image_h, cv->refine_iters, cv);
+			if (cv->num_colors < 0)
+				fail(cv, "ERROR: insufficient memory to build palette");
+		} else {
+		/* go through the picture twice: once for the palette, then to convert it */
+			cv->hist = palette_start(cv->refine_iters);
+			if (!cv->hist)
+				fail(cv, "ERROR: insufficient memory to build palette");
+			for (line = 0; line < cv->image_h; line++) {
+				(*getrow)(getarg, line, cv->window);
+				palette_add(cv->hist, cv->window, cv->image_w);
+			}
+			cv->num_colors = palette_finish(cv->hist, cv->max_colors, cv->palette, cv->refine_iters, cv);
+			cv->hist = 0;
+			if (cv->resizer) {
+				resize_close(cv->resizer);
+				cv->resizer = 0;
+				cv->resizer = open_rows(cv, in_w, in_h, resize_flags, &getrow, &getarg);
+			}
+		}
+		if (cv->data_type == CRY8 || cv->data_type == CRY4 || cv->data_type == CRY1) {
+			cryize_palette(cv);
+		} else {
+			rgbize_palette(cv);
+		}
+	}
+
+	blitflags = blit_flags(cv, cv->image_w, &pixsiz);
+
+	if (cv->object_format)
+		object_start(&cv->sink, cv->object_format);
+	if (cv->compress_method) {
+		cv->compressor = compress_open(&cv->sink, cv->compress_method, cv->num_threads);
+		if (!cv->compressor)
+			fail(cv, "ERROR: insufficient memory to compress");
+	}
+
+	if (cv->c_flag) {
+	/*
+	 * C arrays: the size and blitter flags (and the table of mipmap
+	 * levels) are constants of their own rather than a header, and
+	 * the picture is an array of whole pixels (or bytes, for formats
+	 * with less than 8 bits per pixel)
+	 */
+		cv->binary_file_size = 0;
+		sink_printf(&cv->sink, "/* %s: %d x %d */\n\n", cv->picname, cv->image_w, cv->image_h);
+		sink_printf(&cv->sink, "#include <stdint.h>\n\n");
+		sink_printf(&cv->sink, "static const uint16_t %s_width = %d;\n", cv->picname, cv->image_w);
+		sink_printf(&cv->sink, "static const uint16_t %s_height = %d;\n", cv->picname, cv->image_h);
+		if (blitflags & 0x00007E00u)		/* the WID bits, if the width is blittable */
+			sink_printf(&cv->sink, "static const uint32_t %s_blitflags = 0x%08" PRIX32 ";\t/* PITCH1|PIXEL%d|WID%d|XADDINC */\n",
+				cv->picname, blitflags, pixsiz, cv->image_w);
+		else
+			sink_printf(&cv->sink, "static const uint32_t %s_blitflags = 0x%08" PRIX32 ";\t/* PITCH1|PIXEL%d|XADDINC */\n",
+				cv->picname, blitflags, pixsiz);
+		if (cv->mip_levels > 1) {
+			sink_printf(&cv->sink, "static const uint16_t %s_nlevels = %d;\n", cv->picname, cv->mip_levels);
+			sink_printf(&cv->sink, "/* width, height, blitter flags and byte offset in %s[] of each level */\n", cv->picname);
+			sink_printf(&cv->sink, "static const uint32_t %s_levels[%d][4] = {\n", cv->picname, cv->mip_levels);
+			offset = 0;
+			for (level = 0; level < cv->mip_levels; level++) {
+				blitflags = blit_flags(cv, mip_w[level], &pixsiz);
+				sink_printf(&cv->sink, "\t{ %d, %d, 0x%08" PRIX32 ", %ld },\n", mip_w[level], mip_h[level], blitflags, offset);
+				offset += (data_size(mip_w[level], mip_h[level], pixsiz) + 7) & ~7L;
+			}
+			sink_printf(&cv->sink, "};\n");
+		}
+		c_array_start(cv, (pixsiz >= 16) ? pixsiz / 8 : 1, "");
+	} else if (cv->header_flag) {
+	/* do a fancy header */
+		if (cv->binary_flag) {
+			cv->binary_file_size = 0;
+			output_word(cv, cv->image_w);
+			output_word(cv, cv->image_h);
+			output_long(cv, blitflags);
+		} else {
+			sink_printf(&cv->sink, "\t.globl\t%s\n",cv->picname);
+			if (!cv->nodata_flag)
+				sink_printf(&cv->sink, "\t.data\n");
+			sink_printf(&cv->sink, "\t.phrase\n");
+			sink_printf(&cv->sink, "%s:\n", cv->picname);
+			sink_printf(&cv->sink, "\tdc.w\t%d,%d\n",cv->image_w,cv->image_h);
+			sink_printf(&cv->sink, "\tdc.l\t$%08" PRIX32 "\t;(PITCH1|PIXEL%d|WID%d|XADDINC)\n", blitflags, pixsiz, cv->image_w);
+		}
+	/*
+	 * for mipmaps, a phrase with the number of levels and then a table
+	 * with a width, height, blitter flags and offset (from the start of
+	 * the header) for each level, one level per 2 phrases
+	 */
+		if (cv->mip_levels > 1) {
+			offset = 16 + 16L * cv->mip_levels;
+			if (cv->binary_flag) {
+				output_word(cv, cv->mip_levels);
+				output_word(cv, 0);
+				output_long(cv, 0);
+			} else {
+				sink_printf(&cv->sink, "\tdc.w\t%d,0,0,0\t;number of mipmap levels\n", cv->mip_levels);
+			}
+			for (level = 0; level < cv->mip_levels; level++) {
+				blitflags = blit_flags(cv, mip_w[level], &pixsiz);
+				if (cv->binary_flag) {
+					output_word(cv, mip_w[level]);
+					output_word(cv, mip_h[level]);
+					output_long(cv, blitflags);
+					output_long(cv, offset);
+					output_long(cv, 0);
+				} else {
+					sink_printf(&cv->sink, "\tdc.w\t%d,%d\n", mip_w[level], mip_h[level]);
+					sink_printf(&cv->sink, "\tdc.l\t$%08" PRIX32 ",%ld,0\t;level %d\n", blitflags, offset, level);
+				}
+				offset += (data_size(mip_w[level], mip_h[level], pixsiz) + 7) & ~7L;
+			}
+		}
+	} else {
+	/* do a plain header */
+		if (cv->binary_flag) {
+			cv->binary_file_size = 0;
+		} else {
+			sink_printf(&cv->sink, "\t.globl\t%s\n",cv->picname);
+			if (!cv->nodata_flag)
+				sink_printf(&cv->sink, "\t.data\n");
+			sink_printf(&cv->sink, "\t.phrase\n");
+			sink_printf(&cv->sink, "%s:\n", cv->picname);
+			sink_printf(&cv->sink, ";%d x %d\n",cv->image_w,cv->image_h);
+		}
+		for (level = 1; level < cv->mip_levels; level++)
+			blit_flags(cv, mip_w[level], &pixsiz);
+	}
+
+/*
+ * now the levels themselves; each one after the first is filtered
+ * down from the one before it (dithering doesn't change that one),
+ * and starts on a phrase boundary
+ */
+	for (level = 0; level < cv->mip_levels; level++) {
+		if (level + 1 < cv->mip_levels) {
+			cv->nextdata = rescale(cv->newdata, mip_w[level], mip_h[level], mip_w[level+1], mip_h[level+1],
+					cv->filter_type, resize_flags & ~RESCALE_ASPECT, cv->num_threads);
+			if (!cv->nextdata)
+				fail(cv, "ERROR: Unable to allocate memory for mipmaps");
+		}
+		cv->image_w = mip_w[level];
+		cv->image_h = mip_h[level];
+		if (cv->mip_levels > 1 && !cv->binary_flag) {
+			output_flush(cv);
+			sink_printf(&cv->sink, ";level %d: %d x %d\n", level, cv->image_w, cv->image_h);
+		}
+		level_start = output_size(cv);
+		convert_picture(cv, cv->newdata, getrow, getarg, cv->window);
+		if (level + 1 < cv->mip_levels)
+			output_phrase_pad(cv, level_start);
+		if (cv->newdata != cv->srcfile)
+			my_free(cv->newdata);
+		cv->newdata = cv->nextdata;
+		cv->nextdata = 0;
+	}
+
+	if (cv->resizer) {
+		resize_close(cv->resizer);
+		cv->resizer = 0;
+	}
+	if (cv->window) {
+		my_free(cv->window);
+		cv->window = 0;
+	}
+
+/* now output the palette, if there is one */
+	if (cv->max_colors != 0) {
+		if (cv->c_flag) {
+			c_array_end(cv);
+			sink_printf(&cv->sink, "static const uint16_t %s_ncolors = %d;\n", cv->picname, cv->num_colors);
+			c_array_start(cv, 2, "_palette");
+		} else {
+			if (!cv->binary_flag) {
+				output_flush(cv);
+				sink_printf(&cv->sink,"\n;palette data: number of colors, then the palette entries\n");
+			}
+			output_word(cv, cv->num_colors);
+		}
+		for (line = 0; line < cv->num_colors; line++) {
+			output_word(cv, cv->palette[line].outval);
+		}
+	}
+
+/* round binary file size off to a phrase boundary */
+	if (cv->c_flag) {
+		c_array_end(cv);
+	} else if (cv->binary_flag) {
+		for (line = (8 - (output_size(cv) & 7)) & 7; line > 0; line--)
+			output_byte(cv, 0);
+	}
+	output_flush(cv);
+	if (cv->compressor) {
+		compressed_size = compress_close(cv->compressor);
+		cv->compressor = 0;
+		if (!cv->quiet_flag)
+			fprintf(progress_file(cv), "Compressed %ld bytes to %ld\n", cv->binary_file_size, compressed_size);
+	}
+	if (cv->object_format)
+		object_finish(&cv->sink, cv->object_format, cv->picname, cv->binary_file_size, cv->nodata_flag);
+}
+
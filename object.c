@@ -0,0 +1,208 @@
+/*
+ * writing the converted picture as a relocatable object file, so that
+ * it can go straight to the linker without being assembled first
+ *
+ * The object has one section holding exactly the bytes that -binary
+ * would have written, and one global symbol (the same one the
+ * assembly language output defines) at its start. The section is
+ * .data, or .text with -nodata, just as in the assembly output.
+ *
+ * Two formats are supported, both big endian for the 68000:
+ *   OBJECT_AOUT	BSD a.out (OMAGIC), as read by aln
+ *   OBJECT_ELF		ELF32 (EM_68K), as read by the GNU binutils
+ *
+ * object_start() is called before any of the data is written, and
+ * leaves room for the file header; object_finish() is called after
+ * all of it has been written, with its size, and adds the symbol
+ * table and then goes back and fills in the header. Everything is
+ * written through a Sink, which must be seekable (a file opened in
+ * binary mode, or a buffer).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tgadefs.h"
+#include "tgaproto.h"
+
+#define AOUT_HDRSIZE	32		/* size of an a.out header */
+#define AOUT_OMAGIC	0x0107		/* a.out magic number for relocatable objects */
+#define AOUT_N_TEXT	0x04		/* a.out symbol types */
+#define AOUT_N_DATA	0x06
+#define AOUT_N_EXT	0x01
+
+#define ELF_HDRSIZE	52		/* size of an ELF32 header */
+#define ELF_DATAPOS	64		/* where the section data starts (a phrase boundary) */
+#define ELF_SHDRSIZE	40		/* size of an ELF32 section header */
+#define ELF_SYMSIZE	16		/* size of an ELF32 symbol */
+#define ELF_NSECTIONS	5		/* null, data, .symtab, .strtab, .shstrtab */
+#define EM_68K		4
+#define SHT_PROGBITS	1
+#define SHT_SYMTAB	2
+#define SHT_STRTAB	3
+#define SHF_WRITE	0x1
+#define SHF_ALLOC	0x2
+#define SHF_EXECINSTR	0x4
+#define STB_GLOBAL	1
+#define STT_OBJECT	1
+
+/* store big endian values */
+static void
+put16(unsigned char *p, unsigned long v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+static void
+put32(unsigned char *p, unsigned long v)
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+/*
+ * leave room for the header of an object file of the given format
+ */
+void
+object_start(Sink *f, int format)
+{
+	unsigned char hdr[ELF_DATAPOS];
+
+	memset(hdr, 0, sizeof(hdr));
+	sink_write(f, hdr, (format == OBJECT_ELF) ? ELF_DATAPOS : AOUT_HDRSIZE);
+}
+
+/*
+ * a.out: the symbol table is a single nlist entry, and the string
+ * table is its size (including the size itself) followed by the name
+ */
+static void
+aout_finish(Sink *f, const char *name, long size, int text)
+{
+	unsigned char hdr[AOUT_HDRSIZE];
+	unsigned char sym[12];
+	unsigned char len[4];
+	size_t namelen = strlen(name) + 1;
+
+	put32(sym, 4);				/* the name follows the string table size */
+	sym[4] = (text ? AOUT_N_TEXT : AOUT_N_DATA) | AOUT_N_EXT;
+	sym[5] = 0;
+	put16(sym+6, 0);
+	put32(sym+8, 0);			/* data addresses start after the (empty) text */
+	sink_write(f, sym, sizeof(sym));
+	put32(len, 4 + namelen);
+	sink_write(f, len, sizeof(len));
+	sink_write(f, name, namelen);
+
+	memset(hdr, 0, sizeof(hdr));
+	put32(hdr, AOUT_OMAGIC);
+	put32(hdr+4, text ? size : 0);		/* a_text */
+	put32(hdr+8, text ? 0 : size);		/* a_data */
+	put32(hdr+16, sizeof(sym));		/* a_syms */
+	sink_seek(f, 0L, SEEK_SET);
+	sink_write(f, hdr, sizeof(hdr));
+}
+
+/*
+ * ELF: after the section data come the symbol table (a null symbol,
+ * then ours), the symbol and section name string tables, and the
+ * section headers
+ */
+static void
+elf_finish(Sink *f, const char *name, long size, int text)
+{
+	unsigned char hdr[ELF_HDRSIZE];
+	unsigned char syms[2*ELF_SYMSIZE];
+	unsigned char shdr[ELF_NSECTIONS][ELF_SHDRSIZE];
+	static const char shstrtab[] = "\0.text\0.data\0.symtab\0.strtab\0.shstrtab";
+	static const unsigned char pad[4] = { 0, 0, 0, 0 };
+	size_t namelen = strlen(name) + 1;
+	long symoff, stroff, shstroff, shoff;
+	unsigned char *sh;
+
+	/* the data size is always a whole number of phrases, so this is aligned */
+	symoff = ELF_DATAPOS + size;
+	stroff = symoff + sizeof(syms);
+	shstroff = stroff + 1 + namelen;
+	shoff = (shstroff + sizeof(shstrtab) + 3) & ~3L;
+
+	memset(syms, 0, sizeof(syms));
+	put32(syms+ELF_SYMSIZE, 1);		/* st_name */
+	put32(syms+ELF_SYMSIZE+4, 0);		/* st_value */
+	put32(syms+ELF_SYMSIZE+8, size);	/* st_size */
+	syms[ELF_SYMSIZE+12] = (STB_GLOBAL << 4) | STT_OBJECT;
+	put16(syms+ELF_SYMSIZE+14, 1);		/* st_shndx */
+	sink_write(f, syms, sizeof(syms));
+	sink_write(f, pad, 1);
+	sink_write(f, name, namelen);
+	sink_write(f, shstrtab, sizeof(shstrtab));
+	sink_write(f, pad, shoff - (shstroff + sizeof(shstrtab)));
+
+	memset(shdr, 0, sizeof(shdr));
+	sh = shdr[1];				/* the picture */
+	put32(sh, text ? 1 : 7);
+	put32(sh+4, SHT_PROGBITS);
+	put32(sh+8, text ? (SHF_ALLOC|SHF_EXECINSTR) : (SHF_ALLOC|SHF_WRITE));
+	put32(sh+16, ELF_DATAPOS);
+	put32(sh+20, size);
+	put32(sh+32, 8);			/* aligned to a phrase */
+	sh = shdr[2];				/* .symtab */
+	put32(sh, 13);
+	put32(sh+4, SHT_SYMTAB);
+	put32(sh+16, symoff);
+	put32(sh+20, sizeof(syms));
+	put32(sh+24, 3);			/* sh_link: the string table */
+	put32(sh+28, 1);			/* sh_info: first global symbol */
+	put32(sh+32, 4);
+	put32(sh+36, ELF_SYMSIZE);
+	sh = shdr[3];				/* .strtab */
+	put32(sh, 21);
+	put32(sh+4, SHT_STRTAB);
+	put32(sh+16, stroff);
+	put32(sh+20, 1 + namelen);
+	put32(sh+32, 1);
+	sh = shdr[4];				/* .shstrtab */
+	put32(sh, 29);
+	put32(sh+4, SHT_STRTAB);
+	put32(sh+16, shstroff);
+	put32(sh+20, sizeof(shstrtab));
+	put32(sh+32, 1);
+	sink_write(f, shdr, sizeof(shdr));
+
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = 0x7f;
+	hdr[1] = 'E';
+	hdr[2] = 'L';
+	hdr[3] = 'F';
+	hdr[4] = 1;				/* ELFCLASS32 */
+	hdr[5] = 2;				/* ELFDATA2MSB */
+	hdr[6] = 1;				/* EV_CURRENT */
+	put16(hdr+16, 1);			/* e_type: ET_REL */
+	put16(hdr+18, EM_68K);
+	put32(hdr+20, 1);			/* e_version */
+	put32(hdr+32, shoff);
+	put16(hdr+40, ELF_HDRSIZE);
+	put16(hdr+46, ELF_SHDRSIZE);
+	put16(hdr+48, ELF_NSECTIONS);
+	put16(hdr+50, ELF_NSECTIONS-1);		/* e_shstrndx */
+	sink_seek(f, 0L, SEEK_SET);
+	sink_write(f, hdr, sizeof(hdr));
+}
+
+/*
+ * finish off an object file, now that all "size" bytes of data have
+ * been written; "name" is the global symbol to define at the start of
+ * the data, and if "text" is nonzero the data goes in the text section
+ */
+void
+object_finish(Sink *f, int format, const char *name, long size, int text)
+{
+	if (format == OBJECT_ELF)
+		elf_finish(f, name, size, text);
+	else
+		aout_finish(f, name, size, text);
+	sink_seek(f, 0L, SEEK_END);
+}
@@ -16,14 +16,43 @@
  * of how often each color is used. In order to keep the table within
  * a reasonable size, only 5 bits each of red, green, and blue are
  * used.
+ *
+ * If refine_iters is nonzero, the popular colors are then used as the
+ * starting point for that many Lloyd (k-means) iterations over the
+ * histogram, so that each palette entry moves to the weighted mean of
+ * the colors it actually represents rather than sitting on a histogram
+ * bin corner. Since this works on the (at most 32768) occupied bins,
+ * the cost does not depend on the size of the picture.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "tgadefs.h"
 #include "tgaproto.h"
 
-long color_count[32768];
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+
+#if __MSDOS__
+#include <alloc.h>
+#define my_malloc(x) farmalloc((long)(x))
+#define my_free(x) farfree(x)
+#else
+#define my_malloc(x) malloc(x)
+#define my_free(x) free(x)
+#endif
+
+/*
+ * the histogram; each caller has its own, so that palettes for
+ * different pictures can be built at the same time
+ */
+struct Histogram {
+	long	count[32768];		/* number of pixels in each bin */
+	int64_t	(*sum)[3];		/* sum of the real red, green, blue values in each bin, or NULL */
+};
 
 /*
  * routines to convert to/from color indexes
@@ -55,13 +84,27 @@ UNHASH(int i)
 }
 
 /*
- * count how often each color occurs
+ * count how often each color occurs (adding to the counts so far)
  */
 static void
-count_colors(Pixel *pix, long numpixels)
+count_colors(Histogram *h, Pixel *pix, long numpixels)
 {
+	long *color_count = h->count;
+	int64_t (*color_sum)[3] = h->sum;
 	int index;
 
+	if (color_sum) {
+		while (numpixels) {
+			index = HASH(*pix);
+			color_count[index]++;
+			color_sum[index][0] += pix->red;
+			color_sum[index][1] += pix->green;
+			color_sum[index][2] += pix->blue;
+			pix++;
+			numpixels--;
+		}
+		return;
+	}
 	while (numpixels) {
 		index = HASH(*pix);
 		color_count[index]++; 
@@ -75,8 +118,9 @@ count_colors(Pixel *pix, long numpixels)
  * returns -1 if no color occurs more than 0 times
  */
 static INLINE int
-most_popular_color(void)
+most_popular_color(Histogram *h)
 {
+	long *color_count = h->count;
 	long popcount;
 	long popidx;
 	int i;
@@ -93,25 +137,288 @@ most_popular_color(void)
 	return popidx;
 }
 
+/*
+ * k-means refinement of the palette
+ *
+ * The histogram bins are the points being clustered: each is
+ * weighted by its pixel count and sits at the mean of the pixels
+ * that fell into it. The palette centers are kept in planar
+ * float arrays, padded to a multiple of 4 with centers that can
+ * never win, so that the assignment step can compare a bin against
+ * 4 centers at a time.
+ */
+typedef struct {
+	float	red, green, blue;	/* mean color of the bin */
+	float	weight;			/* number of pixels in the bin */
+	int	cluster;		/* palette entry this bin belongs to */
+} Bin;
+
+#define FAR_AWAY	(1.0e9f)	/* coordinate of the padding centers */
+
+/*
+ * find the index of the center closest to (r,g,b); on ties the
+ * lowest index wins, so the SSE2 and plain C versions agree
+ */
+#ifdef HAVE_SSE2
+static INLINE int
+nearest_center(float r, float g, float b, const float *cr, const float *cg, const float *cb, int n)
+{
+	__m128 vr, vg, vb, d, t, mask, bestd, bestidx, idx;
+	float dd[4], ii[4];
+	int i, best;
+
+	vr = _mm_set1_ps(r);
+	vg = _mm_set1_ps(g);
+	vb = _mm_set1_ps(b);
+	bestd = _mm_set1_ps(3.0e18f);
+	bestidx = _mm_setzero_ps();
+	idx = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	for (i = 0; i < n; i += 4) {
+		t = _mm_sub_ps(_mm_loadu_ps(cr + i), vr);
+		d = _mm_mul_ps(t, t);
+		t = _mm_sub_ps(_mm_loadu_ps(cg + i), vg);
+		d = _mm_add_ps(d, _mm_mul_ps(t, t));
+		t = _mm_sub_ps(_mm_loadu_ps(cb + i), vb);
+		d = _mm_add_ps(d, _mm_mul_ps(t, t));
+		mask = _mm_cmplt_ps(d, bestd);
+		bestd = _mm_min_ps(d, bestd);
+		bestidx = _mm_or_ps(_mm_and_ps(mask, idx), _mm_andnot_ps(mask, bestidx));
+		idx = _mm_add_ps(idx, _mm_set1_ps(4.0f));
+	}
+	_mm_storeu_ps(dd, bestd);
+	_mm_storeu_ps(ii, bestidx);
+	best = 0;
+	for (i = 1; i < 4; i++) {
+		if (dd[i] < dd[best] || (dd[i] == dd[best] && ii[i] < ii[best]))
+			best = i;
+	}
+	return (int)ii[best];
+}
+#else
+static INLINE int
+nearest_center(float r, float g, float b, const float *cr, const float *cg, const float *cb, int n)
+{
+	float d, t, bestd;
+	int i, best;
+
+	bestd = 3.0e18f;
+	best = 0;
+	for (i = 0; i < n; i++) {
+		t = cr[i] - r;
+		d = t * t;
+		t = cg[i] - g;
+		d = d + t * t;
+		t = cb[i] - b;
+		d = d + t * t;
+		if (d < bestd) {
+			bestd = d;
+			best = i;
+		}
+	}
+	return best;
+}
+#endif
+
+static INLINE int
+round_color(float c)
+{
+	int v = (int)(c + 0.5f);
+
+	if (v < 0) return 0;
+	if (v > 255) return 255;
+	return v;
+}
+
+static void
+refine_palette(Palette_Entry *palette, int ncolors, Bin *bins, int nbins, int refine_iters)
+{
+	float cr[256+3], cg[256+3], cb[256+3];
+	double sr[256], sg[256], sb[256], sw[256];
+	int npad, iter, changed;
+	int i, c;
+
+	npad = (ncolors + 3) & ~3;
+	for (i = 0; i < npad; i++) {
+		if (i < ncolors) {
+			cr[i] = palette[i].color.red;
+			cg[i] = palette[i].color.green;
+			cb[i] = palette[i].color.blue;
+		} else {
+			cr[i] = cg[i] = cb[i] = FAR_AWAY;
+		}
+	}
+
+	for (iter = 0; iter < refine_iters; iter++) {
+		/* assignment step */
+		changed = 0;
+		for (i = 0; i < nbins; i++) {
+			c = nearest_center(bins[i].red, bins[i].green, bins[i].blue, cr, cg, cb, npad);
+			if (c != bins[i].cluster) {
+				bins[i].cluster = c;
+				changed++;
+			}
+		}
+		if (changed == 0)		/* converged */
+			break;
+
+		/* update step: move each center to the weighted mean of its bins */
+		for (c = 0; c < ncolors; c++)
+			sr[c] = sg[c] = sb[c] = sw[c] = 0.0;
+		for (i = 0; i < nbins; i++) {
+			c = bins[i].cluster;
+			sr[c] += bins[i].red * bins[i].weight;
+			sg[c] += bins[i].green * bins[i].weight;
+			sb[c] += bins[i].blue * bins[i].weight;
+			sw[c] += bins[i].weight;
+		}
+		for (c = 0; c < ncolors; c++) {
+			if (sw[c] == 0.0)	/* empty cluster: leave the center where it was */
+				continue;
+			cr[c] = (float)(sr[c] / sw[c]);
+			cg[c] = (float)(sg[c] / sw[c]);
+			cb[c] = (float)(sb[c] / sw[c]);
+		}
+	}
+
+	for (c = 0; c < ncolors; c++) {
+		palette[c].color.red = round_color(cr[c]);
+		palette[c].color.green = round_color(cg[c]);
+		palette[c].color.blue = round_color(cb[c]);
+	}
+}
+
+/*
+ * collect the occupied histogram bins for refinement
+ * returns the number of bins found, or -1 if out of memory
+ */
+static int
+collect_bins(Histogram *h, Bin **binsp)
+{
+	long *color_count = h->count;
+	int64_t (*color_sum)[3] = h->sum;
+	Bin *bins;
+	int i, nbins;
+
+	nbins = 0;
+	for (i = 0; i < 32768; i++) {
+		if (color_count[i] != 0)
+			nbins++;
+	}
+	bins = (Bin *)malloc((nbins ? nbins : 1) * sizeof(Bin));
+	if (!bins)
+		return -1;
+	nbins = 0;
+	for (i = 0; i < 32768; i++) {
+		if (color_count[i] != 0) {
+			bins[nbins].red = (float)color_sum[i][0] / (float)color_count[i];
+			bins[nbins].green = (float)color_sum[i][1] / (float)color_count[i];
+			bins[nbins].blue = (float)color_sum[i][2] / (float)color_count[i];
+			bins[nbins].weight = (float)color_count[i];
+			bins[nbins].cluster = -1;
+			nbins++;
+		}
+	}
+	*binsp = bins;
+	return nbins;
+}
+
+/*
+ * a palette can be built a piece of the picture at a time: call
+ * palette_start() to get a histogram, then palette_add() for each
+ * piece, and then palette_finish() to get the palette (and free
+ * the histogram); palette_start() returns NULL if there is not
+ * enough memory, and palette_free() throws a histogram away unused
+ */
+Histogram *
+palette_start(int refine_iters)
+{
+	Histogram *h;
+
+	h = my_malloc(sizeof(Histogram));
+	if (!h)
+		return NULL;
+	memset(h->count, 0, sizeof(h->count));
+	h->sum = NULL;
+	if (refine_iters > 0) {		/* the sums are only needed for refining */
+		h->sum = my_malloc(32768 * sizeof(*h->sum));
+		if (!h->sum) {
+			my_free(h);
+			return NULL;
+		}
+		memset(h->sum, 0, 32768 * sizeof(*h->sum));
+	}
+	return h;
+}
+
+void
+palette_free(Histogram *h)
+{
+	if (h->sum)
+		my_free(h->sum);
+	my_free(h);
+}
+
+void
+palette_add(Histogram *h, Pixel *pix, long numpixels)
+{
+	count_colors(h, pix, numpixels);
+}
+
 int
-build_palette(int max_colors, Palette_Entry *palette, Pixel *pix, long numpixels)
+palette_finish(Histogram *h, int max_colors, Palette_Entry *palette, int refine_iters, Converter *cv)
 {
 	int i;
 	int colidx;
+	int ncolors;
+	int nbins;
+	Bin *bins;
 
-	/* find how often various colors occur */
-	count_colors(pix, numpixels);
+	bins = NULL;
+	nbins = 0;
+	if (refine_iters > 0) {
+		nbins = collect_bins(h, &bins);
+		if (nbins < 0) {
+			warning(cv, "insufficient memory to refine palette");
+			refine_iters = 0;
+		}
+	}
 
 	/* now find the "max_colors" most frequently occuring colors */
+	ncolors = max_colors;
 	for (i = 0; i < max_colors; i++) {
-		colidx = most_popular_color();
+		colidx = most_popular_color(h);
 		if (colidx < 0) {		/* no more colors left in picture */
-			return i;
+			ncolors = i;
+			break;
 		}
 		palette[i].color = UNHASH(colidx);
-		color_count[colidx] = 0;	/* remove that color from consideration */
+		h->count[colidx] = 0;		/* remove that color from consideration */
 	}
-	if (most_popular_color() >= 0)
-		fprintf(stderr, "Warning: more than %d colors in image\n", max_colors);
-	return max_colors;
+	if (ncolors == max_colors && most_popular_color(h) >= 0)
+		warning(cv, "more than %d colors in image", max_colors);
+
+	if (refine_iters > 0) {
+		if (ncolors > 0)
+			refine_palette(palette, ncolors, bins, nbins, refine_iters);
+		free(bins);
+	}
+	palette_free(h);
+	return ncolors;
+}
+
+/*
+ * build a palette for a whole picture at once; returns the number of
+ * colors, or -1 if there is not enough memory
+ */
+int
+build_palette(int max_colors, Palette_Entry *palette, Pixel *pix, long numpixels, int refine_iters, Converter *cv)
+{
+	Histogram *h;
+
+	/* find how often various colors occur */
+	h = palette_start(refine_iters);
+	if (!h)
+		return -1;
+	palette_add(h, pix, numpixels);
+	return palette_finish(h, max_colors, palette, refine_iters, cv);
 }
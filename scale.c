@@ -9,6 +9,7 @@
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
@@ -70,20 +71,12 @@ get_pixel(image, x, y)
 Image *image;
 int x, y;
 {
-	static Image *im = NULL;
-	static int yy = -1;
-	static Pixel *p = NULL;
-	static Pixel dummypix = { 0, 0, 0 };
+	static const Pixel dummypix = { 0, 0, 0 };
 
 	if((x < 0) || (x >= image->xsize) || (y < 0) || (y >= image->ysize)) {
 		return dummypix;
 	}
-	if((im != image) || (yy != y)) {
-		im = image;
-		yy = y;
-		p = image->data + (y * image->span);
-	}
-	return(p[x]);
+	return(image->data[y * image->span + x]);
 }
 
 void
@@ -124,19 +117,10 @@ Image *image;
 int x, y;
 Pixel data;
 {
-	static Image *im = NULL;
-	static int yy = -1;
-	static Pixel *p = NULL;
-
 	if((x < 0) || (x >= image->xsize) || (y < 0) || (y >= image->ysize)) {
 		return;
 	}
-	if((im != image) || (yy != y)) {
-		im = image;
-		yy = y;
-		p = image->data + (y * image->span);
-	}
-	p[x] = data;
+	image->data[y * image->span + x] = data;
 }
 
 
@@ -272,294 +256,1617 @@ double t;
  *	image rescaling routine
  */
 
+/*
+ * The filter contributions for one pass are kept in a single block
+ * of memory: a CTAP for every output pixel giving the first input
+ * pixel it uses, the number of taps, and the offset of its weights,
+ * followed by the weights themselves, "stride" to a pattern. Output
+ * pixels whose weights are identical (which happens all the time
+ * with integer scale ratios) share one pattern.
+ *
+ * The taps for an output pixel are always a contiguous run of input
+ * pixels; "start" may be negative or the run may go past the end of
+ * the line, so callers extend the line with lpad and rpad mirrored
+ * pixels (see reflect()) before filtering it.
+ */
 typedef struct {
-	int	pixel;
-	double	weight;
-} CONTRIB;
+	int	start;		/* first input pixel */
+	int	n;		/* number of taps */
+	int	w;		/* offset of the weights for this pixel */
+} CTAP;
 
 typedef struct {
-	int	n;		/* number of contributors */
-	CONTRIB	*p;		/* pointer to list of contributions */
-} CLIST;
+	int	outsize;	/* number of output pixels */
+	int	insize;		/* number of input pixels */
+	int	stride;		/* space allotted for each weight pattern */
+	int	npatterns;	/* number of distinct weight patterns */
+	int	lpad, rpad;	/* pixels needed beyond the ends of the input */
+	CTAP	*tap;		/* outsize entries */
+	double	*weight;	/* npatterns * stride floating point weights */
+	int32_t	*iweight;	/* npatterns * stride fixed point weights */
+	size_t	size;		/* bytes it takes, with the above */
+} CTABLE;
 
-CLIST	*contrib;		/* array of contribution lists */
+/*
+ * fixed point resampling: the weights for each output pixel are
+ * scaled so that they add up to exactly 1 << WEIGHT_BITS, and the
+ * intermediate image keeps SAMPLE_BITS bits of fraction below the
+ * 8 bit pixel value so the second pass doesn't compound rounding
+ */
+#define WEIGHT_BITS	14
+#define WEIGHT_ONE	(1 << WEIGHT_BITS)
+#define SAMPLE_BITS	7
+#define SAMPLE_MAX	((WHITE_PIXEL << SAMPLE_BITS) | ((1 << SAMPLE_BITS) - 1))
 
-void
-zoom(dst, src, filterf, fwidth)
-Image *dst;				/* destination image structure */
-Image *src;				/* source image structure */
-double (*filterf)(double);	/* filter function */
-double fwidth;				/* filter width (support) */
+/*
+ * linear light: with RESCALE_LINEAR the pixel values are converted from
+ * sRGB to linear intensities (15 bit fixed point, 0 to LINEAR_MAX) before
+ * filtering and back again afterwards, so that averaging doesn't darken
+ * fine detail. Both conversions are done with tables; the one back to
+ * sRGB has an entry for every 1 << LINEAR_SHIFT linear steps.
+ */
+#define LINEAR_MAX	32767
+#define LINEAR_SHIFT	3
+
+static uint16_t to_linear[256];
+static uint8_t from_linear[(LINEAR_MAX >> LINEAR_SHIFT) + 1];
+
+static void
+make_linear_tables(void)
+{
+	int i;
+	double v;
+
+	if (to_linear[255])
+		return;			/* already done */
+	for (i = 0; i < 256; i++) {
+		v = i / 255.0;
+		v = (v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+		to_linear[i] = (uint16_t)floor(v * LINEAR_MAX + 0.5);
+	}
+	/* each entry is for the middle of its range of linear values */
+	for (i = 0; i <= (LINEAR_MAX >> LINEAR_SHIFT); i++) {
+		v = ((i << LINEAR_SHIFT) + (1 << (LINEAR_SHIFT - 1))) / (double)LINEAR_MAX;
+		if (v > 1.0) v = 1.0;
+		v = (v <= 0.0031308) ? v * 12.92 : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+		from_linear[i] = (uint8_t)floor(v * 255.0 + 0.5);
+	}
+}
+
+static INLINE int
+ICLAMP(int32_t value, int min, int max)
+{
+	if (value < min) return min;
+	if (value > max) return max;
+	return (int)value;
+}
+
+/* round a size up so that whatever follows it is suitably aligned */
+#define ARENA_ALIGN(x)	(((x) + 15) & ~(size_t)15)
+
+/*
+ * map a pixel index outside of 0..size-1 back into the line, by
+ * mirroring it about the end pixels
+ */
+static INLINE int
+reflect(int j, int size)
+{
+	if (j < 0) j = -j;
+	if (j >= size) j = (size - j) + size - 1;
+	if (j < 0) j = 0;		/* filter is wider than the whole line */
+	return j;
+}
+
+/*
+ * convert one pattern of weights to fixed point, normalized so that
+ * it sums to exactly WEIGHT_ONE; any rounding error is given to the
+ * largest tap
+ */
+static void
+fix_weights(int32_t *iw, const double *w, int n)
+{
+	int j, big;
+	double sum;
+	int32_t isum;
+
+	sum = 0.0;
+	for (j = 0; j < n; ++j)
+		sum += w[j];
+	if (sum == 0.0)
+		sum = 1.0;
+	isum = 0;
+	big = 0;
+	for (j = 0; j < n; ++j) {
+		iw[j] = (int32_t)floor(w[j] / sum * WEIGHT_ONE + 0.5);
+		isum += iw[j];
+		if (fabs(w[j]) > fabs(w[big]))
+			big = j;
+	}
+	if (n > 0)
+		iw[big] += WEIGHT_ONE - isum;
+}
+
+static unsigned
+hash_weights(const double *w, int n)
+{
+	const unsigned char *p = (const unsigned char *)w;
+	unsigned h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < n * sizeof(double); i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h ^ n;
+}
+
+/*
+ * Filters other than the box are sampled once into a table, at
+ * 1/KERNEL_STEPS steps from 0 out to their support (they are all
+ * symmetric), and make_ctable() interpolates between the samples
+ * rather than calling the filter for every tap of every pixel; the
+ * Lanczos and sinc filters call sin(), which is slow. The tables are
+ * kept until the program exits.
+ */
+#define KERNEL_STEPS	1024
+#define MAX_KERNELS	8
+
+static struct {
+	double	(*filterf)(double);
+	double	fwidth;
+	double	*tab;		/* samples at 0, 1/KERNEL_STEPS, ... */
+} kernels[MAX_KERNELS];
+
+/*
+ * find (or make) the table for a filter
+ * returns NULL if the filter should just be called directly
+ */
+static double *
+kernel_table(double (*filterf)(double), double fwidth)
+{
+	int i, k, n;
+	double *tab;
+
+	if (filterf == box_filter)
+		return NULL;		/* not continuous, and cheap anyway */
+	for (k = 0; k < MAX_KERNELS && kernels[k].tab; k++) {
+		if (kernels[k].filterf == filterf && kernels[k].fwidth == fwidth)
+			return kernels[k].tab;
+	}
+	if (k == MAX_KERNELS)
+		return NULL;
+	n = (int)ceil(fwidth * KERNEL_STEPS) + 2;
+	tab = (double *)my_malloc(n * sizeof(double));
+	if (!tab)
+		return NULL;
+	for (i = 0; i < n; i++)
+		tab[i] = (*filterf)((double)i / KERNEL_STEPS);
+	kernels[k].filterf = filterf;
+	kernels[k].fwidth = fwidth;
+	kernels[k].tab = tab;
+	return tab;
+}
+
+static INLINE double
+kernel_lookup(const double *tab, double fwidth, double t)
+{
+	double pos;
+	int i;
+
+	if (t < 0) t = -t;
+	if (t >= fwidth) return 0.0;
+	pos = t * KERNEL_STEPS;
+	i = (int)pos;
+	return tab[i] + (tab[i+1] - tab[i]) * (pos - i);
+}
+
+/*
+ * calculate the filter contributions for resampling a line of
+ * "insize" pixels to "outsize" pixels; unless "exact" is set the
+ * filter is looked up in a table rather than called for each tap
+ * returns NULL if there is not enough memory
+ */
+static CTABLE *
+make_ctable(int outsize, int insize, double (*filterf)(double), double fwidth, int exact)
 {
-	Image *tmp;			/* intermediate image */
-	double xscale, yscale;		/* zoom scale factors */
-	int i, j, k;			/* loop variables */
-	int n;				/* pixel number */
+	CTABLE *ct;
+	char *arena;
+	double scale;
 	double center, left, right;	/* filter calculation variables */
 	double width, fscale, weight;	/* filter calculation variables */
-	double red, green, blue;
-	Pixel *raster;			/* a row or column of pixels */
-	Pixel tmppixel;
+	int i, j, n;			/* loop variables */
+	int stride, hsize;
+	int *hash;			/* pattern hash table */
+	unsigned h;
+	double *w;
+	double *tab;			/* sampled filter, if any */
+	size_t tapsize, wsize, size;
 
-	/* create intermediate image to hold horizontal zoom */
-	tmp = new_image(dst->xsize, src->ysize);
-	if (!tmp) {
-		fprintf(stderr, "Unable to allocate memory for intermediate image\n");
-		exit(1);
-	}
-	xscale = (double) dst->xsize / (double) src->xsize;
-	yscale = (double) dst->ysize / (double) src->ysize;
-
-	/* pre-calculate filter contributions for a row */
-	contrib = (CLIST *)my_calloc(dst->xsize, sizeof(CLIST));
-	if(xscale < 1.0) {
-		width = fwidth / xscale;
-		fscale = 1.0 / xscale;
-		for(i = 0; i < dst->xsize; ++i) {
-			contrib[i].n = 0;
-			contrib[i].p = (CONTRIB *)my_calloc((int) (width * 2 + 1),
-					sizeof(CONTRIB));
-			center = (double) i / xscale;
-			left = ceil(center - width);
-			right = floor(center + width);
-			for(j = left; j <= right; ++j) {
-				weight = center - (double) j;
-				weight = (*filterf)(weight / fscale) / fscale;
-				if(j < 0) {
-					n = -j;
-				} else if(j >= src->xsize) {
-					n = (src->xsize - j) + src->xsize - 1;
-				} else {
-					n = j;
-				}
-				k = contrib[i].n++;
-				contrib[i].p[k].pixel = n;
-				contrib[i].p[k].weight = weight;
-			}
-		}
+	tab = exact ? NULL : kernel_table(filterf, fwidth);
+	scale = (double) outsize / (double) insize;
+	if (scale < 1.0) {
+		width = fwidth / scale;
+		fscale = 1.0 / scale;
 	} else {
-		for(i = 0; i < dst->xsize; ++i) {
-			contrib[i].n = 0;
-			contrib[i].p = (CONTRIB *)my_calloc((int) (fwidth * 2 + 1),
-					sizeof(CONTRIB));
-			center = (double) i / xscale;
-			left = ceil(center - fwidth);
-			right = floor(center + fwidth);
-			for(j = left; j <= right; ++j) {
-				weight = center - (double) j;
+		width = fwidth;
+		fscale = 1.0;
+	}
+	stride = (int) (width * 2 + 1);
+
+	/* allow for every pixel having its own pattern; usually they won't */
+	tapsize = ARENA_ALIGN(outsize * sizeof(CTAP));
+	wsize = ARENA_ALIGN(outsize * (size_t)stride * sizeof(double));
+	size = ARENA_ALIGN(sizeof(CTABLE)) + tapsize + wsize + outsize * (size_t)stride * sizeof(int32_t);
+	arena = (char *)my_malloc(size);
+	for (hsize = 16; hsize < 2 * outsize; hsize <<= 1)
+		;
+	hash = (int *)my_calloc(hsize, sizeof(int));
+	if (!arena || !hash) {
+		my_free(arena);
+		my_free(hash);
+		return NULL;
+	}
+	ct = (CTABLE *)arena;
+	arena += ARENA_ALIGN(sizeof(CTABLE));
+	ct->tap = (CTAP *)arena;
+	arena += tapsize;
+	ct->weight = (double *)arena;
+	arena += wsize;
+	ct->iweight = (int32_t *)arena;
+	ct->size = size;
+	ct->outsize = outsize;
+	ct->insize = insize;
+	ct->stride = stride;
+	ct->npatterns = 0;
+	ct->lpad = ct->rpad = 0;
+
+	for(i = 0; i < outsize; ++i) {
+		center = (double) i / scale;
+		left = ceil(center - width);
+		right = floor(center + width);
+		w = ct->weight + ct->npatterns * (size_t)stride;
+		n = 0;
+		for(j = left; j <= right; ++j) {
+			weight = center - (double) j;
+			if (tab)
+				weight = kernel_lookup(tab, fwidth, weight / fscale) / fscale;
+			else if (scale < 1.0)
+				weight = (*filterf)(weight / fscale) / fscale;
+			else
 				weight = (*filterf)(weight);
-				if(j < 0) {
-					n = -j;
-				} else if(j >= src->xsize) {
-					n = (src->xsize - j) + src->xsize - 1;
-				} else {
-					n = j;
-				}
-				k = contrib[i].n++;
-				contrib[i].p[k].pixel = n;
-				contrib[i].p[k].weight = weight;
-			}
+			w[n++] = weight;
+		}
+		ct->tap[i].start = (int)left;
+		ct->tap[i].n = n;
+		if ((int)left < 0 && -(int)left > ct->lpad)
+			ct->lpad = -(int)left;
+		if ((int)right >= insize && (int)right - insize + 1 > ct->rpad)
+			ct->rpad = (int)right - insize + 1;
+
+		/* share the weights with an earlier pixel if we can */
+		h = hash_weights(w, n) & (hsize - 1);
+		while (hash[h]) {
+			j = hash[h] - 1;
+			if (ct->tap[j].n == n
+			&& !memcmp(ct->weight + ct->tap[j].w, w, n * sizeof(double)))
+				break;
+			h = (h + 1) & (hsize - 1);
+		}
+		if (hash[h]) {
+			ct->tap[i].w = ct->tap[hash[h] - 1].w;
+		} else {
+			hash[h] = i + 1;
+			ct->tap[i].w = ct->npatterns * stride;
+			fix_weights(ct->iweight + ct->tap[i].w, w, n);
+			ct->npatterns++;
 		}
 	}
+	my_free(hash);
+	return ct;
+}
+
+/*
+ * The tables are also cached, so that resizing more pictures of the
+ * same size (or both directions of a square one) doesn't build them
+ * again. ctable_get() returns a table which must be handed back with
+ * ctable_release(); tables in use are never thrown out of the cache.
+ * The cache (and the sampled kernels) are shared by every conversion
+ * in the process, so they are only used with lock_shared() held.
+ *
+ * Normally up to 8 tables are kept; a program doing many conversions
+ * (tga2cry --serve) can instead give the cache a number of bytes with
+ * ctable_cache_limit(), and then keeps as many as fit, up to
+ * CT_CACHE_SIZE.
+ */
+#define CT_CACHE_SIZE	64
+
+static struct {
+	CTABLE	*ct;
+	double	(*filterf)(double);
+	double	fwidth;
+	int	exact;
+	int	users;		/* number of zooms using the table */
+	unsigned long used;	/* when it was last asked for */
+} ct_cache[CT_CACHE_SIZE];
+static unsigned long ct_clock;
+static int ct_max_tables = 8;
+static size_t ct_max_bytes;	/* 0 for no limit */
+
+/*
+ * let the cached tables take up to "bytes" bytes, rather than being
+ * limited to 8 of them; 0 goes back to the 8
+ */
+void
+ctable_cache_limit(long bytes)
+{
+	lock_shared();
+	ct_max_bytes = bytes > 0 ? (size_t)bytes : 0;
+	ct_max_tables = bytes > 0 ? CT_CACHE_SIZE : 8;
+	unlock_shared();
+}
+
+/*
+ * put ct in the cache if there's room, throwing out the tables asked
+ * for least recently (and not in use) to make it
+ */
+static void
+ctable_keep(CTABLE *ct, double (*filterf)(double), double fwidth, int exact)
+{
+	int i, n, slot, victim;
+	size_t total;
 
-	/* apply filter to zoom horizontally from src to tmp */
-	raster = (Pixel *)my_calloc(src->xsize, sizeof(Pixel));
-	for(k = 0; k < tmp->ysize; ++k) {
-		get_row(raster, src, k);
-		for(i = 0; i < tmp->xsize; ++i) {
-			red = green = blue = 0.0;
-			for(j = 0; j < contrib[i].n; ++j) {
-				red += raster[contrib[i].p[j].pixel].red
-					* contrib[i].p[j].weight;
-				green += raster[contrib[i].p[j].pixel].green
-					* contrib[i].p[j].weight;
-				blue += raster[contrib[i].p[j].pixel].blue
-					* contrib[i].p[j].weight;
+	for (;;) {
+		n = 0;
+		total = 0;
+		slot = victim = -1;
+		for (i = 0; i < CT_CACHE_SIZE; i++) {
+			if (!ct_cache[i].ct) {
+				if (slot < 0)
+					slot = i;
+				continue;
 			}
-			tmppixel.red = CLAMP(red, BLACK_PIXEL, WHITE_PIXEL);
-			tmppixel.green = CLAMP(green, BLACK_PIXEL, WHITE_PIXEL);
-			tmppixel.blue = CLAMP(blue, BLACK_PIXEL, WHITE_PIXEL);
-			put_pixel(tmp, i, k, tmppixel);
+			n++;
+			total += ct_cache[i].ct->size;
+			if (ct_cache[i].users == 0 && (victim < 0 || ct_cache[i].used < ct_cache[victim].used))
+				victim = i;
 		}
+		if (slot >= 0 && n < ct_max_tables && (!ct_max_bytes || total + ct->size <= ct_max_bytes))
+			break;
+		if (victim < 0)
+			return;			/* ctable_release() will free it */
+		my_free(ct_cache[victim].ct);
+		ct_cache[victim].ct = NULL;
 	}
-	my_free(raster);
-
-	/* free the memory allocated for horizontal filter weights */
-	for(i = 0; i < tmp->xsize; ++i) {
-		my_free(contrib[i].p);
-	}
-	my_free(contrib);
-
-	/* pre-calculate filter contributions for a column */
-	contrib = (CLIST *)my_calloc(dst->ysize, sizeof(CLIST));
-	if(yscale < 1.0) {
-		width = fwidth / yscale;
-		fscale = 1.0 / yscale;
-		for(i = 0; i < dst->ysize; ++i) {
-			contrib[i].n = 0;
-			contrib[i].p = (CONTRIB *)my_calloc((int) (width * 2 + 1),
-					sizeof(CONTRIB));
-			center = (double) i / yscale;
-			left = ceil(center - width);
-			right = floor(center + width);
-			for(j = left; j <= right; ++j) {
-				weight = center - (double) j;
-				weight = (*filterf)(weight / fscale) / fscale;
-				if(j < 0) {
-					n = -j;
-				} else if(j >= tmp->ysize) {
-					n = (tmp->ysize - j) + tmp->ysize - 1;
-				} else {
-					n = j;
-				}
-				k = contrib[i].n++;
-				contrib[i].p[k].pixel = n;
-				contrib[i].p[k].weight = weight;
-			}
+	ct_cache[slot].ct = ct;
+	ct_cache[slot].filterf = filterf;
+	ct_cache[slot].fwidth = fwidth;
+	ct_cache[slot].exact = exact;
+	ct_cache[slot].users = 1;
+	ct_cache[slot].used = ++ct_clock;
+}
+
+static CTABLE *
+ctable_get(int outsize, int insize, double (*filterf)(double), double fwidth, int exact)
+{
+	int i;
+	CTABLE *ct;
+
+	lock_shared();
+	for (i = 0; i < CT_CACHE_SIZE; i++) {
+		ct = ct_cache[i].ct;
+		if (ct && ct->outsize == outsize && ct->insize == insize && ct_cache[i].filterf == filterf
+		&& ct_cache[i].fwidth == fwidth && ct_cache[i].exact == exact) {
+			ct_cache[i].users++;
+			ct_cache[i].used = ++ct_clock;
+			unlock_shared();
+			return ct;
+		}
+	}
+	ct = make_ctable(outsize, insize, filterf, fwidth, exact);
+	if (ct)
+		ctable_keep(ct, filterf, fwidth, exact);
+	unlock_shared();
+	return ct;
+}
+
+static void
+ctable_release(CTABLE *ct)
+{
+	int i;
+
+	if (!ct)
+		return;
+	lock_shared();
+	for (i = 0; i < CT_CACHE_SIZE; i++) {
+		if (ct_cache[i].ct == ct) {
+			ct_cache[i].users--;
+			unlock_shared();
+			return;
 		}
+	}
+	unlock_shared();
+	my_free(ct);			/* wasn't room to cache it */
+}
+
+/*
+ * copy "size" samples of "count" bytes each from "src" (spaced "step"
+ * bytes apart) into "dst", adding lpad mirrored samples in front and
+ * rpad mirrored samples after; dst points at the first real sample
+ */
+static void
+pad_line(char *dst, const char *src, int size, long step, int count, int lpad, int rpad)
+{
+	int j;
+
+	for (j = -lpad; j < size + rpad; j++)
+		memcpy(dst + j * (long)count, src + reflect(j, size) * step, count);
+}
+
+/*
+ * everything the passes need to know about one zoom; the contribution
+ * tables are built once and only read by the workers, and each worker
+ * writes a disjoint set of rows, so the result doesn't depend on the
+ * number of threads
+ *
+ * The intermediate image (the output of the horizontal pass) has one
+ * row per source row, each "rowbytes" long; what a row holds depends
+ * on the method:
+ *	ZOOM_FLOAT	dst->xsize Pixels
+ *	ZOOM_FIXED	3 * dst->xsize 16 bit samples
+ *	ZOOM_PLANAR	3 planes of pw floats (red, then green, then blue)
+ * If "ring" is nonzero only that many rows are kept, and row y lives
+ * in slot y % ring; this is used to stream the output a band at a time.
+ * If the source has no data in memory, its rows are read into a ring
+ * of the same size (srcrows) just before they are filtered.
+ */
+/* scratch space for one worker */
+typedef struct {
+	Pixel	*raster;		/* a padded source row */
+	uint16_t *lraster;		/* the same, converted to linear light */
+	float	*line;			/* one channel of a padded source row (planar) */
+	void	*acc;			/* a row of accumulated samples */
+} SCRATCH;
+
+typedef struct {
+	Image	*dst;			/* destination image */
+	Image	*src;			/* source image */
+	int	method;			/* ZOOM_xxx */
+	int	linear;			/* filter in linear light (fixed point and planar only) */
+	CTABLE	*xct, *yct;		/* horizontal and vertical contributions */
+	char	*inter;			/* intermediate rows */
+	size_t	rowbytes;		/* size of an intermediate row */
+	int	ring;			/* number of intermediate rows kept, or 0 for all */
+	int	filled;			/* intermediate rows computed so far (streaming) */
+	Pixel	*srcrows;		/* ring of source rows, if src->data is NULL */
+	int	pw;			/* width of a plane, rounded up to a multiple of 8 */
+	int32_t	*pstart;		/* horizontal filter starts (planar zoom) */
+	float	*pweight;		/* horizontal filter weights (planar zoom) */
+	SCRATCH	*scratch;		/* one for each thread */
+	int	nscratch;
+} ZOOM;
+
+/* the ways the zoom can do the filtering */
+#define ZOOM_FLOAT	0		/* original double precision */
+#define ZOOM_FIXED	1		/* fixed point */
+#define ZOOM_PLANAR	2		/* planar single precision, with SIMD */
+
+/* first and last+1 lines of band "index" of "count" bands */
+#define BAND_START(lines, index, count)	((int)((long)(lines) * (index) / (count)))
+
+static INLINE char *
+inter_row(ZOOM *z, int y)
+{
+	return z->inter + (size_t)(z->ring ? y % z->ring : y) * z->rowbytes;
+}
+
+static INLINE Pixel *
+src_row(ZOOM *z, int y)
+{
+	if (z->srcrows)
+		return z->srcrows + (size_t)(y % z->ring) * z->src->xsize;
+	return z->src->data + y * z->src->span;
+}
+
+/*
+ * returns 0 if there is not enough memory (with whatever was
+ * allocated left for scratch_free())
+ */
+static int
+scratch_alloc(ZOOM *z, SCRATCH *s)
+{
+	CTABLE *ct = z->xct;
+
+	s->raster = NULL;
+	s->lraster = NULL;
+	s->line = NULL;
+	s->acc = NULL;
+	if (z->method == ZOOM_PLANAR) {
+		/* room for the padding, plus taps of weight 0 past the end */
+		s->line = (float *)my_calloc(ct->lpad + z->src->xsize + ct->rpad + ct->stride, sizeof(float));
+		s->acc = my_malloc(3 * sizeof(float) * (size_t)z->pw);
 	} else {
-		for(i = 0; i < dst->ysize; ++i) {
-			contrib[i].n = 0;
-			contrib[i].p = (CONTRIB *)my_calloc((int) (fwidth * 2 + 1),
-					sizeof(CONTRIB));
-			center = (double) i / yscale;
-			left = ceil(center - fwidth);
-			right = floor(center + fwidth);
-			for(j = left; j <= right; ++j) {
-				weight = center - (double) j;
-				weight = (*filterf)(weight);
-				if(j < 0) {
-					n = -j;
-				} else if(j >= tmp->ysize) {
-					n = (tmp->ysize - j) + tmp->ysize - 1;
-				} else {
-					n = j;
-				}
-				k = contrib[i].n++;
-				contrib[i].p[k].pixel = n;
-				contrib[i].p[k].weight = weight;
-			}
+		s->raster = (Pixel *)my_calloc(ct->lpad + z->src->xsize + ct->rpad, sizeof(Pixel));
+		if (z->method == ZOOM_FIXED && z->linear) {
+			s->lraster = (uint16_t *)my_malloc(3 * sizeof(uint16_t) * (size_t)(ct->lpad + z->src->xsize + ct->rpad));
+			if (!s->lraster)
+				return 0;
 		}
+		if (z->method == ZOOM_FIXED)
+			s->acc = my_malloc(3 * sizeof(int32_t) * (size_t)z->dst->xsize);
+		else
+			s->acc = my_malloc(3 * sizeof(double) * (size_t)z->dst->xsize);
 	}
+	return (s->raster || s->line) && s->acc;
+}
 
-	/* apply filter to zoom vertically from tmp to dst */
-	raster = (Pixel *)my_calloc(tmp->ysize, sizeof(Pixel));
-	for(k = 0; k < dst->xsize; ++k) {
-		get_column(raster, tmp, k);
-		for(i = 0; i < dst->ysize; ++i) {
-			red = green = blue = 0.0;
-			for(j = 0; j < contrib[i].n; ++j) {
-				red += raster[contrib[i].p[j].pixel].red
-					* contrib[i].p[j].weight;
-				green += raster[contrib[i].p[j].pixel].green
-					* contrib[i].p[j].weight;
-				blue += raster[contrib[i].p[j].pixel].blue
-					* contrib[i].p[j].weight;
-			}
-			tmppixel.red = CLAMP(red, BLACK_PIXEL, WHITE_PIXEL);
-			tmppixel.green = CLAMP(green, BLACK_PIXEL, WHITE_PIXEL);
-			tmppixel.blue = CLAMP(blue, BLACK_PIXEL, WHITE_PIXEL);
-			put_pixel(dst, k, i, tmppixel);
+static void
+scratch_free(SCRATCH *s)
+{
+	my_free(s->raster);
+	my_free(s->lraster);
+	my_free(s->line);
+	my_free(s->acc);
+}
+
+/*
+ * floating point passes
+ */
+static void
+hrow_float(ZOOM *z, SCRATCH *s, int k)
+{
+	CTABLE *ct = z->xct;
+	Pixel *raster = s->raster;
+	int i, j;			/* loop variables */
+	double red, green, blue;
+	Pixel *p, *q;
+	double *w;
+
+	pad_line((char *)(raster + ct->lpad), (char *)src_row(z, k),
+		z->src->xsize, sizeof(Pixel), sizeof(Pixel), ct->lpad, ct->rpad);
+	q = (Pixel *)inter_row(z, k);
+	for(i = 0; i < z->dst->xsize; ++i) {
+		red = green = blue = 0.0;
+		p = raster + ct->lpad + ct->tap[i].start;
+		w = ct->weight + ct->tap[i].w;
+		for(j = 0; j < ct->tap[i].n; ++j) {
+			red += p[j].red * w[j];
+			green += p[j].green * w[j];
+			blue += p[j].blue * w[j];
 		}
+		q[i].red = CLAMP(red, BLACK_PIXEL, WHITE_PIXEL);
+		q[i].green = CLAMP(green, BLACK_PIXEL, WHITE_PIXEL);
+		q[i].blue = CLAMP(blue, BLACK_PIXEL, WHITE_PIXEL);
 	}
-	my_free(raster);
+}
+
+static void
+vrow_float(ZOOM *z, SCRATCH *s, int i, Pixel *out)
+{
+	CTABLE *ct = z->yct;
+	int width = z->dst->xsize;
+	int j, x;			/* loop variables */
+	double *acc = (double *)s->acc;
+	Pixel *p;
+	double *w;
 
-	/* free the memory allocated for vertical filter weights */
-	for(i = 0; i < dst->ysize; ++i) {
-		my_free(contrib[i].p);
+	for(x = 0; x < 3 * width; ++x)
+		acc[x] = 0.0;
+	w = ct->weight + ct->tap[i].w;
+	for(j = 0; j < ct->tap[i].n; ++j) {
+		p = (Pixel *)inter_row(z, reflect(ct->tap[i].start + j, z->src->ysize));
+		for(x = 0; x < width; ++x) {
+			acc[3*x] += p[x].red * w[j];
+			acc[3*x+1] += p[x].green * w[j];
+			acc[3*x+2] += p[x].blue * w[j];
+		}
+	}
+	for(x = 0; x < width; ++x) {
+		out[x].red = CLAMP(acc[3*x], BLACK_PIXEL, WHITE_PIXEL);
+		out[x].green = CLAMP(acc[3*x+1], BLACK_PIXEL, WHITE_PIXEL);
+		out[x].blue = CLAMP(acc[3*x+2], BLACK_PIXEL, WHITE_PIXEL);
 	}
-	my_free(contrib);
-	free_image(tmp);
 }
 
 /*
- *	interface to tga2cry program
+ * fixed point passes; the same algorithm, but with integer weights
+ * and accumulators, and an intermediate image of 16 bit samples
+ * (3 per pixel) instead of Pixels
+ */
+/*
+ * the linear light version of the horizontal pass; s->raster holds the
+ * padded source row, and the intermediate samples are linear intensities
  */
+static void
+hrow_linear(ZOOM *z, SCRATCH *s, uint16_t *trow)
+{
+	CTABLE *ct = z->xct;
+	int i, j, n;			/* loop variables */
+	int32_t red, green, blue, w;
+	uint16_t *l, *p;
+	int32_t *iw;
 
-Pixel *
-rescale(Pixel *oldpix, unsigned old_w, unsigned old_h, unsigned new_w, unsigned new_h, int filter_type, int aspect)
+	l = s->lraster;
+	n = ct->lpad + z->src->xsize + ct->rpad;
+	for (j = 0; j < n; j++) {
+		l[3*j] = to_linear[s->raster[j].red];
+		l[3*j+1] = to_linear[s->raster[j].green];
+		l[3*j+2] = to_linear[s->raster[j].blue];
+	}
+	for(i = 0; i < z->dst->xsize; ++i) {
+		red = green = blue = 0;
+		p = l + 3 * (ct->lpad + ct->tap[i].start);
+		iw = ct->iweight + ct->tap[i].w;
+		for(j = 0; j < ct->tap[i].n; ++j) {
+			w = iw[j];
+			red += p[3*j] * w;
+			green += p[3*j+1] * w;
+			blue += p[3*j+2] * w;
+		}
+		*trow++ = ICLAMP((red + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS, 0, LINEAR_MAX);
+		*trow++ = ICLAMP((green + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS, 0, LINEAR_MAX);
+		*trow++ = ICLAMP((blue + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS, 0, LINEAR_MAX);
+	}
+}
+
+static void
+hrow_fixed(ZOOM *z, SCRATCH *s, int k)
 {
-	Image oldimage, newimage;
-	Pixel *newpix;
-	double delta, fwidth;
-	unsigned vert_border, horiz_border;
-	double (*filterf)(double);
+	CTABLE *ct = z->xct;
+	Pixel *raster = s->raster;
+	int i, j;			/* loop variables */
+	int32_t red, green, blue, w;
+	uint16_t *trow;			/* a row of the intermediate image */
+	Pixel *p;
+	int32_t *iw;
 
-	newpix = my_calloc(new_w*(size_t)new_h, sizeof(Pixel));
-	if (!newpix) return 0;
+	pad_line((char *)(raster + ct->lpad), (char *)src_row(z, k),
+		z->src->xsize, sizeof(Pixel), sizeof(Pixel), ct->lpad, ct->rpad);
+	trow = (uint16_t *)inter_row(z, k);
+	if (z->linear) {
+		hrow_linear(z, s, trow);
+		return;
+	}
+	for(i = 0; i < z->dst->xsize; ++i) {
+		red = green = blue = 0;
+		p = raster + ct->lpad + ct->tap[i].start;
+		iw = ct->iweight + ct->tap[i].w;
+		for(j = 0; j < ct->tap[i].n; ++j) {
+			w = iw[j];
+			red += p[j].red * w;
+			green += p[j].green * w;
+			blue += p[j].blue * w;
+		}
+		/* keep SAMPLE_BITS of the fraction */
+		*trow++ = ICLAMP((red + (1 << (WEIGHT_BITS - SAMPLE_BITS - 1))) >> (WEIGHT_BITS - SAMPLE_BITS), 0, SAMPLE_MAX);
+		*trow++ = ICLAMP((green + (1 << (WEIGHT_BITS - SAMPLE_BITS - 1))) >> (WEIGHT_BITS - SAMPLE_BITS), 0, SAMPLE_MAX);
+		*trow++ = ICLAMP((blue + (1 << (WEIGHT_BITS - SAMPLE_BITS - 1))) >> (WEIGHT_BITS - SAMPLE_BITS), 0, SAMPLE_MAX);
+	}
+}
 
-	oldimage.span = (long)old_w;
-	oldimage.xsize = (int)oldimage.span;
-	oldimage.ysize = old_h;
-	oldimage.data = oldpix;
+static void
+vrow_fixed(ZOOM *z, SCRATCH *s, int i, Pixel *out)
+{
+	CTABLE *ct = z->yct;
+	int width = z->dst->xsize;
+	int j, x;			/* loop variables */
+	int32_t w;
+	int32_t *acc = (int32_t *)s->acc;
+	uint16_t *t;
+	int32_t *iw;
+
+	for(x = 0; x < 3 * width; ++x)
+		acc[x] = 0;
+	iw = ct->iweight + ct->tap[i].w;
+	for(j = 0; j < ct->tap[i].n; ++j) {
+		w = iw[j];
+		t = (uint16_t *)inter_row(z, reflect(ct->tap[i].start + j, z->src->ysize));
+		for(x = 0; x < 3 * width; ++x)
+			acc[x] += t[x] * w;
+	}
+	if (z->linear) {
+		for(x = 0; x < width; ++x) {
+			out[x].red = from_linear[ICLAMP((acc[3*x] + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS, 0, LINEAR_MAX) >> LINEAR_SHIFT];
+			out[x].green = from_linear[ICLAMP((acc[3*x+1] + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS, 0, LINEAR_MAX) >> LINEAR_SHIFT];
+			out[x].blue = from_linear[ICLAMP((acc[3*x+2] + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS, 0, LINEAR_MAX) >> LINEAR_SHIFT];
+		}
+		return;
+	}
+	for(x = 0; x < width; ++x) {
+		out[x].red = ICLAMP((acc[3*x] + (1 << (WEIGHT_BITS + SAMPLE_BITS - 1))) >> (WEIGHT_BITS + SAMPLE_BITS), BLACK_PIXEL, WHITE_PIXEL);
+		out[x].green = ICLAMP((acc[3*x+1] + (1 << (WEIGHT_BITS + SAMPLE_BITS - 1))) >> (WEIGHT_BITS + SAMPLE_BITS), BLACK_PIXEL, WHITE_PIXEL);
+		out[x].blue = ICLAMP((acc[3*x+2] + (1 << (WEIGHT_BITS + SAMPLE_BITS - 1))) >> (WEIGHT_BITS + SAMPLE_BITS), BLACK_PIXEL, WHITE_PIXEL);
+	}
+}
 
-	newimage.span = new_w;
-	newimage.data = newpix;
 /*
- * figure out the proper new width and height to preserve aspect ratios
- * first, we'll try scaling by width (leaving a border at the bottom)
+ * planar passes: rows are split into separate red, green and blue
+ * arrays of floats, so that the kernels in scalesimd.c can work on
+ * 8 samples at once; the intermediate image is kept as 3 planes of
+ * unclamped floats, and the result is only rounded back to Pixels
+ * at the very end. As in the fixed point passes the weights for
+ * each output pixel are normalized to add up to 1.
  */
 
-	delta = (double)new_w/(double)old_w;
-	vert_border = delta*old_h;
+/*
+ * lay out the horizontal weights the way planar_hfilter() wants them:
+ * in groups of 8 output pixels, tap-major, with every filter padded
+ * out to ct->stride taps of weight 0
+ */
+static int
+make_planar_weights(ZOOM *z)
+{
+	CTABLE *ct = z->xct;
+	int i, j, n;
+	double sum;
+	double *w;
+	float *pw;
 
-	if (vert_border > new_h) {
-		/* this is no good! we'll have to scale by height and leave borders
-		 * at the sides
-		 */
-		delta = (double)new_h/(double)old_h;
-		horiz_border = delta*old_w;
-		vert_border = new_h;
-	} else {
-		horiz_border = new_w;
+	z->pstart = (int32_t *)my_calloc(z->pw, sizeof(int32_t));
+	z->pweight = (float *)my_calloc(z->pw * (size_t)ct->stride, sizeof(float));
+	if (!z->pstart || !z->pweight)
+		return 0;
+	for (i = 0; i < ct->outsize; i++) {
+		z->pstart[i] = ct->lpad + ct->tap[i].start;
+		w = ct->weight + ct->tap[i].w;
+		n = ct->tap[i].n;
+		sum = 0.0;
+		for (j = 0; j < n; j++)
+			sum += w[j];
+		if (sum == 0.0)
+			sum = 1.0;
+		pw = z->pweight + (i & ~7) * (size_t)ct->stride + (i & 7);
+		for (j = 0; j < n; j++)
+			pw[j * 8] = (float)(w[j] / sum);
 	}
+	return 1;
+}
 
-	if (aspect) {
-		newimage.xsize = horiz_border;
-		newimage.ysize = vert_border;
-	/* center the output */
-		newimage.data = newpix + ((new_w*(new_h - vert_border)/2) + (new_w - horiz_border)/2);
+static void
+hrow_planar(ZOOM *z, SCRATCH *s, int k)
+{
+	CTABLE *ct = z->xct;
+	int c, j;			/* loop variables */
+	int insize = z->src->xsize;
+	float *line = s->line;
+	float *out;
+	Pixel *row;
+
+	row = src_row(z, k);
+	out = (float *)inter_row(z, k);
+	for (c = 0; c < 3; c++) {
+		for (j = -ct->lpad; j < insize + ct->rpad; j++) {
+			if (c == 0)
+				line[ct->lpad + j] = row[reflect(j, insize)].red;
+			else if (c == 1)
+				line[ct->lpad + j] = row[reflect(j, insize)].green;
+			else
+				line[ct->lpad + j] = row[reflect(j, insize)].blue;
+		}
+		if (z->linear) {
+			for (j = 0; j < ct->lpad + insize + ct->rpad; j++)
+				line[j] = to_linear[(int)line[j]];
+		}
+		(*planar_hfilter)(line, z->pstart, z->pweight, ct->stride, z->pw, out + c * z->pw);
+	}
+}
+
+static INLINE int
+FCLAMP(float value)
+{
+	if (value <= (float)BLACK_PIXEL) return BLACK_PIXEL;
+	if (value >= (float)WHITE_PIXEL) return WHITE_PIXEL;
+	return (int)(value + 0.5f);
+}
+
+/* convert a linear intensity back to sRGB */
+static INLINE int
+FLINEAR(float value)
+{
+	if (value <= 0.0f) return from_linear[0];
+	if (value >= (float)LINEAR_MAX) return from_linear[LINEAR_MAX >> LINEAR_SHIFT];
+	return from_linear[(int)(value + 0.5f) >> LINEAR_SHIFT];
+}
+
+static void
+vrow_planar(ZOOM *z, SCRATCH *s, int i, Pixel *out)
+{
+	CTABLE *ct = z->yct;
+	int width = z->dst->xsize;
+	int c, j, x, n;			/* loop variables */
+	float *acc = (float *)s->acc;
+	float *t;
+	double sum;
+	double *w;
+
+	for(x = 0; x < 3 * z->pw; ++x)
+		acc[x] = 0.0f;
+	w = ct->weight + ct->tap[i].w;
+	n = ct->tap[i].n;
+	sum = 0.0;
+	for(j = 0; j < n; ++j)
+		sum += w[j];
+	if (sum == 0.0)
+		sum = 1.0;
+	for(j = 0; j < n; ++j) {
+		t = (float *)inter_row(z, reflect(ct->tap[i].start + j, z->src->ysize));
+		for (c = 0; c < 3; c++)
+			(*planar_vfilter)(acc + c * z->pw, t + c * z->pw, (float)(w[j] / sum), width);
+	}
+	if (z->linear) {
+		for(x = 0; x < width; ++x) {
+			out[x].red = FLINEAR(acc[x]);
+			out[x].green = FLINEAR(acc[z->pw + x]);
+			out[x].blue = FLINEAR(acc[2 * z->pw + x]);
+		}
+		return;
+	}
+	for(x = 0; x < width; ++x) {
+		out[x].red = FCLAMP(acc[x]);
+		out[x].green = FCLAMP(acc[z->pw + x]);
+		out[x].blue = FCLAMP(acc[2 * z->pw + x]);
+	}
+}
+
+/*
+ * compute intermediate row k, or destination row i (into "out")
+ */
+static void
+hrow(ZOOM *z, SCRATCH *s, int k)
+{
+	if (z->method == ZOOM_FIXED)
+		hrow_fixed(z, s, k);
+	else if (z->method == ZOOM_PLANAR)
+		hrow_planar(z, s, k);
+	else
+		hrow_float(z, s, k);
+}
+
+static void
+vrow(ZOOM *z, SCRATCH *s, int i, Pixel *out)
+{
+	if (z->method == ZOOM_FIXED)
+		vrow_fixed(z, s, i, out);
+	else if (z->method == ZOOM_PLANAR)
+		vrow_planar(z, s, i, out);
+	else
+		vrow_float(z, s, i, out);
+}
+
+/*
+ * thread workers for the two passes over whole images
+ */
+static void
+hpass(void *arg, int index, int count)
+{
+	ZOOM *z = (ZOOM *)arg;
+	int k;
+
+	for(k = BAND_START(z->src->ysize, index, count); k < BAND_START(z->src->ysize, index+1, count); ++k)
+		hrow(z, &z->scratch[index], k);
+}
+
+static void
+vpass(void *arg, int index, int count)
+{
+	ZOOM *z = (ZOOM *)arg;
+	int i;
+
+	for(i = BAND_START(z->dst->ysize, index, count); i < BAND_START(z->dst->ysize, index+1, count); ++i)
+		vrow(z, &z->scratch[index], i, z->dst->data + i * z->dst->span);
+}
+
+/*
+ * the lowest and highest intermediate rows needed for destination row i
+ */
+static void
+rows_needed(ZOOM *z, int i, int *lo, int *hi)
+{
+	CTABLE *ct = z->yct;
+	int j, y;
+
+	*lo = z->src->ysize;
+	*hi = -1;
+	for (j = 0; j < ct->tap[i].n; j++) {
+		y = reflect(ct->tap[i].start + j, z->src->ysize);
+		if (y < *lo) *lo = y;
+		if (y > *hi) *hi = y;
+	}
+}
+
+/*
+ * set up the filter tables for a zoom from src to dst; "linear" asks
+ * for filtering in linear light, which the floating point zoom can't do
+ * returns 0 if there is not enough memory
+ */
+static int
+zoom_init(ZOOM *z, Image *dst, Image *src, double (*filterf)(double), double fwidth, int method, int linear)
+{
+	z->dst = dst;
+	z->src = src;
+	z->method = method;
+	z->linear = linear && method != ZOOM_FLOAT;
+	if (z->linear) {
+		lock_shared();
+		make_linear_tables();
+		unlock_shared();
+	}
+	z->inter = NULL;
+	z->ring = 0;
+	z->filled = 0;
+	z->srcrows = NULL;
+	z->pw = (dst->xsize + 7) & ~7;
+	z->pstart = NULL;
+	z->pweight = NULL;
+	z->scratch = NULL;
+	z->nscratch = 0;
+
+	/* pre-calculate filter contributions for a row and a column */
+	z->xct = ctable_get(dst->xsize, src->xsize, filterf, fwidth, method == ZOOM_FLOAT);
+	z->yct = ctable_get(dst->ysize, src->ysize, filterf, fwidth, method == ZOOM_FLOAT);
+	if (!z->xct || !z->yct)
+		return 0;
+	if (method == ZOOM_PLANAR) {
+		lock_shared();
+		planar_init();
+		unlock_shared();
+		if (!make_planar_weights(z))
+			return 0;
+	}
+
+	if (method == ZOOM_FIXED)
+		z->rowbytes = 3 * sizeof(uint16_t) * (size_t)dst->xsize;
+	else if (method == ZOOM_PLANAR)
+		z->rowbytes = 3 * sizeof(float) * (size_t)z->pw;
+	else
+		z->rowbytes = sizeof(Pixel) * (size_t)dst->xsize;
+	return 1;
+}
+
+/*
+ * the number of intermediate rows that have to be kept to produce the
+ * destination "band" rows at a time, top to bottom; the rows for a band
+ * are computed in order, up to the last one any row of the band needs,
+ * and must not overwrite any that the band still needs
+ */
+static int
+ring_size(ZOOM *z, int band)
+{
+	int i, j, lo, hi;
+	int blo, top, ring;
+
+	ring = 0;
+	top = -1;				/* last row computed so far */
+	for (i = 0; i < z->dst->ysize; i += band) {
+		blo = z->src->ysize;
+		for (j = i; j < i + band && j < z->dst->ysize; j++) {
+			rows_needed(z, j, &lo, &hi);
+			if (lo < blo) blo = lo;
+			if (hi > top) top = hi;
+		}
+		if (top - blo + 1 > ring)
+			ring = top - blo + 1;
+	}
+	return ring;
+}
+
+/*
+ * allocate the intermediate image, and scratch space for up to
+ * nthreads threads; if "ring" is nonzero only that many rows of the
+ * intermediate image are kept
+ * returns 0 if there is not enough memory
+ */
+static int
+zoom_alloc(ZOOM *z, int ring, int nthreads)
+{
+	int i;
+
+	z->ring = ring;
+
+	/* create intermediate image to hold horizontal zoom */
+	z->inter = (char *)my_malloc(z->rowbytes * (ring ? ring : z->src->ysize));
+	if (!z->src->data) {
+		z->srcrows = (Pixel *)my_malloc(sizeof(Pixel) * (size_t)z->src->xsize * ring);
+		if (!z->srcrows)
+			return 0;
+	}
+	if (!z->inter)
+		return 0;
+
+	/* the threads can't stop the program, so they get their memory now */
+	if (nthreads < 1)
+		nthreads = 1;
+	z->scratch = (SCRATCH *)my_calloc(nthreads, sizeof(SCRATCH));
+	if (!z->scratch)
+		return 0;
+	for (i = 0; i < nthreads; i++) {
+		z->nscratch++;
+		if (!scratch_alloc(z, &z->scratch[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static void
+zoom_free(ZOOM *z)
+{
+	int i;
+
+	for (i = 0; i < z->nscratch; i++)
+		scratch_free(&z->scratch[i]);
+	my_free(z->scratch);
+	my_free(z->inter);
+	my_free(z->srcrows);
+	my_free(z->pstart);
+	my_free(z->pweight);
+	ctable_release(z->xct);
+	ctable_release(z->yct);
+}
+
+/*
+ * zoom src into dst using nthreads threads; "method" says which
+ * of the sets of passes above to use
+ * returns 0 if there is not enough memory
+ */
+static int
+zoom_threads(Image *dst, Image *src, double (*filterf)(double), double fwidth, int nthreads, int method, int linear)
+{
+	ZOOM z;
+
+	/* don't bother with more threads than there are rows */
+	if (nthreads > src->ysize) nthreads = src->ysize;
+	if (nthreads > dst->ysize) nthreads = dst->ysize;
+
+	if (!zoom_init(&z, dst, src, filterf, fwidth, method, linear) || !zoom_alloc(&z, 0, nthreads)) {
+		zoom_free(&z);
+		return 0;
+	}
+
+	/* zoom horizontally from src to tmp, then vertically from tmp to dst */
+	run_threads(nthreads, hpass, &z);
+	run_threads(nthreads, vpass, &z);
+	zoom_free(&z);
+	return 1;
+}
+
+int
+zoom(dst, src, filterf, fwidth, nthreads)
+Image *dst;				/* destination image structure */
+Image *src;				/* source image structure */
+double (*filterf)(double);	/* filter function */
+double fwidth;				/* filter width (support) */
+int nthreads;				/* number of threads to use */
+{
+	return zoom_threads(dst, src, filterf, fwidth, nthreads, ZOOM_FLOAT, 0);
+}
+
+int
+zoom_fixed(dst, src, filterf, fwidth, nthreads)
+Image *dst;				/* destination image structure */
+Image *src;				/* source image structure */
+double (*filterf)(double);	/* filter function */
+double fwidth;				/* filter width (support) */
+int nthreads;				/* number of threads to use */
+{
+	return zoom_threads(dst, src, filterf, fwidth, nthreads, ZOOM_FIXED, 0);
+}
+
+int
+zoom_planar(dst, src, filterf, fwidth, nthreads)
+Image *dst;				/* destination image structure */
+Image *src;				/* source image structure */
+double (*filterf)(double);	/* filter function */
+double fwidth;				/* filter width (support) */
+int nthreads;				/* number of threads to use */
+{
+	return zoom_threads(dst, src, filterf, fwidth, nthreads, ZOOM_PLANAR, 0);
+}
+
+/*
+ * exact shortcuts for the box filter
+ *
+ * When a picture is shrunk by 2, 4 or 8 in each direction, or enlarged
+ * by a whole number in each direction, the box filter weights are all
+ * equal (or all but one are 0), and the fixed point and planar passes
+ * above give exactly the rounded average of a block of pixels (or a
+ * copy of one pixel). The routines here get the same result directly,
+ * with no contribution tables and about one pass over the source.
+ * Note that the blocks are the ones the filter uses: when shrinking by
+ * k, output pixel i covers input pixels k*i - k/2 to k*i + k/2 - 1,
+ * reflected about the left (or top) edge.
+ */
+typedef struct {
+	Image	*dst;			/* destination image */
+	Image	*src;			/* source image */
+	int	shrink;			/* nonzero to shrink, 0 to enlarge */
+	int	kx, ky;			/* ratio in each direction */
+	int	shift;			/* log2(kx * ky), when shrinking */
+	int	*xmap;			/* source column of each output column, when enlarging */
+	uint16_t *acc;			/* a row of sums for each thread, when shrinking */
+} RATIO;
+
+#define SMALL_POWER_OF_2(k)	((k) == 1 || (k) == 2 || (k) == 4 || (k) == 8)
+
+/* source pixel copied to output pixel i when enlarging by k */
+#define NEAREST(i, k, size)	IMIN((i) / (k) + (2 * ((i) % (k)) > (k)), (size) - 1)
+
+static INLINE int
+IMIN(int a, int b)
+{
+	return a < b ? a : b;
+}
+
+/*
+ * see if zooming src to dst can be done by one of the shortcuts
+ * returns 1 if it can (and sets up q), 0 if not
+ */
+static int
+ratio_init(RATIO *q, Image *dst, Image *src, int filter_type, int method)
+{
+	if (filter_type != FILTER_BOX || method == ZOOM_FLOAT)
+		return 0;		/* the floating point zoom rounds differently */
+	if (dst->xsize <= 0 || dst->ysize <= 0 || src->xsize <= 0 || src->ysize <= 0)
+		return 0;
+	q->dst = dst;
+	q->src = src;
+	q->xmap = NULL;
+	q->acc = NULL;
+	if (src->xsize >= dst->xsize && src->ysize >= dst->ysize) {
+		q->shrink = 1;
+		q->kx = src->xsize / dst->xsize;
+		q->ky = src->ysize / dst->ysize;
+		if (q->kx * dst->xsize != src->xsize || q->ky * dst->ysize != src->ysize
+		|| !SMALL_POWER_OF_2(q->kx) || !SMALL_POWER_OF_2(q->ky))
+			return 0;
+		for (q->shift = 0; (1 << q->shift) < q->kx * q->ky; q->shift++)
+			;
+	} else if (src->xsize <= dst->xsize && src->ysize <= dst->ysize) {
+		q->shrink = 0;
+		q->kx = dst->xsize / src->xsize;
+		q->ky = dst->ysize / src->ysize;
+		if (q->kx * src->xsize != dst->xsize || q->ky * src->ysize != dst->ysize)
+			return 0;
 	} else {
-		newimage.xsize = new_w;
-		newimage.ysize = new_h;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * allocate what the shortcut needs for up to nthreads threads: the
+ * column map when enlarging, or a row of sums of source samples for
+ * each thread when shrinking
+ * returns 0 if there is not enough memory
+ */
+static int
+ratio_alloc(RATIO *q, int nthreads)
+{
+	int i;
+
+	if (q->shrink) {
+		q->acc = (uint16_t *)my_malloc(sizeof(Pixel) * sizeof(uint16_t) * (size_t)q->src->xsize * nthreads);
+		return q->acc != NULL;
 	}
+	q->xmap = (int *)my_malloc(q->dst->xsize * sizeof(int));
+	if (!q->xmap)
+		return 0;
+	for (i = 0; i < q->dst->xsize; i++)
+		q->xmap[i] = NEAREST(i, q->kx, q->src->xsize);
+	return 1;
+}
+
+/*
+ * compute output row i
+ */
+static void
+ratio_row(RATIO *q, uint16_t *acc, int i, Pixel *out)
+{
+	Image *src = q->src;
+	int width = q->dst->xsize;
+	int x, t, first;
+	int red, green, blue;
+	int half = (1 << q->shift) >> 1;
+	Pixel *in;
+	uint16_t *a;
+
+	if (!q->shrink) {
+		in = src->data + NEAREST(i, q->ky, src->ysize) * src->span;
+		for (x = 0; x < width; x++)
+			out[x] = in[q->xmap[x]];
+		return;
+	}
+
+	/* add up the rows of the block, channel by channel */
+	memset(acc, 0, sizeof(Pixel) * sizeof(uint16_t) * (size_t)src->xsize);
+	for (t = 0; t < q->ky; t++)
+		add_bytes(acc, (const uint8_t *)(src->data + reflect(q->ky * i - q->ky / 2 + t, src->ysize) * src->span),
+			sizeof(Pixel) * src->xsize);
+
+	/* then across the block */
+	for (x = 0; x < width; x++) {
+		red = green = blue = 0;
+		first = q->kx * x - q->kx / 2;
+		for (t = 0; t < q->kx; t++) {
+			a = acc + sizeof(Pixel) * (first < 0 ? reflect(first + t, src->xsize) : first + t);
+			red += a[offsetof(Pixel, red)];
+			green += a[offsetof(Pixel, green)];
+			blue += a[offsetof(Pixel, blue)];
+		}
+		out[x].red = (red + half) >> q->shift;
+		out[x].green = (green + half) >> q->shift;
+		out[x].blue = (blue + half) >> q->shift;
+	}
+}
+
+static void
+ratio_free(RATIO *q)
+{
+	my_free(q->xmap);
+	my_free(q->acc);
+}
+
+/* thread worker for the shortcuts */
+static void
+ratio_pass(void *arg, int index, int count)
+{
+	RATIO *q = (RATIO *)arg;
+	uint16_t *acc;
+	int i;
+
+	acc = q->shrink ? q->acc + sizeof(Pixel) * (size_t)q->src->xsize * index : NULL;
+	for(i = BAND_START(q->dst->ysize, index, count); i < BAND_START(q->dst->ysize, index+1, count); ++i)
+		ratio_row(q, acc, i, q->dst->data + i * q->dst->span);
+}
+
+/*
+ *	interface to tga2cry program
+ */
 
 /*
  * pick a filter type
  */
+static void
+pick_filter(int filter_type, double (**filterf)(double), double *fwidth)
+{
 	switch(filter_type) {
 	case FILTER_BOX:
-		filterf = box_filter;
-		fwidth = box_support;
+		*filterf = box_filter;
+		*fwidth = box_support;
 		break;
 	case FILTER_BELL:
-		filterf = bell_filter;
-		fwidth = bell_support;
+		*filterf = bell_filter;
+		*fwidth = bell_support;
 		break;
 	case FILTER_LANC:
-		filterf = Lanczos3_filter;
-		fwidth = Lanczos3_support;
+		*filterf = Lanczos3_filter;
+		*fwidth = Lanczos3_support;
 		break;
 	case FILTER_MITCH:
 	default:
-		filterf = Mitchell_filter;
-		fwidth = Mitchell_support;
+		*filterf = Mitchell_filter;
+		*fwidth = Mitchell_support;
 		break;
 	case FILTER_SINC:
-		filterf = Sinc_filter;
-		fwidth = Sinc_support;
+		*filterf = Sinc_filter;
+		*fwidth = Sinc_support;
 		break;
 	case FILTER_TRI:
-		filterf = triangle_filter;
-		fwidth = triangle_support;
+		*filterf = triangle_filter;
+		*fwidth = triangle_support;
 		break;
 	}
-	zoom(&newimage, &oldimage, filterf, fwidth);
+}
+
+/*
+ * figure out where in a new_w x new_h output the resized picture goes:
+ * (*x0, *y0) is its upper left corner, and *w x *h its size
+ */
+static void
+fit_picture(unsigned old_w, unsigned old_h, unsigned new_w, unsigned new_h, int flags,
+	int *x0, int *y0, int *w, int *h)
+{
+	double delta;
+	unsigned vert_border, horiz_border;
+
+	if (!(flags & RESCALE_ASPECT)) {
+		*x0 = *y0 = 0;
+		*w = new_w;
+		*h = new_h;
+		return;
+	}
+/*
+ * figure out the proper new width and height to preserve aspect ratios
+ * first, we'll try scaling by width (leaving a border at the bottom)
+ */
+
+	delta = (double)new_w/(double)old_w;
+	vert_border = delta*old_h;
+
+	if (vert_border > new_h) {
+		/* this is no good! we'll have to scale by height and leave borders
+		 * at the sides
+		 */
+		delta = (double)new_h/(double)old_h;
+		horiz_border = delta*old_w;
+		vert_border = new_h;
+	} else {
+		horiz_border = new_w;
+	}
+
+	/* center the output */
+	*w = horiz_border;
+	*h = vert_border;
+	*x0 = (new_w - horiz_border)/2;
+	*y0 = (new_h - vert_border)/2;
+}
+
+static int
+zoom_method(int flags)
+{
+	if (flags & RESCALE_FLOAT)
+		return ZOOM_FLOAT;
+	if (flags & RESCALE_PLANAR)
+		return ZOOM_PLANAR;
+	return ZOOM_FIXED;
+}
+
+Pixel *
+rescale(Pixel *oldpix, unsigned old_w, unsigned old_h, unsigned new_w, unsigned new_h, int filter_type, int flags, int nthreads)
+{
+	Image oldimage, newimage;
+	Pixel *newpix;
+	double fwidth;
+	double (*filterf)(double);
+	int x0, y0;
+	RATIO q;
+
+	newpix = my_calloc(new_w*(size_t)new_h, sizeof(Pixel));
+	if (!newpix) return 0;
+
+	oldimage.span = (long)old_w;
+	oldimage.xsize = (int)oldimage.span;
+	oldimage.ysize = old_h;
+	oldimage.data = oldpix;
+
+	newimage.span = new_w;
+	fit_picture(old_w, old_h, new_w, new_h, flags, &x0, &y0, &newimage.xsize, &newimage.ysize);
+	newimage.data = newpix + (y0 * (long)new_w + x0);
+
+	if (!(flags & RESCALE_LINEAR) && ratio_init(&q, &newimage, &oldimage, filter_type, zoom_method(flags))) {
+		if (nthreads > newimage.ysize) nthreads = newimage.ysize;
+		if (!ratio_alloc(&q, nthreads)) {
+			ratio_free(&q);
+			my_free(newpix);
+			return 0;
+		}
+		run_threads(nthreads, ratio_pass, &q);
+		ratio_free(&q);
+		return newpix;
+	}
+
+	pick_filter(filter_type, &filterf, &fwidth);
+	if (!zoom_threads(&newimage, &oldimage, filterf, fwidth, nthreads, zoom_method(flags), (flags & RESCALE_LINEAR) != 0)) {
+		my_free(newpix);
+		return 0;
+	}
 	return newpix;
 }
 
+/*
+ * streaming version of rescale(): rather than producing the whole new
+ * picture at once, resize_row() returns it a row at a time, top to
+ * bottom. The rows are computed in bands of "band" rows, keeping only
+ * the intermediate rows (and, if the source rows are read with a
+ * Row_Func rather than being in memory, the source rows) that the
+ * next band needs; the bands overlap by the support of the filter.
+ * Each band is filtered with up to "nthreads" threads.
+ */
+struct Resizer {
+	ZOOM	z;
+	int	fast;			/* nonzero if one of the box filter shortcuts is used */
+	RATIO	q;
+	Image	src, dst;
+	Row_Func getrow;		/* reads source rows, if they're not in memory */
+	void	*arg;			/* passed to getrow */
+	int	nthreads;		/* number of threads to use */
+	int	new_w, new_h;		/* size of the output, including any border */
+	int	x0, y0;			/* where the resized picture is in the output */
+	int	line;			/* next output row */
+	int	band;			/* output rows computed at once */
+	int	first, last;		/* picture rows in "rows" (first to last-1) */
+	int	from, to;		/* intermediate rows being computed */
+	Pixel	*rows;			/* the current band */
+};
+
+/*
+ * memory needed to resize a band of "band" rows at a time
+ */
+static long
+band_memory(Resizer *r, int band)
+{
+	long rowbytes;
+
+	rowbytes = (long)r->z.rowbytes;
+	if (!r->src.data)
+		rowbytes += sizeof(Pixel) * (long)r->src.xsize;
+	return ring_size(&r->z, band) * rowbytes + band * (long)sizeof(Pixel) * r->dst.xsize;
+}
+
+/*
+ * open a resizer; the source rows are either in "oldpix" or, if that
+ * is NULL, are read by calling getrow(arg, y, row) with y increasing
+ * (rows that aren't needed are skipped). If "memlimit" is nonzero, the
+ * bands are made as big as they can be without needing more than that
+ * many bytes.
+ * returns NULL if there is not enough memory; if that is because
+ * memlimit is too small even for a band of one row, *needed is set to
+ * the least that would do (otherwise it is set to 0)
+ */
+Resizer *
+resize_open(Pixel *oldpix, Row_Func getrow, void *arg, unsigned old_w, unsigned old_h,
+	unsigned new_w, unsigned new_h, int filter_type, int flags, int nthreads, long memlimit, long *needed)
+{
+	Resizer *r;
+	double fwidth;
+	double (*filterf)(double);
+
+	*needed = 0;
+	r = (Resizer *)my_calloc(1, sizeof(Resizer));
+	if (!r) return 0;
+	r->src.xsize = old_w;
+	r->src.ysize = old_h;
+	r->src.span = old_w;
+	r->src.data = oldpix;
+	r->getrow = getrow;
+	r->arg = arg;
+	r->nthreads = nthreads;
+	r->new_w = new_w;
+	r->new_h = new_h;
+	r->line = 0;
+	fit_picture(old_w, old_h, new_w, new_h, flags, &r->x0, &r->y0, &r->dst.xsize, &r->dst.ysize);
+	r->dst.span = new_w;
+	r->dst.data = NULL;		/* rows go wherever resize_row() is told */
+
+	/* the shortcuts need the whole source */
+	if (oldpix && !(flags & RESCALE_LINEAR) && ratio_init(&r->q, &r->dst, &r->src, filter_type, zoom_method(flags))) {
+		r->fast = 1;
+		if (!ratio_alloc(&r->q, 1)) {
+			ratio_free(&r->q);
+			my_free(r);
+			return 0;
+		}
+		return r;
+	}
+
+	pick_filter(filter_type, &filterf, &fwidth);
+	if (!zoom_init(&r->z, &r->dst, &r->src, filterf, fwidth, zoom_method(flags), (flags & RESCALE_LINEAR) != 0)) {
+		zoom_free(&r->z);
+		my_free(r);
+		return 0;
+	}
+
+	/* as big a band as will fit */
+	r->band = 1;
+	if (memlimit) {
+		if (band_memory(r, 1) > memlimit) {
+			*needed = band_memory(r, 1);
+			zoom_free(&r->z);
+			my_free(r);
+			return 0;
+		}
+		while (r->band < r->dst.ysize && band_memory(r, 2 * r->band) <= memlimit)
+			r->band *= 2;
+		if (r->band > r->dst.ysize)
+			r->band = r->dst.ysize;
+	}
+	r->first = r->last = 0;
+	r->rows = (Pixel *)my_malloc(sizeof(Pixel) * (size_t)r->dst.xsize * r->band);
+	if (!r->rows || !zoom_alloc(&r->z, ring_size(&r->z, r->band), nthreads)) {
+		zoom_free(&r->z);
+		my_free(r->rows);
+		my_free(r);
+		return 0;
+	}
+	return r;
+}
+
+/* thread workers for a band */
+static void
+band_hpass(void *arg, int index, int count)
+{
+	Resizer *r = (Resizer *)arg;
+	int k;
+
+	for(k = r->from + BAND_START(r->to - r->from, index, count); k < r->from + BAND_START(r->to - r->from, index+1, count); ++k)
+		hrow(&r->z, &r->z.scratch[index], k);
+}
+
+static void
+band_vpass(void *arg, int index, int count)
+{
+	Resizer *r = (Resizer *)arg;
+	int i;
+
+	for(i = r->first + BAND_START(r->last - r->first, index, count); i < r->first + BAND_START(r->last - r->first, index+1, count); ++i)
+		vrow(&r->z, &r->z.scratch[index], i, r->rows + (i - r->first) * (size_t)r->dst.xsize);
+}
+
+/*
+ * compute the band starting at picture row i
+ */
+static void
+resize_band(Resizer *r, int i)
+{
+	int j, lo, hi, top;
+	int nthreads;
+
+	r->first = i;
+	r->last = i + r->band;
+	if (r->last > r->dst.ysize)
+		r->last = r->dst.ysize;
+
+	/* bring the intermediate image up to date */
+	top = -1;
+	for (j = r->first; j < r->last; j++) {
+		rows_needed(&r->z, j, &lo, &hi);
+		if (hi > top) top = hi;
+	}
+	if (top >= r->z.filled) {
+		/* skip any rows that nothing needs, rather than overwrite ones we do */
+		r->from = r->z.filled;
+		if (r->from < top + 1 - r->z.ring)
+			r->from = top + 1 - r->z.ring;
+		r->to = top + 1;
+		if (r->getrow) {
+			for (j = r->from; j < r->to; j++)
+				(*r->getrow)(r->arg, j, src_row(&r->z, j));
+		}
+		nthreads = r->nthreads;
+		if (nthreads > r->to - r->from) nthreads = r->to - r->from;
+		run_threads(nthreads, band_hpass, r);
+		r->z.filled = r->to;
+	}
+
+	nthreads = r->nthreads;
+	if (nthreads > r->last - r->first) nthreads = r->last - r->first;
+	run_threads(nthreads, band_vpass, r);
+}
+
+/*
+ * produce the next row of the output (new_w pixels) in "row"
+ */
+void
+resize_row(Resizer *r, Pixel *row)
+{
+	int i;
+
+	i = r->line++ - r->y0;
+	memset(row, 0, r->new_w * sizeof(Pixel));
+	if (i < 0 || i >= r->dst.ysize)
+		return;			/* in the border */
+
+	if (r->fast) {
+		ratio_row(&r->q, r->q.acc, i, row + r->x0);
+		return;
+	}
+	if (i >= r->last)
+		resize_band(r, i);
+	memcpy(row + r->x0, r->rows + (i - r->first) * (size_t)r->dst.xsize, r->dst.xsize * sizeof(Pixel));
+}
+
+void
+resize_close(Resizer *r)
+{
+	if (r->fast) {
+		ratio_free(&r->q);
+		my_free(r);
+		return;
+	}
+	zoom_free(&r->z);
+	my_free(r->rows);
+	my_free(r);
+}
+
 /*
  * crop an input image to a specified window
+ * returns NULL if there is not enough memory
  */
 Pixel *
 crop(Pixel *oldpix, unsigned image_w, unsigned image_h, unsigned crop_x, unsigned crop_y, unsigned crop_w, unsigned crop_h)
@@ -569,10 +1876,8 @@ crop(Pixel *oldpix, unsigned image_w, unsigned image_h, unsigned crop_x, unsigne
 	Pixel *newpix;
 
 	newpix = (Pixel *)my_calloc(crop_w * (size_t)crop_h, sizeof(Pixel));
-	if (!newpix) {
-		fprintf(stderr, "ERROR: insufficient memory for cropping picture\n");
-		exit(1);
-	}
+	if (!newpix)
+		return 0;
 	crop_w += crop_x;		/* move to lower left hand corner */
 	crop_h += crop_y;
 
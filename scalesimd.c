@@ -0,0 +1,299 @@
+/*
+ * inner loops for the planar floating point resampler in scale.c,
+ * with AVX2 and SSE2 versions chosen at run time
+ *
+ * All versions do exactly the same single precision operations in
+ * the same order (multiply, then add; no fused multiply-add), so the
+ * output doesn't depend on which one was picked.
+ *
+ * planar_hfilter: horizontal pass over one channel of one row.
+ *   "in" is the (padded) input line, "start" gives the first input
+ *   sample of each output sample, and "w" holds the weights for
+ *   groups of 8 output samples, tap-major: w[(g*stride + j)*8 + k]
+ *   is weight j of output sample g*8+k. Taps past the end of a
+ *   filter have weight 0, so every output uses exactly "stride" taps.
+ *   nout must be a multiple of 8 (the caller pads its buffers).
+ *
+ * planar_vfilter: acc[x] += w * in[x] for x = 0..n-1, used for the
+ *   vertical pass a row at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "tgadefs.h"
+#include "tgaproto.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define HAVE_X86_SIMD 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define HAVE_X86_SIMD 1
+#define TARGET_AVX2
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+static void
+hfilter_c(const float *in, const int32_t *start, const float *w, int stride, int nout, float *out)
+{
+	int g, j, k;
+	float acc[8];
+
+	for (g = 0; g < nout; g += 8) {
+		for (k = 0; k < 8; k++)
+			acc[k] = 0.0f;
+		for (j = 0; j < stride; j++) {
+			for (k = 0; k < 8; k++)
+				acc[k] = acc[k] + in[start[g+k] + j] * w[k];
+			w += 8;
+		}
+		for (k = 0; k < 8; k++)
+			out[g+k] = acc[k];
+	}
+}
+
+static void
+vfilter_c(float *acc, const float *in, float w, int n)
+{
+	int x;
+
+	for (x = 0; x < n; x++)
+		acc[x] = acc[x] + in[x] * w;
+}
+
+#ifdef HAVE_X86_SIMD
+static void
+hfilter_sse2(const float *in, const int32_t *start, const float *w, int stride, int nout, float *out)
+{
+	int g, j;
+	__m128 acc0, acc1;
+	const int32_t *s;
+
+	for (g = 0; g < nout; g += 8) {
+		acc0 = acc1 = _mm_setzero_ps();
+		s = start + g;
+		for (j = 0; j < stride; j++) {
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_set_ps(in[s[3]+j], in[s[2]+j], in[s[1]+j], in[s[0]+j]),
+						_mm_loadu_ps(w)));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_set_ps(in[s[7]+j], in[s[6]+j], in[s[5]+j], in[s[4]+j]),
+						_mm_loadu_ps(w + 4)));
+			w += 8;
+		}
+		_mm_storeu_ps(out + g, acc0);
+		_mm_storeu_ps(out + g + 4, acc1);
+	}
+}
+
+static void
+vfilter_sse2(float *acc, const float *in, float w, int n)
+{
+	int x;
+	__m128 vw = _mm_set1_ps(w);
+
+	for (x = 0; x + 4 <= n; x += 4)
+		_mm_storeu_ps(acc + x, _mm_add_ps(_mm_loadu_ps(acc + x), _mm_mul_ps(_mm_loadu_ps(in + x), vw)));
+	for (; x < n; x++)
+		acc[x] = acc[x] + in[x] * w;
+}
+
+TARGET_AVX2 static void
+hfilter_avx2(const float *in, const int32_t *start, const float *w, int stride, int nout, float *out)
+{
+	int g, j;
+	__m256 acc;
+	__m256i idx, one;
+
+	one = _mm256_set1_epi32(1);
+	for (g = 0; g < nout; g += 8) {
+		acc = _mm256_setzero_ps();
+		idx = _mm256_loadu_si256((const __m256i *)(start + g));
+		for (j = 0; j < stride; j++) {
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_i32gather_ps(in, idx, 4), _mm256_loadu_ps(w)));
+			idx = _mm256_add_epi32(idx, one);
+			w += 8;
+		}
+		_mm256_storeu_ps(out + g, acc);
+	}
+}
+
+TARGET_AVX2 static void
+vfilter_avx2(float *acc, const float *in, float w, int n)
+{
+	int x;
+	__m256 vw = _mm256_set1_ps(w);
+
+	for (x = 0; x + 8 <= n; x += 8)
+		_mm256_storeu_ps(acc + x, _mm256_add_ps(_mm256_loadu_ps(acc + x), _mm256_mul_ps(_mm256_loadu_ps(in + x), vw)));
+	for (; x < n; x++)
+		acc[x] = acc[x] + in[x] * w;
+}
+
+/* does this processor (and operating system) support AVX2? */
+static int
+have_avx2(void)
+{
+#if defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	int info[4];
+
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)))	/* OSXSAVE, AVX */
+		return 0;
+	if ((_xgetbv(0) & 6) != 6)		/* OS saves the YMM registers */
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;	/* AVX2 */
+#endif
+}
+#endif /* HAVE_X86_SIMD */
+
+/*
+ * add_bytes: acc[x] += in[x] for x = 0..n-1, used to add up rows of
+ * pixels for the box filter shortcuts in scale.c; every processor that
+ * HAVE_X86_SIMD is defined for has SSE2, so there is only one version
+ */
+void
+add_bytes(uint16_t *acc, const uint8_t *in, int n)
+{
+	int x = 0;
+#ifdef HAVE_X86_SIMD
+	__m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	for (; x + 16 <= n; x += 16) {
+		v = _mm_loadu_si128((const __m128i *)(in + x));
+		_mm_storeu_si128((__m128i *)(acc + x),
+			_mm_add_epi16(_mm_loadu_si128((const __m128i *)(acc + x)), _mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128((__m128i *)(acc + x + 8),
+			_mm_add_epi16(_mm_loadu_si128((const __m128i *)(acc + x + 8)), _mm_unpackhi_epi8(v, zero)));
+	}
+#endif
+	for (; x < n; x++)
+		acc[x] = acc[x] + in[x];
+}
+
+/*
+ * swap_words: store n 16 bit words from "in" at "out" in big endian
+ * (68000) byte order, for the binary output writer in tga2cry.c; like
+ * add_bytes this only needs SSE2
+ */
+void
+swap_words(uint8_t *out, const uint16_t *in, int n)
+{
+	int x = 0;
+#ifdef HAVE_X86_SIMD
+	__m128i v;
+
+	for (; x + 8 <= n; x += 8) {
+		v = _mm_loadu_si128((const __m128i *)(in + x));
+		_mm_storeu_si128((__m128i *)(out + 2*x), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#endif
+	for (; x < n; x++) {
+		out[2*x] = in[x] >> 8;
+		out[2*x+1] = in[x] & 0x00ff;
+	}
+}
+
+/*
+ * mask_bits: pack a mask of the black (0,0,0) pixels of a row into
+ * (n+7)/8 bytes at "out", 1 for black, with the first pixel in the
+ * most significant bit, for the msk format. The SSE2 version compares
+ * 16 pixels (48 bytes) with 0 at a time, and turns each 4 pixels (12
+ * bits) of the resulting byte mask into 4 bits through black_nybble[],
+ * which mask_init() must have built first.
+ */
+#ifdef HAVE_X86_SIMD
+static uint8_t black_nybble[4096];
+static int black_nybble_ready;
+#endif
+
+void
+mask_init(void)
+{
+#ifdef HAVE_X86_SIMD
+	unsigned acc;
+	int i, j;
+
+	lock_shared();
+	if (!black_nybble_ready) {
+		for (i = 0; i < 4096; i++) {
+			acc = 0;
+			for (j = 0; j < 4; j++)
+				acc = (acc << 1) | (((i >> 3*j) & 7) == 7);
+			black_nybble[i] = acc;
+		}
+		black_nybble_ready = 1;
+	}
+	unlock_shared();
+#endif
+}
+
+void
+mask_bits(uint8_t *out, const Pixel *row, int n)
+{
+	int x = 0, i;
+	unsigned acc;
+#ifdef HAVE_X86_SIMD
+	const uint8_t *p = (const uint8_t *)row;
+	__m128i zero = _mm_setzero_si128();
+	uint64_t z;
+
+	if (sizeof(Pixel) == 3) {
+		for (; x + 16 <= n; x += 16, p += 48) {
+			z = (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), zero))
+				| (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), zero)) << 16
+				| (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), zero)) << 32;
+			*out++ = (black_nybble[z & 0xfff] << 4) | black_nybble[(z >> 12) & 0xfff];
+			*out++ = (black_nybble[(z >> 24) & 0xfff] << 4) | black_nybble[(z >> 36) & 0xfff];
+		}
+	}
+#endif
+	acc = 0;
+	for (i = 0; x < n; x++) {
+		acc = (acc << 1) | (row[x].red == 0 && row[x].green == 0 && row[x].blue == 0);
+		if (++i == 8) {
+			*out++ = acc;
+			acc = 0;
+			i = 0;
+		}
+	}
+	if (i)
+		*out = acc << (8 - i);
+}
+
+void (*planar_hfilter)(const float *in, const int32_t *start, const float *w, int stride, int nout, float *out) = hfilter_c;
+void (*planar_vfilter)(float *acc, const float *in, float w, int n) = vfilter_c;
+
+/*
+ * pick the best versions of the kernels for this machine; this must
+ * be called before any threads that use them are started, with
+ * lock_shared() held, and only the first call changes them (so that
+ * other conversions already using them are left alone)
+ * returns the name of the kernels chosen
+ */
+static const char *planar_name;
+
+const char *
+planar_init(void)
+{
+	if (planar_name)
+		return planar_name;
+#ifdef HAVE_X86_SIMD
+	if (have_avx2()) {
+		planar_hfilter = hfilter_avx2;
+		planar_vfilter = vfilter_avx2;
+		planar_name = "AVX2";
+	} else {
+		planar_hfilter = hfilter_sse2;
+		planar_vfilter = vfilter_sse2;
+		planar_name = "SSE2";
+	}
+#else
+	planar_name = "C";
+#endif
+	return planar_name;
+}
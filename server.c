@@ -0,0 +1,478 @@
+/*
+ * tga2cry --serve: a server that does conversions for other tga2cry
+ * processes
+ *
+ * Started with
+ *
+ *	tga2cry --serve [-mem n] socket
+ *
+ * it listens on the Unix domain socket "socket" for commands from
+ * "tga2cry --client socket ...", or from any tga2cry run with the
+ * environment variable TGA2CRY_SERVER set to the socket, so that a
+ * makefile can use it without being changed. Each command is run by
+ * run_command() in a thread of its own, just as tga2cry would have run
+ * it in the client's directory, and what it printed is sent back to
+ * the client, which prints it and exits with the command's status.
+ *
+ * What makes this worth doing is what the server keeps from one command
+ * to the next: the pictures it has read (the picture cache, in cache.c)
+ * and the contribution tables for resizing them (in scale.c), up to
+ * -mem megabytes between them.
+ *
+ * The client sends
+ *
+ *	cwd <its directory>
+ *	arg <argument>		for each argument
+ *	end
+ *
+ * and the server answers
+ *
+ *	out <n>			followed by n bytes for stdout
+ *	err <n>			followed by n bytes for stderr
+ *	exit <status>
+ *
+ * A client that can't reach a server (or loses it before it has heard
+ * anything back) does the conversion itself; one that loses it after
+ * that says so and fails, rather than print the output twice.
+ * "tga2cry --client socket --stop" stops the server, once the commands
+ * it is running have finished.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "tga2cry.h"
+#include "tgaproto.h"
+
+extern char *progname;
+
+#if defined(_WIN32)
+
+int
+serve(int argc, char **argv)
+{
+	fprintf(stderr, "%s: --serve isn't supported on this system\n", progname);
+	return 1;
+}
+
+int
+client(const char *sockname, int argc, char **argv)
+{
+	return -1;			/* never a server to talk to */
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_LINE	4200		/* longest line of a request: "arg " and a file name */
+#define MEM_DEFAULT	256		/* -mem, in megabytes */
+
+typedef struct {
+	int	sock;			/* listening */
+	const char *sockname;
+	Picture_Cache *pictures;
+	int	stopping;		/* --stop was asked for */
+	int	running;		/* commands being run */
+	long	commands;		/* how many have been run */
+	pthread_mutex_t lock;
+	pthread_cond_t idle;		/* running has gone down to 0 */
+} Server;
+
+/* a connection from a client */
+typedef struct {
+	Server	*sv;
+	int	fd;
+} Request;
+
+/* fill in the address of the socket "sockname"; returns -1 if the name is too long */
+static int
+socket_address(struct sockaddr_un *addr, const char *sockname)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(sockname) >= sizeof(addr->sun_path))
+		return -1;
+	strcpy(addr->sun_path, sockname);
+	return 0;
+}
+
+/* connect to the server at sockname; returns the socket, or -1 */
+static int
+connect_to(const char *sockname)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (socket_address(&addr, sockname) < 0)
+		return -1;
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* write all n bytes of buf to fd; returns -1 if it couldn't */
+static int
+write_all(int fd, const char *buf, size_t n)
+{
+	ssize_t k;
+
+	while (n > 0) {
+		k = write(fd, buf, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return -1;
+		buf += k;
+		n -= k;
+	}
+	return 0;
+}
+
+/* send "what" and the n bytes of f, from the start */
+static int
+send_file(int fd, const char *what, FILE *f)
+{
+	char buf[65536];
+	long n;
+	size_t k;
+
+	fflush(f);
+	n = ftell(f);
+	rewind(f);
+	sprintf(buf, "%s %ld\n", what, n < 0 ? 0L : n);
+	if (write_all(fd, buf, strlen(buf)) < 0)
+		return -1;
+	while (n > 0 && (k = fread(buf, 1, n < (long)sizeof(buf) ? (size_t)n : sizeof(buf), f)) > 0) {
+		if (write_all(fd, buf, k) < 0)
+			return -1;
+		n -= (long)k;
+	}
+	return 0;
+}
+
+/* read a line from the client, without its newline; returns -1 at the end or if it's too long */
+static int
+get_line(FILE *in, char *line)
+{
+	size_t n;
+
+	if (!fgets(line, MAX_LINE, in))
+		return -1;
+	n = strlen(line);
+	if (n == 0 || line[n-1] != '\n')
+		return -1;
+	line[n-1] = 0;
+	return 0;
+}
+
+/*
+ * the thread for a connection: read the command, run it, and send back
+ * what it printed
+ */
+static void *
+handle_request(void *arg)
+{
+	Request *r = (Request *)arg;
+	Server *sv = r->sv;
+	FILE *in, *out, *err;
+	char line[MAX_LINE];
+	char *cwd = NULL;
+	char **args = NULL, **new_args;
+	int nargs = 0, room = 0;
+	int status, ok, fd;
+
+	ok = 0;
+	in = NULL;
+	fd = dup(r->fd);			/* so that fclose(in) leaves r->fd open */
+	if (fd >= 0) {
+		in = fdopen(fd, "r");
+		if (!in)
+			close(fd);
+	}
+	while (in && get_line(in, line) == 0) {
+		if (!strcmp(line, "end")) {
+			ok = (cwd != NULL);
+			break;
+		}
+		if (!strncmp(line, "cwd ", 4) && !cwd) {
+			cwd = (char *)malloc(strlen(line + 4) + 1);
+			if (!cwd)
+				break;
+			strcpy(cwd, line + 4);
+		} else if (!strncmp(line, "arg ", 4)) {
+			if (nargs + 2 > room) {
+				new_args = (char **)realloc(args, (room ? 2 * room : 16) * sizeof(char *));
+				if (!new_args)
+					break;
+				args = new_args;
+				room = room ? 2 * room : 16;
+			}
+			args[nargs] = (char *)malloc(strlen(line + 4) + 1);
+			if (!args[nargs])
+				break;
+			strcpy(args[nargs++], line + 4);
+			args[nargs] = NULL;
+		} else {
+			break;			/* not a tga2cry client */
+		}
+	}
+	if (in)
+		fclose(in);
+
+	if (ok && nargs == 1 && !strcmp(args[0], "--stop")) {
+		pthread_mutex_lock(&sv->lock);
+		sv->stopping = 1;
+		pthread_mutex_unlock(&sv->lock);
+		close(connect_to(sv->sockname));	/* wake up accept() */
+		write_all(r->fd, "exit 0\n", 7);
+	} else if (ok) {
+		out = tmpfile();
+		err = tmpfile();
+		if (out && err) {
+			status = run_command(nargs, args, out, err, cwd, sv->pictures);
+			if (send_file(r->fd, "out", out) == 0 && send_file(r->fd, "err", err) == 0) {
+				sprintf(line, "exit %d\n", status);
+				write_all(r->fd, line, strlen(line));
+			}
+		}
+		if (out)
+			fclose(out);
+		if (err)
+			fclose(err);
+	}
+	close(r->fd);
+
+	while (nargs > 0)
+		free(args[--nargs]);
+	free(args);
+	free(cwd);
+	free(r);
+	pthread_mutex_lock(&sv->lock);
+	sv->commands++;
+	if (--sv->running == 0)
+		pthread_cond_broadcast(&sv->idle);
+	pthread_mutex_unlock(&sv->lock);
+	return NULL;
+}
+
+/*
+ * tga2cry --serve [-mem n] socket: serve until told to stop
+ */
+int
+serve(int argc, char **argv)
+{
+	Server sv;
+	Request *r;
+	struct sockaddr_un addr;
+	struct stat st;
+	pthread_t tid;
+	pthread_attr_t attr;
+	long mem = MEM_DEFAULT;
+	long hits, misses, bytes;
+	int fd;
+	char msg[80];
+
+	if (argc == 3 && !strcmp(argv[0], "-mem")) {
+		if (sscanf(argv[1], "%ld", &mem) != 1 || mem <= 0)
+			return usage(stdout, "-mem requires a number of megabytes\n");
+		if (mem > LONG_MAX / (1024L * 1024L)) {		/* long may be 32 bits */
+			sprintf(msg, "-mem can be at most %ld megabytes\n", LONG_MAX / (1024L * 1024L));
+			return usage(stdout, msg);
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc != 1)
+		return usage(stdout, "--serve requires the name of the socket\n");
+
+	memset(&sv, 0, sizeof(sv));
+	sv.sockname = argv[0];
+	if (socket_address(&addr, sv.sockname) < 0) {
+		fprintf(stderr, "%s: socket name too long\n", sv.sockname);
+		return 1;
+	}
+	fd = connect_to(sv.sockname);
+	if (fd >= 0) {
+		close(fd);
+		fprintf(stderr, "%s: a server is already running there\n", sv.sockname);
+		return 1;
+	}
+	if (stat(sv.sockname, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(sv.sockname);		/* left by a server that didn't stop cleanly */
+	sv.sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sv.sock < 0 || bind(sv.sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sv.sock, 64) < 0) {
+		fprintf(stderr, "%s: %s\n", sv.sockname, strerror(errno));
+		return 1;
+	}
+
+	/* a sixteenth of the memory for resizing tables, the rest for pictures */
+	mem *= 1024L * 1024L;
+	ctable_cache_limit(mem / 16);
+	sv.pictures = picture_cache_new(mem - mem / 16);
+	if (!sv.pictures) {
+		fprintf(stderr, "ERROR: insufficient memory\n");
+		return 1;
+	}
+	pthread_mutex_init(&sv.lock, NULL);
+	pthread_cond_init(&sv.idle, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	signal(SIGPIPE, SIG_IGN);		/* a client going away mustn't stop the server */
+	printf("%s: serving on %s\n", progname, sv.sockname);
+	fflush(stdout);
+
+	for (;;) {
+		fd = accept(sv.sock, NULL, NULL);
+		pthread_mutex_lock(&sv.lock);
+		if (sv.stopping) {
+			pthread_mutex_unlock(&sv.lock);
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+		pthread_mutex_unlock(&sv.lock);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "%s: %s\n", sv.sockname, strerror(errno));
+			break;
+		}
+		r = (Request *)malloc(sizeof(Request));
+		if (!r) {
+			close(fd);
+			continue;
+		}
+		r->sv = &sv;
+		r->fd = fd;
+		pthread_mutex_lock(&sv.lock);
+		sv.running++;
+		pthread_mutex_unlock(&sv.lock);
+		if (pthread_create(&tid, &attr, handle_request, r) != 0)
+			handle_request(r);	/* couldn't start a thread, so do it here */
+	}
+
+	close(sv.sock);
+	unlink(sv.sockname);
+	pthread_mutex_lock(&sv.lock);
+	while (sv.running > 0)
+		pthread_cond_wait(&sv.idle, &sv.lock);
+	pthread_mutex_unlock(&sv.lock);
+	picture_cache_stats(sv.pictures, &hits, &misses, &bytes);
+	printf("%s: stopped after %ld commands; pictures: %ld hits, %ld misses, %.1f megabytes kept\n",
+	       progname, sv.commands, hits, misses, bytes / (1024.0 * 1024.0));
+	picture_cache_free(sv.pictures);
+	ctable_cache_limit(0L);
+	pthread_attr_destroy(&attr);
+	pthread_cond_destroy(&sv.idle);
+	pthread_mutex_destroy(&sv.lock);
+	return 0;
+}
+
+/* send a line of the request; returns -1 if it couldn't */
+static int
+send_line(int fd, const char *what, const char *value)
+{
+	if (strchr(value, '\n') || strlen(value) + 6 > MAX_LINE)
+		return -1;			/* can't be sent; do it here instead */
+	if (write_all(fd, what, strlen(what)) < 0 || write_all(fd, " ", 1) < 0
+	    || write_all(fd, value, strlen(value)) < 0 || write_all(fd, "\n", 1) < 0)
+		return -1;
+	return 0;
+}
+
+/* copy n bytes from in to out */
+static int
+copy_bytes(FILE *in, FILE *out, long n)
+{
+	char buf[65536];
+	size_t k;
+
+	while (n > 0) {
+		k = fread(buf, 1, n < (long)sizeof(buf) ? (size_t)n : sizeof(buf), in);
+		if (k == 0)
+			return -1;
+		fwrite(buf, 1, k, out);
+		n -= (long)k;
+	}
+	return 0;
+}
+
+/*
+ * have the server at sockname run the command argv[0..argc-1], and
+ * print what it did; returns its exit status, or -1 if there's no
+ * server to do it (and nothing has been printed)
+ */
+int
+client(const char *sockname, int argc, char **argv)
+{
+	FILE *in;
+	char cwd[MAX_LINE], line[MAX_LINE];
+	long n;
+	int fd, i, status, heard;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		return -1;
+	fd = connect_to(sockname);
+	if (fd < 0)
+		return -1;
+	signal(SIGPIPE, SIG_IGN);
+	if (send_line(fd, "cwd", cwd) < 0) {
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < argc; i++) {
+		if (send_line(fd, "arg", argv[i]) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	if (write_all(fd, "end\n", 4) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	in = fdopen(fd, "r");
+	if (!in) {
+		close(fd);
+		return -1;
+	}
+	status = -1;
+	heard = 0;
+	while (get_line(in, line) == 0) {
+		heard = 1;
+		if (sscanf(line, "out %ld", &n) == 1) {
+			if (copy_bytes(in, stdout, n) < 0)
+				break;
+		} else if (sscanf(line, "err %ld", &n) == 1) {
+			if (copy_bytes(in, stderr, n) < 0)
+				break;
+		} else if (sscanf(line, "exit %d", &status) == 1) {
+			break;
+		} else {
+			break;
+		}
+	}
+	fclose(in);
+	if (status < 0 && heard) {
+		fflush(stdout);
+		fprintf(stderr, "%s: lost the connection to the server on %s\n", progname, sockname);
+		return 1;
+	}
+	return status;
+}
+
+#endif /* _WIN32 */
@@ -0,0 +1,120 @@
+/*
+ * where the converted data goes: either a file, or a buffer supplied
+ * by the program using the library
+ *
+ * A sink never stops the program. A write that fails, or that would
+ * run past the end of the buffer, sets "error" and is otherwise
+ * ignored; a buffer sink still keeps count of the bytes it was given,
+ * so that sink_size() tells the caller how big the buffer needed to
+ * be. The caller checks "error" once, when the output is finished.
+ *
+ * Object files and compressed output go back and patch their headers,
+ * so a sink can be told to seek; for a file sink the file must have
+ * been opened in binary mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "tgadefs.h"
+#include "tgaproto.h"
+
+/*
+ * set up a sink writing to a file
+ */
+void
+sink_file(Sink *s, FILE *f)
+{
+	s->f = f;
+	s->buf = NULL;
+	s->size = s->pos = s->len = 0;
+	s->error = 0;
+}
+
+/*
+ * set up a sink writing to "size" bytes at buf
+ */
+void
+sink_buffer(Sink *s, void *buf, long size)
+{
+	s->f = NULL;
+	s->buf = (uint8_t *)buf;
+	s->size = buf ? size : 0;
+	s->pos = s->len = 0;
+	s->error = 0;
+}
+
+void
+sink_write(Sink *s, const void *data, long n)
+{
+	long k;
+
+	if (n <= 0)
+		return;
+	if (s->f) {
+		if (fwrite(data, 1, (size_t)n, s->f) != (size_t)n)
+			s->error = 1;
+		return;
+	}
+	k = s->size - s->pos;
+	if (k > n)
+		k = n;
+	if (k > 0)
+		memcpy(s->buf + s->pos, data, (size_t)k);
+	if (k < n)
+		s->error = 1;
+	s->pos += n;
+	if (s->pos > s->len)
+		s->len = s->pos;
+}
+
+void
+sink_printf(Sink *s, const char *fmt, ...)
+{
+	char line[512];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (n < 0 || n >= (int)sizeof(line)) {
+		s->error = 1;
+		return;
+	}
+	sink_write(s, line, n);
+}
+
+long
+sink_tell(Sink *s)
+{
+	return s->f ? ftell(s->f) : s->pos;
+}
+
+/*
+ * move to offset "pos" from the start (whence == SEEK_SET), or to the
+ * end (whence == SEEK_END, pos ignored)
+ */
+void
+sink_seek(Sink *s, long pos, int whence)
+{
+	if (s->f) {
+		if (whence == SEEK_END)
+			pos = 0;
+		if (fseek(s->f, pos, whence) != 0)
+			s->error = 1;
+		return;
+	}
+	s->pos = (whence == SEEK_END) ? s->len : pos;
+}
+
+/*
+ * how many bytes have been written to a buffer sink (or would have
+ * been, had it been big enough)
+ */
+long
+sink_size(Sink *s)
+{
+	return s->len;
+}
@@ -0,0 +1,46 @@
+/*
+ * libtga2cry: converting 24 bit pictures to Jaguar CRY or RGB data from
+ * another program (see convert.c)
+ *
+ *	cv = converter_new();
+ *	converter_option(cv, "f", "cry8");
+ *	converter_option(cv, "binary", NULL);
+ *	if (convert_pixels(cv, pixels, w, h, buf, sizeof(buf), &len) < 0)
+ *		fprintf(stderr, "%s\n", converter_error(cv));
+ *	converter_free(cv);
+ *
+ * The options are the tga2cry command line options, without the '-'.
+ * The functions returning int return -1 when something is wrong, and
+ * converter_error() then says what.
+ */
+
+#ifndef TGA2CRY_H
+#define TGA2CRY_H
+
+#include "tgadefs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+Converter *converter_new(void);
+void converter_free(Converter *cv);
+int converter_option(Converter *cv, const char *name, const char *value);
+int converter_check(Converter *cv, const char *infile);
+int convert_file(Converter *cv, const char *infile);
+int convert_pixels(Converter *cv, const Pixel *pix, unsigned w, unsigned h, void *out, long outsize, long *outlen);
+int decode_file(Converter *cv, const char *infile, Pixel **pix, unsigned *w, unsigned *h);
+int convert_decoded(Converter *cv, const char *infile, const Pixel *pix, unsigned w, unsigned h);
+void free_decoded(Pixel *pix);
+int converter_output_name(Converter *cv, int i, const char *infile, char *buf, int size);
+int converter_settings(Converter *cv, char *buf, int size);
+const char *converter_error(Converter *cv);
+int converter_label(Converter *cv, const char *label);
+void converter_messages(Converter *cv, FILE *f);
+void converter_progress(Converter *cv, FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
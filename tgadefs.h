@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdint.h>
 
 typedef struct {
@@ -18,6 +19,43 @@ typedef struct {
 	long	span;		/* Pixel offset between two scanlines */
 } Image;
 
+/* the state of one picture's conversion (see convert.c) */
+typedef struct Converter Converter;
+
+/* a streaming resizer (see scale.c) */
+typedef struct Resizer Resizer;
+
+/* color counts for building a palette (see palette.c) */
+typedef struct Histogram Histogram;
+
+/* compressed output (see compress.c) */
+typedef struct Compressor Compressor;
+
+/* a list of conversions to run, in batch.c */
+typedef struct Batch Batch;
+
+/* decoded pictures kept by tga2cry --serve, in cache.c */
+typedef struct Picture_Cache Picture_Cache;
+
+/* where output goes: a file, or a caller's buffer (see sink.c) */
+typedef struct {
+	FILE	*f;			/* the file, or NULL for a buffer */
+	uint8_t	*buf;			/* the buffer */
+	long	size;			/* its size */
+	long	pos;			/* where the next byte goes */
+	long	len;			/* bytes written so far (even past size) */
+	int	error;			/* nonzero if anything could not be written */
+} Sink;
+
+/* a function that reads row y of a picture into "row" */
+typedef void (*Row_Func)(void *arg, int y, Pixel *row);
+
+/* a function to be run in several threads by run_threads() */
+typedef void (*Thread_Func)(void *arg, int index, int count);
+
+/* a job for run_jobs(), run by thread "worker" */
+typedef void (*Job_Func)(void *arg, int worker, int job);
+
 /* constants for filter_type */
 #define FILTER_BOX	0
 #define FILTER_BELL	1
@@ -26,6 +64,20 @@ typedef struct {
 #define FILTER_SINC	4
 #define FILTER_TRI	5
 
+/* flags for rescale() */
+#define RESCALE_ASPECT	0x0001		/* preserve aspect ratio, adding a border */
+#define RESCALE_FLOAT	0x0002		/* use the floating point resampler */
+#define RESCALE_PLANAR	0x0004		/* use the planar (SIMD) resampler */
+#define RESCALE_LINEAR	0x0008		/* filter in linear light rather than sRGB */
+
+/* object file formats for object_start() and object_finish() */
+#define OBJECT_AOUT	1		/* BSD a.out */
+#define OBJECT_ELF	2		/* ELF32 */
+
+/* compression methods for compress_open() */
+#define COMPRESS_RLE	1		/* word run length encoding */
+#define COMPRESS_LZSS	2		/* LZSS with a 4K window */
+
 #ifdef __GNUC__
 #define INLINE __inline__
 #else
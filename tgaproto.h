@@ -6,19 +6,46 @@
 
 
 /* tga2cry.c */
-void usage P_((char *));
+int usage P_((FILE *f, char *msg));
+int run_command P_((int argc, char **argv, FILE *out, FILE *err, const char *dir, Picture_Cache *pc));
 int main P_((int argc, char **argv));
-char *change_extension P_((char *name, char *ext));
-char *strip_extension P_((char *name));
-int do_file P_((char *infile, char *outfile));
-void err_eof P_((void));
-void read_row P_((FILE *fhandle, Pixel *place));
-void read_file P_((char *infile));
-void output_word P_((FILE *f, uint16_t w));
-void output_long P_((FILE *f, uint32_t w));
-void output_bit P_((FILE *f, int b));
-uint32_t wid P_((unsigned int image_w));
-void make_newdata P_((void));
+
+/* batch.c */
+Batch *batch_new P_((char **opts, int nopts, int quiet));
+int batch_add P_((Batch *b, char *input, char **opts, int nopts, char *where));
+int batch_read_list P_((Batch *b, const char *listname));
+int batch_run P_((Batch *b, int nthreads));
+void batch_cache P_((Batch *b, const char *dir, int link, const char *version));
+void batch_serve P_((Batch *b, FILE *out, FILE *err, const char *dir, Picture_Cache *pc));
+void batch_free P_((Batch *b));
+
+/* server.c */
+int serve P_((int argc, char **argv));
+int client P_((const char *sockname, int argc, char **argv));
+
+/* cache.c */
+int hash_file P_((const char *name, uint8_t digest[32]));
+void cache_key P_((char *key, const uint8_t input[32], const char *version, const char *settings, char **labels, int nout));
+int cache_has P_((const char *dir, const char *key, int nout));
+int cache_fetch P_((const char *dir, const char *key, char **outs, int nout, int link));
+void cache_store P_((const char *dir, const char *key, char **outs, int nout, int link));
+Picture_Cache *picture_cache_new P_((long limit));
+int picture_get P_((Picture_Cache *pc, Converter *cv, const char *name, Pixel **pix, unsigned *w, unsigned *h));
+void picture_release P_((Picture_Cache *pc, Pixel *pix));
+void picture_cache_stats P_((Picture_Cache *pc, long *hits, long *misses, long *bytes));
+void picture_cache_free P_((Picture_Cache *pc));
+
+/* convert.c */
+char *change_extension P_((const char *name, const char *ext));
+char *strip_extension P_((const char *name));
+void read_row P_((Converter *cv, FILE *fhandle, Pixel *place));
+void read_file P_((Converter *cv, const char *infile));
+void output_word P_((Converter *cv, uint16_t w));
+void output_long P_((Converter *cv, uint32_t w));
+void output_bit P_((Converter *cv, int b));
+uint32_t wid P_((Converter *cv, unsigned int image_w));
+void make_newdata P_((Converter *cv));
+void warning P_((Converter *cv, const char *fmt, ...));
 
 /* filter.c */
 Image *new_image P_((int xsize, int ysize));
@@ -35,11 +62,57 @@ double B_spline_filter P_((double t));
 double sinc P_((double x));
 double Lanczos3_filter P_((double t));
 double Mitchell_filter P_((double t));
-void zoom P_((Image *dst, Image *src, double (*filterf )(double), double fwidth));
-Pixel *rescale P_((Pixel *oldpix, unsigned old_w, unsigned old_h, unsigned new_w, unsigned new_h, int filter_type, int aspect));
+int zoom P_((Image *dst, Image *src, double (*filterf )(double), double fwidth, int nthreads));
+int zoom_fixed P_((Image *dst, Image *src, double (*filterf )(double), double fwidth, int nthreads));
+int zoom_planar P_((Image *dst, Image *src, double (*filterf )(double), double fwidth, int nthreads));
+Pixel *rescale P_((Pixel *oldpix, unsigned old_w, unsigned old_h, unsigned new_w, unsigned new_h, int filter_type, int flags, int nthreads));
+Resizer *resize_open P_((Pixel *oldpix, Row_Func getrow, void *arg, unsigned old_w, unsigned old_h, unsigned new_w, unsigned new_h, int filter_type, int flags, int nthreads, long memlimit, long *needed));
+void resize_row P_((Resizer *r, Pixel *row));
+void resize_close P_((Resizer *r));
 Pixel *crop P_((Pixel *oldpix, unsigned old_w, unsigned old_h, unsigned new_x, unsigned new_y, unsigned new_w, unsigned new_h));
+void ctable_cache_limit P_((long bytes));
+
+/* scalesimd.c */
+extern void (*planar_hfilter) P_((const float *in, const int32_t *start, const float *w, int stride, int nout, float *out));
+extern void (*planar_vfilter) P_((float *acc, const float *in, float w, int n));
+const char *planar_init P_((void));
+void add_bytes P_((uint16_t *acc, const uint8_t *in, int n));
+void swap_words P_((uint8_t *out, const uint16_t *in, int n));
+void mask_init P_((void));
+void mask_bits P_((uint8_t *out, const Pixel *row, int n));
+
+/* thread.c */
+int cpu_count P_((void));
+void run_threads P_((int nthreads, Thread_Func func, void *arg));
+void lock_shared P_((void));
+void unlock_shared P_((void));
+double wall_clock P_((void));
+void run_jobs P_((int nthreads, int njobs, const long *cost, const int *after, Job_Func func, void *arg));
 
 /* palette.c */
-int build_palette P_((int max_colors, Palette_Entry *palette, Pixel *pix, long numpixels));
+int build_palette P_((int max_colors, Palette_Entry *palette, Pixel *pix, long numpixels, int refine_iters, Converter *cv));
+Histogram *palette_start P_((int refine_iters));
+void palette_free P_((Histogram *h));
+void palette_add P_((Histogram *h, Pixel *pix, long numpixels));
+int palette_finish P_((Histogram *h, int max_colors, Palette_Entry *palette, int refine_iters, Converter *cv));
+
+/* compress.c */
+Compressor *compress_open P_((Sink *s, int method, int nthreads));
+void compress_write P_((Compressor *c, const uint8_t *buf, long n));
+long compress_close P_((Compressor *c));
+void compress_free P_((Compressor *c));
+
+/* object.c */
+void object_start P_((Sink *f, int format));
+void object_finish P_((Sink *f, int format, const char *name, long size, int text));
+
+/* sink.c */
+void sink_file P_((Sink *s, FILE *f));
+void sink_buffer P_((Sink *s, void *buf, long size));
+void sink_write P_((Sink *s, const void *data, long n));
+void sink_printf P_((Sink *s, const char *fmt, ...));
+long sink_tell P_((Sink *s));
+void sink_seek P_((Sink *s, long pos, int whence));
+long sink_size P_((Sink *s));
 
 #undef P_
@@ -0,0 +1,357 @@
+/*
+ * minimal portable threading support for tga2cry
+ *
+ * run_threads(n, func, arg) calls func(arg, i, n) for i = 0 to n-1,
+ * each call in its own thread (call 0 is made in the calling thread),
+ * and returns once all of them have finished. This is all the
+ * conversion code needs to split work into independent bands.
+ *
+ * lock_shared() and unlock_shared() guard the few tables that every
+ * conversion in the process shares (the resizer's filter tables, for
+ * instance), which are built the first time they are needed.
+ *
+ * run_jobs() runs a list of jobs of different sizes (whole pictures,
+ * for batch mode), some of which may have to wait for others, on a pool
+ * of threads, balancing them by work stealing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "tgadefs.h"
+#include "tgaproto.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+	Thread_Func	func;
+	void		*arg;
+	int		index;
+	int		count;
+} Thread_Start;
+
+#if defined(_WIN32)
+static unsigned __stdcall
+thread_main(void *p)
+{
+	Thread_Start *ts = (Thread_Start *)p;
+
+	(*ts->func)(ts->arg, ts->index, ts->count);
+	return 0;
+}
+#else
+static void *
+thread_main(void *p)
+{
+	Thread_Start *ts = (Thread_Start *)p;
+
+	(*ts->func)(ts->arg, ts->index, ts->count);
+	return NULL;
+}
+#endif
+
+#if defined(_WIN32)
+static SRWLOCK shared_lock = SRWLOCK_INIT;
+static SRWLOCK job_lock = SRWLOCK_INIT;
+static CONDITION_VARIABLE job_ready = CONDITION_VARIABLE_INIT;
+#define LOCK(l)		AcquireSRWLockExclusive(&(l))
+#define UNLOCK(l)	ReleaseSRWLockExclusive(&(l))
+#else
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+#define LOCK(l)		pthread_mutex_lock(&(l))
+#define UNLOCK(l)	pthread_mutex_unlock(&(l))
+#endif
+
+void
+lock_shared(void)
+{
+	LOCK(shared_lock);
+}
+
+void
+unlock_shared(void)
+{
+	UNLOCK(shared_lock);
+}
+
+/*
+ * the time in seconds from some fixed point, for timing things
+ */
+double
+wall_clock(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq, now;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	return (double)time(NULL);
+#endif
+}
+
+/*
+ * return the number of processors available, or 1 if we can't tell
+ */
+int
+cpu_count(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (int)n : 1;
+#else
+	return 1;
+#endif
+}
+
+/*
+ * run func in nthreads threads; if a thread cannot be started its
+ * share of the work is done in the calling thread instead, so the
+ * caller never needs to worry about failures
+ */
+void
+run_threads(int nthreads, Thread_Func func, void *arg)
+{
+	Thread_Start *ts;
+	int i;
+#if defined(_WIN32)
+	HANDLE *tid;
+#else
+	pthread_t *tid;
+#endif
+	char *started;
+
+	if (nthreads <= 1) {
+		(*func)(arg, 0, 1);
+		return;
+	}
+	ts = (Thread_Start *)malloc(nthreads * sizeof(Thread_Start));
+	tid = malloc(nthreads * sizeof(*tid));
+	started = (char *)calloc(nthreads, 1);
+	if (!ts || !tid || !started) {
+		free(ts); free(tid); free(started);
+		for (i = 0; i < nthreads; i++)
+			(*func)(arg, i, nthreads);
+		return;
+	}
+	for (i = 0; i < nthreads; i++) {
+		ts[i].func = func;
+		ts[i].arg = arg;
+		ts[i].index = i;
+		ts[i].count = nthreads;
+	}
+	for (i = 1; i < nthreads; i++) {
+#if defined(_WIN32)
+		tid[i] = (HANDLE)_beginthreadex(NULL, 0, thread_main, &ts[i], 0, NULL);
+		started[i] = (tid[i] != 0);
+#else
+		started[i] = (pthread_create(&tid[i], NULL, thread_main, &ts[i]) == 0);
+#endif
+	}
+	(*func)(arg, 0, nthreads);
+	for (i = 1; i < nthreads; i++) {
+		if (started[i]) {
+#if defined(_WIN32)
+			WaitForSingleObject(tid[i], INFINITE);
+			CloseHandle(tid[i]);
+#else
+			pthread_join(tid[i], NULL);
+#endif
+		} else {
+			(*func)(arg, i, nthreads);
+		}
+	}
+	free(ts);
+	free(tid);
+	free(started);
+}
+
+/*
+ * the job queues for run_jobs(): the jobs that are ready to run are
+ * sorted, most costly first, and dealt out in turn to the workers, so
+ * each worker's queue is in order of cost too. A worker takes jobs from
+ * the front of its own queue; when that is empty it steals from the
+ * back (the cheapest end) of the longest queue left, so the big jobs get
+ * started early and the small ones fill in the gaps at the end. When a
+ * job finishes, the jobs waiting for it go on the front of the queue of
+ * the worker that ran it, which is the one most likely to still have
+ * its results in the cache.
+ */
+typedef struct {
+	int	nthreads;
+	int	njobs;
+	Job_Func func;
+	void	*arg;
+	int	*queue;			/* worker w's queue is the ring queue[w*njobs ...] */
+	int	*head, *count;		/* where worker w's queue starts, and how many jobs are in it */
+	int	*child, *sibling;	/* the jobs waiting for each job, as lists */
+	int	unfinished;		/* jobs not finished yet */
+} Job_Pool;
+
+static const long *sort_cost;		/* for by_cost(), under job_lock */
+
+static int
+by_cost(const void *a, const void *b)
+{
+	long ca = sort_cost[*(const int *)a];
+	long cb = sort_cost[*(const int *)b];
+
+	if (ca != cb)
+		return ca > cb ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
+}
+
+/* take a job for worker w, or return -1 if none is ready (under job_lock) */
+static int
+take_job(Job_Pool *p, int w)
+{
+	int v, victim, job;
+
+	if (p->count[w] > 0) {
+		job = p->queue[w * p->njobs + p->head[w]];
+		p->head[w] = (p->head[w] + 1) % p->njobs;
+		p->count[w]--;
+		return job;
+	}
+	victim = -1;
+	for (v = 0; v < p->nthreads; v++) {
+		if (p->count[v] > 0 && (victim < 0 || p->count[v] > p->count[victim]))
+			victim = v;
+	}
+	if (victim < 0)
+		return -1;
+	p->count[victim]--;
+	return p->queue[victim * p->njobs + (p->head[victim] + p->count[victim]) % p->njobs];
+}
+
+static void
+job_worker(void *arg, int index, int count)
+{
+	Job_Pool *p = (Job_Pool *)arg;
+	int job, c;
+
+	LOCK(job_lock);
+	for (;;) {
+		job = take_job(p, index);
+		if (job < 0) {
+			if (p->unfinished == 0)
+				break;
+			/* nothing to do until a running job finishes */
+#if defined(_WIN32)
+			SleepConditionVariableSRW(&job_ready, &job_lock, INFINITE, 0);
+#else
+			pthread_cond_wait(&job_ready, &job_lock);
+#endif
+			continue;
+		}
+		UNLOCK(job_lock);
+		(*p->func)(p->arg, index, job);
+		LOCK(job_lock);
+		p->unfinished--;
+		for (c = p->child[job]; c >= 0; c = p->sibling[c]) {
+			p->head[index] = (p->head[index] + p->njobs - 1) % p->njobs;
+			p->queue[index * p->njobs + p->head[index]] = c;
+			p->count[index]++;
+		}
+		if (p->child[job] >= 0 || p->unfinished == 0) {
+#if defined(_WIN32)
+			WakeAllConditionVariable(&job_ready);
+#else
+			pthread_cond_broadcast(&job_ready);
+#endif
+		}
+	}
+	UNLOCK(job_lock);
+}
+
+/*
+ * call func(arg, worker, job) for each job from 0 to njobs-1, using
+ * up to nthreads threads; "worker" (0 to nthreads-1) says which thread
+ * is running the job, so that each can have its own working state.
+ * cost[job] is how much work each job is, roughly (it only needs to
+ * be right relative to the others), or cost may be NULL if they are
+ * all about the same. If "after" is not NULL, job j isn't started
+ * until job after[j] has finished (or straight away if after[j] is
+ * -1); after[j] must be less than j. Like run_threads(), this never
+ * fails: without memory for the queues, the jobs are simply run one
+ * after another.
+ */
+void
+run_jobs(int nthreads, int njobs, const long *cost, const int *after, Job_Func func, void *arg)
+{
+	Job_Pool p;
+	int *order;
+	int i, n, w;
+
+	if (nthreads > njobs)
+		nthreads = njobs;
+	order = (int *)malloc((njobs + 1) * sizeof(int));
+	p.queue = (int *)malloc(((long)njobs * nthreads + 1) * sizeof(int));
+	p.head = (int *)calloc(nthreads + 1, sizeof(int));
+	p.count = (int *)calloc(nthreads + 1, sizeof(int));
+	p.child = (int *)malloc((njobs + 1) * sizeof(int));
+	p.sibling = (int *)malloc((njobs + 1) * sizeof(int));
+	if (nthreads <= 1 || !order || !p.queue || !p.head || !p.count || !p.child || !p.sibling) {
+		free(order); free(p.queue); free(p.head); free(p.count); free(p.child); free(p.sibling);
+		for (i = 0; i < njobs; i++)
+			(*func)(arg, 0, i);
+		return;
+	}
+
+	/* the jobs that can start straight away, most costly first */
+	n = 0;
+	for (i = 0; i < njobs; i++) {
+		p.child[i] = -1;
+		if (!after || after[i] < 0)
+			order[n++] = i;
+	}
+	for (i = njobs - 1; i >= 0; i--) {
+		if (after && after[i] >= 0) {
+			p.sibling[i] = p.child[after[i]];
+			p.child[after[i]] = i;
+		}
+	}
+	if (cost) {
+		LOCK(job_lock);
+		sort_cost = cost;
+		qsort(order, n, sizeof(int), by_cost);
+		UNLOCK(job_lock);
+	}
+	for (i = 0; i < n; i++) {
+		w = i % nthreads;
+		p.queue[w * njobs + p.count[w]++] = order[i];
+	}
+	free(order);
+
+	p.nthreads = nthreads;
+	p.njobs = njobs;
+	p.func = func;
+	p.arg = arg;
+	p.unfinished = njobs;
+	run_threads(nthreads, job_worker, &p);
+	free(p.queue);
+	free(p.head);
+	free(p.count);
+	free(p.child);
+	free(p.sibling);
+}